@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct Arena {
+    unsigned char* base;
+    size_t used;
+    size_t capacity;
+} Arena;
+
+
+Arena arena_create(size_t capacity);
+void* arena_alloc(Arena* arena, size_t size, size_t alignment);
+void arena_reset(Arena* arena);
+void arena_destroy(Arena* arena);
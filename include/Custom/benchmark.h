@@ -4,12 +4,31 @@
 #include "Custom/bvh.h"
 
 
-void free_bvh(BVHNode* node);
 void create_gnuplot_script(const char* data_filename);
 void run_gnuplot();
 void save_benchmark_data(const char* filename, int sphere_count, double time_no_bvh, double time_with_bvh);
 void create_gnuplot_script(const char* data_filename);
 double benchmark_no_bvh(Sphere* spheres, int num_spheres, int num_rays);
-double benchmark_with_bvh(BVHNode* root, int num_spheres, int num_rays);
+double benchmark_with_bvh(BVH* bvh, int num_spheres, int num_rays);
+void benchmark_bvh_layout(BVHNode* root, BVH* bvh, int num_rays);
+void benchmark_leaf_termination(Sphere* spheres, int num_spheres, int num_rays);
+void create_clustered_spheres(Sphere* spheres, int num_spheres, int num_clusters, float world_size, float spread);
+void benchmark_builders(Sphere* spheres, int num_spheres, int num_rays);
+void benchmark_optimize(Sphere* spheres, int num_spheres, int num_rays, int rounds);
+void benchmark_spatial_splits(Sphere* spheres, int num_spheres, int num_rays);
+void benchmark_ray_distribution(Sphere* spheres, int num_spheres, int frames);
+void benchmark_refit(Sphere* spheres, int num_spheres, int frames, int num_rays);
+void benchmark_dynamic_bvh(Sphere* spheres, int num_spheres, int num_edits, int num_rays);
+void benchmark_instancing(int copies, int object_spheres, int num_rays);
+void benchmark_wide_bvh(Sphere* spheres, int num_spheres, int num_rays);
+void benchmark_stackless(Sphere* spheres, int num_spheres);
+void benchmark_occlusion(Sphere* spheres, int num_spheres);
+void benchmark_packets(Sphere* spheres, int num_spheres);
+void benchmark_ray_stream(Sphere* spheres, int num_spheres);
+void benchmark_treelets(int max_spheres, int num_rays);
+void benchmark_tile_frustum(Sphere* spheres, int num_spheres);
+void benchmark_sphere_soa(int num_rays);
+void benchmark_cpu_dispatch(Sphere* spheres, int num_spheres);
+void benchmark_parallel_build(Sphere* spheres, int num_spheres);
 void print_sphere_info(Sphere *spheres, int num_spheres);
 void run_benchmark_with_plotting();
\ No newline at end of file
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <stdint.h>
 #include "Custom/vec3.h"
 #include "Custom/sphere.h"
 #include "Custom/ray.h"
+#include "Custom/arena.h"
 
 typedef struct AABB {
     Vec3 min;
@@ -17,6 +19,60 @@ typedef struct BVHNode {
     int sphere_count;
 } BVHNode;
 
+// Flattened node, 32 bytes. Nodes are stored depth first, so the left child of an
+// interior node is always the next node in the array.
+// axis / axis_flip order the children for traversal (bvh_assign_split_axes()): a ray whose direction
+// along axis is positive meets the left child first, unless axis_flip is set.
+typedef struct BVHFlatNode {
+    AABB bounds;
+    uint32_t right_or_first; // interior - index of the right child, leaf - index of the first sphere
+    uint32_t count : 29;     // interior - 0, leaf - number of spheres
+    uint32_t axis : 2;       // interior - axis the child centers differ most along (0 - x, 1 - y, 2 - z)
+    uint32_t axis_flip : 1;  // interior - the right child lies on the negative side along axis
+} BVHFlatNode;
+
+_Static_assert(sizeof(BVHFlatNode) == 32, "BVHFlatNode must stay 32 bytes");
+
+// Linear BVH used for traversal, nodes and this struct live in one arena
+typedef struct BVH {
+    BVHFlatNode* nodes;
+    int node_count;
+    Sphere* spheres;
+    int sphere_count;
+    int owns_spheres; // spheres live in the arena (bvh_allocate_owned), not in the caller's array
+    Arena arena;
+} BVH;
+
+typedef enum BVHBuilder {
+    BVH_BUILDER_SAH,  // top-down binned SAH (build_bvh_node)
+    BVH_BUILDER_LBVH, // Morton code linear BVH (lbvh.c)
+    BVH_BUILDER_PLOC, // bottom-up locally-ordered clustering (ploc.c)
+    BVH_BUILDER_SBVH, // binned SAH with spatial splits, spheres may be referenced by several leaves (sbvh.c)
+    BVH_BUILDER_RSAH, // binned SAH weighted by sampled camera rays (rsah.c)
+    BVH_BUILDER_COUNT
+} BVHBuilder;
+
+typedef struct BVHBuildConfig {
+    BVHBuilder builder;
+    int bin_count;
+    float traversal_cost;
+    float intersection_cost;
+    int thread_count;             // 0 - all available threads, 1 - serial build
+    int parallel_threshold;       // minimum spheres for building a subtree as a separate task
+    int parallel_split_threshold; // minimum spheres for chunked binning and partition of a node
+    int max_leaf_size;            // most spheres a leaf may hold when SAH prefers not to split
+    int morton_bits;              // LBVH / PLOC Morton code length, 30 or 63
+    int ploc_radius;              // PLOC nearest neighbour search radius (clusters on each side)
+    int optimize_rounds;          // treelet restructuring passes after the build, 0 - off
+    float spatial_split_alpha;    // SBVH tries spatial splits when child overlap / root area exceeds this
+    float duplication_budget;     // SBVH extra sphere references allowed, as a fraction of the sphere count
+    const Ray* sample_rays;       // RSAH ray sample, owned by the caller, NULL - plain SAH weights
+    int sample_ray_count;
+    float ray_weight;             // RSAH share of the ray hit ratio in the child weight (the rest is SA)
+    float rebuild_growth;         // refit : rebuild the whole tree when its SAH cost grows by this factor
+    float subtree_rebuild_growth; // refit : rebuild a subtree when its own SAH cost grows by this factor
+} BVHBuildConfig;
+
 
 AABB create_empty_aabb();
 AABB create_aabb_from_sphere(Sphere* sphere);
@@ -24,4 +80,20 @@ AABB combine_aabb(AABB a, AABB b);
 float get_aabb_surface_area(AABB box);
 float evaluate_sah(Sphere* spheres, int start, int end, int axis, float split);
 BVHNode* build_bvh_node(Sphere* spheres, int start, int end, int depth);
+BVHNode* build_bvh_node_grid(Sphere* spheres, int start, int end, int depth);
+BVHBuildConfig bvh_default_build_config();
+BVHBuildConfig bvh_get_build_config();
+void bvh_set_build_config(BVHBuildConfig config);
+float bvh_sah_cost(BVHNode* root);
+int bvh_count_nodes(BVHNode* node);
+void free_bvh(BVHNode* node);
+BVH* bvh_allocate(Sphere* spheres, int num_spheres, int node_count);
+BVH* bvh_allocate_owned(int num_spheres, int node_count);
+void bvh_assign_split_axes(BVHFlatNode* nodes, int node_count);
+BVH* bvh_flatten(BVHNode* root, Sphere* spheres, int num_spheres);
+BVH* bvh_build(Sphere* spheres, int num_spheres);
+void bvh_free(BVH* bvh);
+float bvh_flat_sah_cost(const BVH* bvh);
+float bvh_flat_overlap(const BVH* bvh);
+const char* bvh_builder_name(BVHBuilder builder);
 
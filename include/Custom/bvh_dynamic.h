@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Custom/sphere.h"
+#include "Custom/bvh.h"
+
+typedef struct DynamicBVHNode {
+    AABB bounds;
+    int parent;  // -1 for the root, next free node for nodes on the free list
+    int child1;  // -1 for leaves
+    int child2;
+    int height;  // 0 for leaves, -1 for free nodes
+    Sphere sphere; // leaves only
+} DynamicBVHNode;
+
+// Pointer-free binary tree with one sphere per leaf, spheres are inserted, removed and moved one at
+// a time. Handles are leaf node indices and stay valid until the sphere is removed.
+typedef struct DynamicBVH {
+    DynamicBVHNode* nodes;
+    int capacity;
+    int free_list;
+    int root;         // -1 when empty
+    int sphere_count;
+    long long rotations; // rotations applied since creation
+    BVH* flat;        // depth first copy for ray_bvh_intersect(), written by bvh_dynamic_flat()
+    int flat_capacity; // spheres the flat copy has room for
+    int flat_dirty;
+} DynamicBVH;
+
+
+DynamicBVH* bvh_dynamic_create(int capacity);
+int bvh_dynamic_insert(DynamicBVH* tree, Sphere sphere);
+void bvh_dynamic_remove(DynamicBVH* tree, int handle);
+void bvh_dynamic_update(DynamicBVH* tree, int handle, Sphere sphere);
+const BVH* bvh_dynamic_flat(DynamicBVH* tree);
+int bvh_dynamic_height(const DynamicBVH* tree);
+void bvh_dynamic_destroy(DynamicBVH* tree);
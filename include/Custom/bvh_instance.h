@@ -0,0 +1,41 @@
+#pragma once
+
+#include "Custom/vec3.h"
+#include "Custom/bvh.h"
+
+// Affine transform, p' = m[.][0..2] * p + m[.][3] (row major 3x4)
+typedef struct Transform {
+    float m[3][4];
+} Transform;
+
+// One placement of a shared bottom-level BVH (built in object space) in the scene
+typedef struct Instance {
+    const BVH* blas;            // owned by the caller, any number of instances may share it
+    Transform object_to_world;
+    Transform world_to_object;
+    AABB bounds;                // world space bounds of the transformed BLAS root
+} Instance;
+
+// Top-level BVH over instances, same node layout as BVH. Leaves index the TLAS's own
+// (reordered) copy of the instances. The struct, nodes and instances live in one arena.
+typedef struct TLAS {
+    BVHFlatNode* nodes;
+    int node_count;
+    Instance* instances;
+    int instance_count;
+    Arena arena;
+} TLAS;
+
+
+Transform transform_identity();
+Transform transform_translate(Vec3 offset);
+Transform transform_scale(Vec3 scale);
+Transform transform_rotate(Vec3 axis, float angle);
+Transform transform_multiply(Transform a, Transform b);
+Transform transform_inverse(Transform t);
+Vec3 transform_point(const Transform* t, Vec3 p);
+Vec3 transform_vector(const Transform* t, Vec3 v);
+Vec3 transform_normal(const Transform* world_to_object, Vec3 n);
+Instance instance_create(const BVH* blas, Transform object_to_world);
+TLAS* tlas_build(const Instance* instances, int instance_count);
+void tlas_free(TLAS* tlas);
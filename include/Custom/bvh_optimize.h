@@ -0,0 +1,6 @@
+#pragma once
+
+#include "Custom/bvh.h"
+
+
+void bvh_optimize(BVH* bvh, int rounds);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "Custom/bvh.h"
+
+typedef struct BVHRefitter {
+    BVH* bvh;          // owned, replaced when subtrees are rebuilt
+    float* sah;        // per node, SAH cost of the subtree (sum of Ct * SA and Ci * n * SA, not normalised)
+    float* build_sah;  // the same right after the last (re)build of the node
+} BVHRefitter;
+
+typedef struct BVHRefitStats {
+    float sah_cost;       // SAH cost of the tree after the update
+    float growth;         // SAH cost of the refitted tree / SAH cost after the last rebuild (not normalised)
+    int rebuilt_subtrees; // 0 - refit only
+    int full_rebuild;     // the whole tree was rebuilt
+    int rebuilt_spheres;  // spheres in the rebuilt subtrees
+} BVHRefitStats;
+
+
+float bvh_refit(BVH* bvh);
+BVHRefitter* bvh_refitter_create(BVH* bvh);
+BVHRefitStats bvh_refitter_update(BVHRefitter* refitter);
+void bvh_refitter_destroy(BVHRefitter* refitter);
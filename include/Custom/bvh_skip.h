@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include "Custom/bvh.h"
+
+// Depth first node with a skip link (rope) instead of a right child. A hit interior node continues
+// at the next node, a missed node or a finished leaf continues at skip. skip of the last subtree on
+// the way back to the root is node_count, which ends the walk. 32 bytes like BVHFlatNode.
+typedef struct BVHSkipNode {
+    AABB bounds;
+    uint32_t skip;
+    uint32_t first : 24; // leaf - index of the first sphere
+    uint32_t count : 8;  // interior - 0, leaf - number of spheres
+} BVHSkipNode;
+
+_Static_assert(sizeof(BVHSkipNode) == 32, "BVHSkipNode must stay 32 bytes");
+
+// Skip link copy of a linear BVH, shares the linear BVH's sphere array
+typedef struct BVHSkip {
+    BVHSkipNode* nodes;
+    int node_count;
+    Sphere* spheres;
+    int sphere_count;
+    Arena arena;
+} BVHSkip;
+
+
+BVHSkip* bvh_skip_build(const BVH* bvh);
+void bvh_skip_free(BVHSkip* skip);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "Custom/bvh.h"
+#include "Custom/hit.h"
+
+// Cache sized pieces of a linear BVH. treelet_of maps every node of the linear BVH to its treelet,
+// bytes is the node and sphere data of every treelet (node_count entries, treelet_count used).
+typedef struct BVHTreelets {
+    const BVH* bvh;
+    uint32_t* treelet_of;
+    size_t* bytes;
+    int treelet_count;
+    int max_depth; // deepest node, the pending far children of a ray never exceed it
+    Arena arena;
+} BVHTreelets;
+
+typedef struct {
+    long long queue_runs;    // treelet queues processed (treelet data loaded)
+    long long ray_entries;   // rays taken out of a queue
+    long long treelet_bytes; // treelet data of all queue runs
+} TreeletStats;
+
+
+BVHTreelets* bvh_treelets_build(const BVH* bvh, size_t treelet_bytes);
+void bvh_treelets_free(BVHTreelets* treelets);
+void ray_treelet_intersect(const BVHTreelets* treelets, const Ray* rays, int count, HitRecord* hits, TreeletStats* stats);
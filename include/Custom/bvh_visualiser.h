@@ -6,8 +6,8 @@
 
 
 
-void draw_bvh_recursive(SDL_Renderer* renderer, BVHNode* node, Camera* camera, 
+void draw_bvh_recursive(SDL_Renderer* renderer, const BVH* bvh, uint32_t index, Camera* camera, 
                        int screen_width, int screen_height, int depth);
-void render_debug_visualization(SDL_Renderer* renderer, BVHNode* root, Camera* camera);
+void render_debug_visualization(SDL_Renderer* renderer, const BVH* bvh, Camera* camera);
 void draw_camera_debug(SDL_Renderer* renderer, Camera* camera, int screen_width, int screen_height);
 
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include "Custom/bvh.h"
+#include "Custom/hit.h"
+
+// Wide nodes keep the bounds of all children in SoA form, rows are min x, y, z, max x, y, z.
+// count is 0 for an interior child (child = node index) and the sphere count for a leaf child
+// (child = first sphere). Unused slots have inverted (empty) bounds, so they are never hit.
+typedef struct BVH4Node {
+    float bounds[6][4];
+    uint32_t child[4];
+    uint32_t count[4];
+} BVH4Node;
+
+typedef struct BVH8Node {
+    float bounds[6][8];
+    uint32_t child[8];
+    uint32_t count[8];
+} BVH8Node;
+
+// BVH8 node with the child bounds quantized to 8 bits inside the node's own box. A child's bounds
+// decode to origin + q * 2^exponent per axis and are rounded outwards, so they always contain the
+// exact bounds. Counts are bytes, leaves of more than 255 spheres can not be stored.
+typedef struct BVH8QNode {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t pad;
+    uint8_t bounds[6][8];
+    uint32_t child[8];
+    uint8_t count[8];
+} BVH8QNode;
+
+_Static_assert(sizeof(BVH4Node) == 128, "BVH4Node must stay two cache lines");
+_Static_assert(sizeof(BVH8Node) == 256, "BVH8Node must stay four cache lines");
+_Static_assert(sizeof(BVH8QNode) == 104, "BVH8QNode must stay 104 bytes");
+
+// BVH4 / BVH8 / quantized BVH8 collapsed from a binary BVH, shares the binary BVH's sphere array
+typedef struct BVHWide {
+    int width;     // 4 or 8
+    int quantized; // 8 wide only, nodes8q
+    union {
+        BVH4Node* nodes4;
+        BVH8Node* nodes8;
+        BVH8QNode* nodes8q;
+    };
+    int node_count;
+    Sphere* spheres;
+    int sphere_count;
+    Arena arena;
+} BVHWide;
+
+
+BVHWide* bvh_wide_build(const BVH* bvh, int width);
+BVHWide* bvh_wide_build_quantized(const BVH* bvh);
+size_t bvh_wide_node_size(const BVHWide* wide);
+void bvh_wide_free(BVHWide* wide);
+HitRecord ray_bvh_wide_intersect(Ray ray, const BVHWide* wide);
+const char* bvh_wide_simd_path(int width);
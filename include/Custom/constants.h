@@ -7,3 +7,78 @@
 #define WIDTH 800
 #define HEIGHT 600
 
+// Vector math (see vec3.h), Newton-Raphson steps after the hardware reciprocal / rsqrt estimate:
+// 0 - about 12 bits, 1 - about 23 bits, -1 - exact division and square root
+#define VEC3_NEWTON_STEPS 1
+
+// Binned SAH BVH construction (see bvh.c)
+#define BVH_SAH_BINS 16
+#define BVH_MAX_SAH_BINS 64
+#define BVH_TRAVERSAL_COST 4.0f // two child slab tests, each ~1.5-2x a sphere test
+#define BVH_INTERSECTION_COST 1.0f
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_MAX_LEAF_LIMIT 64
+
+// Parallel BVH construction (needs OpenMP, see Makefile)
+#define BVH_BUILD_THREADS 0
+#define BVH_PARALLEL_THRESHOLD 4096
+#define BVH_PARALLEL_SPLIT_THRESHOLD 262144
+#define BVH_PARALLEL_CHUNK 32768
+
+// Morton code linear BVH construction (see lbvh.c)
+#define LBVH_MORTON_BITS 63
+#define LBVH_SORT_CHUNK 65536
+
+// Locally-ordered clustering BVH construction (see ploc.c)
+#define PLOC_SEARCH_RADIUS 16
+#define PLOC_CHUNK 65536
+
+// Post-build treelet optimization (see bvh_optimize.c)
+#define BVH_OPTIMIZE_ROUNDS 0
+#define BVH_TREELET_LEAVES 7
+
+// Spatial split BVH construction (see sbvh.c)
+#define SBVH_SPATIAL_SPLIT_ALPHA 1e-5f
+#define SBVH_DUPLICATION_BUDGET 0.3f
+#define SBVH_MAX_DEPTH 64
+
+// Ray distribution aware SAH construction (see rsah.c)
+#define RSAH_RAY_WEIGHT 0.9f
+#define RSAH_SAMPLE_COLUMNS 80
+#define RSAH_SAMPLE_ROWS 60
+#define RSAH_MAX_NODE_RAYS 1024
+#define RSAH_RAY_FILE "rsah_rays.txt"
+
+// BVH refit for moving spheres (see bvh_refit.c)
+#define BVH_REFIT_REBUILD_GROWTH 1.2f
+#define BVH_REFIT_SUBTREE_GROWTH 1.3f
+#define BVH_REFIT_TASK_NODES 8192
+
+// Wide BVH traversal (see bvh_wide.c)
+#define BVH_WIDE_STACK_SIZE 512
+
+// Ordered linear BVH traversal (see hit.c), deeper trees fall back to a nested walk
+#define BVH_TRAVERSAL_STACK_SIZE 64
+
+// Treelet ray queues (see bvh_treelet.c), node and sphere bytes per treelet, rays queued at once
+#define BVH_TREELET_BYTES (512 * 1024)
+#define BVH_TREELET_BATCH 65536
+
+// Ray packets (see ray_packet.c), the renderer traces primary rays in blocks of
+// RAY_BLOCK_WIDTH x RAY_BLOCK_HEIGHT pixels, at most RAY_PACKET_MAX rays
+#define RAY_PACKET_MAX 16
+#define RAY_BLOCK_WIDTH 4
+#define RAY_BLOCK_HEIGHT 4
+
+// Tile frustum culling (see tile_frustum.c), tiles of RAY_TILE_SIZE x RAY_TILE_SIZE pixels (a multiple
+// of the ray blocks) start their primary rays at up to TILE_CUT_MAX subtree roots
+#define RAY_TILE_SIZE 16
+#define TILE_CUT_MAX 8
+
+// SoA spheres (see sphere_soa.c), entries past the last sphere for whole SIMD groups, and the
+// smallest BVH leaf tested with the SoA kernel instead of the scalar loop
+#define SPHERE_SOA_PAD 16
+#define SPHERE_SOA_MIN_LEAF 4
+
+// Ray streams (see ray_stream.c), origin cells per axis of the sort key as bits (at most 10)
+#define RAY_STREAM_CELL_BITS 8
@@ -0,0 +1,36 @@
+#pragma once
+
+// Instruction set paths of the SIMD kernels (sphere_soa.c, hit.c, ray_packet.c, bvh_wide.c, framebuffer.c),
+// from the most portable to the widest
+typedef enum CpuPath {
+    CPU_PATH_SCALAR,
+    CPU_PATH_SSE2,
+    CPU_PATH_AVX2,
+    CPU_PATH_AVX512,
+    CPU_PATH_COUNT
+} CpuPath;
+
+// x86-64 GCC / clang builds compile every path into the one binary, the functions of a wider path
+// carry its target attribute. AVX-512F brings its own fused multiply-add instructions (GCC uses them
+// without defining __FMA__, clang also turns on FMA), a * b + c must not be contracted into them or
+// the AVX-512 kernels would round differently. GCC gets fp-contract=off on those functions, clang's
+// default contraction within an expression is switched off for every file including this header,
+// so the kernels give the same floats on every path.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CPU_DISPATCH_X86 1
+#define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#define CPU_TARGET_AVX512 __attribute__((target("avx2,avx512f")))
+#else
+#define CPU_TARGET_AVX512 __attribute__((target("avx2,avx512f"), optimize("fp-contract=off")))
+#endif
+#endif
+
+
+CpuPath cpu_detect_path();
+CpuPath cpu_get_path();
+int cpu_set_path(CpuPath path);
+int cpu_path_supported(CpuPath path);
+const char* cpu_path_name(CpuPath path);
+int cpu_path_parse(const char* name, CpuPath* path);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+
+// Accumulation buffer entries are 4 floats (r, g, b, a) per pixel, colors in [0, 1]
+void framebuffer_accumulate(float* accumulation, const SDL_Color* colors, int count, int frames, SDL_Color* out);
@@ -4,6 +4,10 @@
 #include "ray.h"
 #include "sphere.h"
 #include "bvh.h"
+#include "bvh_instance.h"
+#include "bvh_skip.h"
+#include "sphere_soa.h"
+#include "constants.h"
 
 typedef struct {
     float t;
@@ -13,6 +17,49 @@ typedef struct {
     Sphere *object;
 } HitRecord;
 
+typedef struct {
+    long long node_visits;
+    long long sphere_tests;
+} TraversalStats;
+
 HitRecord ray_sphere_intersect(Ray ray, Sphere *sphere);
+HitRecord ray_sphere_intersect_range(Ray ray, Sphere *sphere, float t_min, float t_max);
+int ray_sphere_hit_t(Ray ray, const Sphere *sphere, float t_min, float t_max, float *t);
+HitRecord ray_sphere_hit_record(Ray ray, Sphere *sphere, float t);
+int ray_sphere_occludes(Ray ray, const Sphere *sphere, float t_min, float t_max);
 int ray_aabb_intersect(Ray ray, AABB box);
-HitRecord ray_bvh_intersect(Ray ray, BVHNode* node);
\ No newline at end of file
+int ray_aabb_intersect_range(Ray ray, AABB box, float t_min, float t_max);
+HitRecord ray_bvh_node_intersect(Ray ray, BVHNode* node);
+HitRecord ray_bvh_intersect(Ray ray, const BVH* bvh);
+HitRecord ray_bvh_intersect_range(Ray ray, const BVH* bvh, float t_min, float t_max);
+HitRecord ray_bvh_intersect_soa(Ray ray, const BVH* bvh, const SphereSoA* soa);
+HitRecord ray_spheres_closest_soa(Ray ray, Sphere* spheres, const SphereSoA* soa);
+HitRecord ray_bvh_intersect_subtrees(Ray ray, const BVH* bvh, const uint32_t* roots, int root_count);
+HitRecord ray_bvh_intersect_stats(Ray ray, const BVH* bvh, TraversalStats* stats);
+int ray_bvh_occluded(Ray ray, const BVH* bvh, float t_min, float t_max);
+int ray_spheres_occluded(Ray ray, const Sphere* spheres, int num_spheres, float t_min, float t_max);
+HitRecord ray_bvh_skip_intersect(Ray ray, const BVHSkip* skip);
+HitRecord ray_bvh_skip_intersect_range(Ray ray, const BVHSkip* skip, float t_min, float t_max);
+HitRecord ray_tlas_intersect(Ray ray, const TLAS* tlas);
+
+// Slab tests with a precomputed inverse direction (ray packets, treelets, wide BVHs)
+// A zero component gets a huge finite inverse, 0 * inf would be NaN for boxes touching the origin.
+// The inverse is vec3_rcp(), to VEC3_NEWTON_STEPS precision.
+static inline float ray_inv_direction(float direction) {
+    return vec3_rcp(direction != 0.0f ? direction : 1e-30f);
+}
+
+// 1 if the ray enters the box before t_max and leaves it past EPSILON
+static inline int ray_aabb_slabs_inv(const float origin[3], const float inv_direction[3], const AABB* box,
+                                     float t_max) {
+    const float min[3] = {box->min.x, box->min.y, box->min.z};
+    const float max[3] = {box->max.x, box->max.y, box->max.z};
+    float enter = -INFINITY, exit = INFINITY;
+    for (int axis = 0; axis < 3; axis++) {
+        float t0 = (min[axis] - origin[axis]) * inv_direction[axis];
+        float t1 = (max[axis] - origin[axis]) * inv_direction[axis];
+        enter = fmaxf(enter, fminf(t0, t1));
+        exit = fminf(exit, fmaxf(t0, t1));
+    }
+    return exit >= enter && exit > EPSILON && enter <= t_max;
+}
\ No newline at end of file
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include "Custom/sphere.h"
+#include "Custom/bvh.h"
+
+
+uint64_t morton_encode(uint32_t x, uint32_t y, uint32_t z, int bits);
+void compute_morton_codes(Sphere* spheres, int num_spheres, int bits, uint64_t* codes, uint32_t* indices);
+int radix_sort_chunk_count(int count);
+void radix_sort_morton_buffers(uint64_t* keys, uint32_t* values, int count, int key_bits,
+                               uint64_t* key_buffer, uint32_t* value_buffer, uint32_t (*histograms)[256]);
+void radix_sort_morton(uint64_t* keys, uint32_t* values, int count, int key_bits);
+BVH* lbvh_build(Sphere* spheres, int num_spheres);
@@ -9,4 +9,5 @@ typedef struct {
 
 
 Ray get_camera_ray(Camera *camera, float u, float v);
+void get_camera_rays(Camera *camera, const float *u, const float *v, int count, Ray *rays);
 
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "Custom/bvh.h"
+#include "Custom/hit.h"
+
+
+void ray_packet_intersect(const Ray* rays, int count, const BVH* bvh, const SphereSoA* soa, HitRecord* hits);
+void ray_packet_intersect_subtrees(const Ray* rays, int count, const BVH* bvh, const SphereSoA* soa,
+                                   const uint32_t* roots, int root_count, HitRecord* hits);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include "Custom/ray.h"
+#include "Custom/bvh.h"
+
+// Work arrays of ray_stream_sort() for up to capacity rays, allocated once by the caller (FrameStream)
+typedef struct RayStreamScratch {
+    uint64_t* keys;
+    uint32_t* order;
+    uint64_t* key_buffer;
+    uint32_t* value_buffer;
+    uint32_t (*histograms)[256];
+    Ray* sorted_rays;
+    int capacity;
+} RayStreamScratch;
+
+
+RayStreamScratch* ray_stream_scratch_create(int capacity);
+void ray_stream_scratch_free(RayStreamScratch* scratch);
+void ray_stream_sort(Ray* rays, uint32_t* ids, int count, AABB bounds, RayStreamScratch* scratch);
@@ -4,5 +4,27 @@
 #include "Custom/ray.h"
 #include "Custom/sphere.h"
 #include "Custom/bvh.h"
+#include "Custom/tile_frustum.h"
+#include "Custom/sphere_soa.h"
+#include "Custom/ray_stream.h"
 
-SDL_Color trace_ray(Ray ray, Sphere *spheres, int num_spheres, int depth, BVHNode* bvh);
\ No newline at end of file
+// Work arrays of trace_frame_stream() for up to capacity primary rays and depth bounces, allocated
+// once next to the frame buffers instead of every frame
+typedef struct FrameStream {
+    Ray* rays;
+    uint32_t* ids;
+    SDL_Color* base_colors;
+    int* hit_count;
+    RayStreamScratch* sort;
+    int capacity;
+    int depth;
+} FrameStream;
+
+
+FrameStream* frame_stream_create(int capacity, int depth);
+void frame_stream_free(FrameStream* stream);
+SDL_Color trace_ray(Ray ray, Sphere *spheres, int num_spheres, int depth, const BVH* bvh, const SphereSoA* soa);
+void trace_ray_packet(const Ray* rays, int count, Sphere* spheres, int num_spheres, int depth, const BVH* bvh,
+                      const SphereSoA* soa, const TileCut* cut, SDL_Color* colors);
+void trace_frame_stream(const Ray* rays, int count, Sphere* spheres, int num_spheres, int depth, const BVH* bvh,
+                        const SphereSoA* soa, FrameStream* stream, SDL_Color* colors);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "Custom/sphere.h"
+#include "Custom/camera.h"
+#include "Custom/ray.h"
+#include "Custom/bvh.h"
+
+
+BVH* rsah_build(Sphere* spheres, int num_spheres);
+Ray* rsah_sample_camera_rays(Camera* camera, int columns, int rows);
+Ray* rsah_load_rays(const char* path, int* num_rays);
+int rsah_save_rays(const char* path, const Ray* rays, int num_rays);
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "Custom/sphere.h"
+#include "Custom/bvh.h"
+
+
+BVH* sbvh_build(Sphere* spheres, int num_spheres);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "Custom/sphere.h"
+#include "Custom/ray.h"
+
+// Sphere centers and squared radii in separate arrays, in the order of the sphere array they were
+// built from. Arrays hold SPHERE_SOA_PAD entries past count, so kernels may read whole SIMD groups.
+typedef struct SphereSoA {
+    float* center_x;
+    float* center_y;
+    float* center_z;
+    float* radius2;
+    int count;
+} SphereSoA;
+
+
+SphereSoA* sphere_soa_build(const Sphere* spheres, int num_spheres);
+void sphere_soa_free(SphereSoA* soa);
+int sphere_soa_closest(const SphereSoA* soa, Ray ray, int first, int count, float t_min, float* t_max);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include "Custom/bvh.h"
+#include "Custom/camera.h"
+#include "Custom/constants.h"
+
+// Roots of the BVH subtrees a screen tile's frustum can reach, front to back for the tile center.
+// The closest hit of a ray inside the frustum is the closest hit over these subtrees.
+typedef struct TileCut {
+    uint32_t roots[TILE_CUT_MAX];
+    int count;
+} TileCut;
+
+
+void tile_cut_build(const BVH* bvh, Camera* camera, float u0, float v0, float u1, float v1, TileCut* cut);
@@ -1,19 +1,223 @@
 #pragma once
 
+#include <math.h>
+#include "Custom/constants.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The helpers are defined here so every call in the hot loops is inlined, also in builds without
+// optimization (the Makefile's). Float only, no round trips through double.
+#if defined(__GNUC__)
+#define VEC3_INLINE static inline __attribute__((always_inline))
+#else
+#define VEC3_INLINE static inline
+#endif
+
 typedef struct Vec3{
     float x;
     float y;
     float z;
 } Vec3;
 
+// Vec3 in one 16 byte aligned SIMD register (x, y, z, 0) on SSE2 targets, 4 aligned floats otherwise.
+// Vec3 itself stays 12 bytes, it is part of AABB, Ray and Sphere and the 32 byte BVH nodes.
+#if defined(__SSE2__)
+typedef __m128 Vec3A;
+#else
+typedef struct Vec3A {
+    _Alignas(16) float v[4];
+} Vec3A;
+#endif
+
 
-Vec3 vec3_sub(Vec3 a, Vec3 b);
-Vec3 vec3_normalize(Vec3 a);
-float vec3_dot(Vec3 a, Vec3 b);
-Vec3 vec3_add(Vec3 a, Vec3 b);
-Vec3 vec3_multiply(Vec3 v, float t);
-Vec3 vec3_cross(Vec3 a, Vec3 b);
-Vec3 vec3_reflect(Vec3 v, Vec3 n);
-Vec3 vec3_refract(Vec3 uv, Vec3 n, float etai_over_etat);
 Vec3 vec3_random(float min, float max);
-float vec3_len(Vec3 a);
+void vec3_normalize_array(Vec3* v, int count);
+
+//--------------------------------------------------------------------------------------------------
+
+// Vec3
+
+//--------------------------------------------------------------------------------------------------
+
+VEC3_INLINE Vec3 vec3_sub(Vec3 a, Vec3 b){
+    return (Vec3){a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+VEC3_INLINE Vec3 vec3_add(Vec3 a, Vec3 b){
+    return (Vec3){a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+VEC3_INLINE Vec3 vec3_multiply(Vec3 v, float t){
+    return (Vec3){v.x * t, v.y * t, v.z * t};
+}
+
+VEC3_INLINE float vec3_dot(Vec3 a, Vec3 b){
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+VEC3_INLINE Vec3 vec3_cross(Vec3 a, Vec3 b){
+    return (Vec3){
+        a.y * b.z - a.z * b.y,
+        a.z * b.x - a.x * b.z,
+        a.x * b.y - a.y * b.x
+    };
+}
+
+VEC3_INLINE float vec3_len(Vec3 a){
+    return sqrtf(a.x * a.x + a.y * a.y + a.z * a.z);
+}
+
+VEC3_INLINE Vec3 vec3_normalize(Vec3 a){
+    float len = sqrtf(a.x * a.x + a.y * a.y + a.z * a.z);
+    return (len != 0) ? (Vec3){a.x / len, a.y / len, a.z / len} : (Vec3){0, 0, 0};
+}
+
+VEC3_INLINE Vec3 vec3_reflect(Vec3 v, Vec3 n){
+    float dot = vec3_dot(v, n);
+    return vec3_sub(v, vec3_multiply(n, 2 * dot));
+}
+
+VEC3_INLINE Vec3 vec3_refract(Vec3 uv, Vec3 n, float etai_over_etat){
+    float cos_theta = fminf(vec3_dot(vec3_multiply(uv, -1), n), 1.0f);
+    Vec3 r_out_perp = vec3_multiply(vec3_add(uv, vec3_multiply(n, cos_theta)), etai_over_etat);
+    Vec3 r_out_parallel = vec3_multiply(n, -sqrtf(fabsf(1.0f - vec3_dot(r_out_perp, r_out_perp))));
+    return vec3_add(r_out_perp, r_out_parallel);
+}
+
+VEC3_INLINE float vec3_axis(Vec3 v, int axis){
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Fast reciprocal and reciprocal square root
+// The hardware estimates (about 12 bits) refined by VEC3_NEWTON_STEPS Newton-Raphson steps, each
+// about doubles the bits, or the exact division / square root for VEC3_NEWTON_STEPS < 0.
+// For results that do not need the last bits, e.g. diffuse bounce directions and the inverse ray
+// directions of slab tests.
+
+//--------------------------------------------------------------------------------------------------
+
+VEC3_INLINE float vec3_rcp(float x){
+#if defined(__SSE2__)
+    if (VEC3_NEWTON_STEPS >= 0) {
+        float r = _mm_cvtss_f32(_mm_rcp_ss(_mm_set_ss(x)));
+        for (int i = 0; i < VEC3_NEWTON_STEPS; i++)
+            r = r * (2.0f - x * r);
+        return r;
+    }
+#endif
+    return 1.0f / x;
+}
+
+VEC3_INLINE float vec3_rsqrt(float x){
+#if defined(__SSE2__)
+    if (VEC3_NEWTON_STEPS >= 0) {
+        float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+        for (int i = 0; i < VEC3_NEWTON_STEPS; i++)
+            r = r * (1.5f - 0.5f * x * r * r);
+        return r;
+    }
+#endif
+    return 1.0f / sqrtf(x);
+}
+
+// vec3_normalize() to the precision of vec3_rsqrt()
+VEC3_INLINE Vec3 vec3_normalize_fast(Vec3 a){
+    float len2 = a.x * a.x + a.y * a.y + a.z * a.z;
+    return len2 != 0 ? vec3_multiply(a, vec3_rsqrt(len2)) : (Vec3){0, 0, 0};
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Vec3A
+// The same float operations as the Vec3 helpers, lane by lane, so results match them exactly.
+
+//--------------------------------------------------------------------------------------------------
+
+#if defined(__SSE2__)
+
+VEC3_INLINE Vec3A vec3a_load(Vec3 v){
+    return _mm_setr_ps(v.x, v.y, v.z, 0.0f);
+}
+
+VEC3_INLINE Vec3A vec3a_set1(float s){
+    return _mm_set1_ps(s);
+}
+
+VEC3_INLINE Vec3 vec3a_store(Vec3A a){
+    _Alignas(16) float v[4];
+    _mm_store_ps(v, a);
+    return (Vec3){v[0], v[1], v[2]};
+}
+
+VEC3_INLINE Vec3A vec3a_add(Vec3A a, Vec3A b){ return _mm_add_ps(a, b); }
+VEC3_INLINE Vec3A vec3a_sub(Vec3A a, Vec3A b){ return _mm_sub_ps(a, b); }
+VEC3_INLINE Vec3A vec3a_mul(Vec3A a, Vec3A b){ return _mm_mul_ps(a, b); }
+VEC3_INLINE Vec3A vec3a_div(Vec3A a, Vec3A b){ return _mm_div_ps(a, b); }
+VEC3_INLINE Vec3A vec3a_min(Vec3A a, Vec3A b){ return _mm_min_ps(a, b); }
+VEC3_INLINE Vec3A vec3a_max(Vec3A a, Vec3A b){ return _mm_max_ps(a, b); }
+
+// Lanes of where that are 0 take if_zero, the others otherwise
+VEC3_INLINE Vec3A vec3a_select_zero(Vec3A where, Vec3A if_zero, Vec3A otherwise){
+    __m128 zero = _mm_cmpeq_ps(where, _mm_setzero_ps());
+    return _mm_or_ps(_mm_and_ps(zero, if_zero), _mm_andnot_ps(zero, otherwise));
+}
+
+// Largest / smallest of x, y and z
+VEC3_INLINE float vec3a_hmax(Vec3A a){
+    __m128 yz = _mm_max_ss(_mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1)), _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 2, 2)));
+    return _mm_cvtss_f32(_mm_max_ss(a, yz));
+}
+
+VEC3_INLINE float vec3a_hmin(Vec3A a){
+    __m128 yz = _mm_min_ss(_mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1)), _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 2, 2)));
+    return _mm_cvtss_f32(_mm_min_ss(a, yz));
+}
+
+#else
+
+VEC3_INLINE Vec3A vec3a_load(Vec3 v){
+    return (Vec3A){{v.x, v.y, v.z, 0.0f}};
+}
+
+VEC3_INLINE Vec3A vec3a_set1(float s){
+    return (Vec3A){{s, s, s, s}};
+}
+
+VEC3_INLINE Vec3 vec3a_store(Vec3A a){
+    return (Vec3){a.v[0], a.v[1], a.v[2]};
+}
+
+#define VEC3A_LANES(expression) \
+    Vec3A r; \
+    for (int i = 0; i < 4; i++) \
+        r.v[i] = (expression); \
+    return r
+
+VEC3_INLINE Vec3A vec3a_add(Vec3A a, Vec3A b){ VEC3A_LANES(a.v[i] + b.v[i]); }
+VEC3_INLINE Vec3A vec3a_sub(Vec3A a, Vec3A b){ VEC3A_LANES(a.v[i] - b.v[i]); }
+VEC3_INLINE Vec3A vec3a_mul(Vec3A a, Vec3A b){ VEC3A_LANES(a.v[i] * b.v[i]); }
+VEC3_INLINE Vec3A vec3a_div(Vec3A a, Vec3A b){ VEC3A_LANES(a.v[i] / b.v[i]); }
+VEC3_INLINE Vec3A vec3a_min(Vec3A a, Vec3A b){ VEC3A_LANES(a.v[i] < b.v[i] ? a.v[i] : b.v[i]); }
+VEC3_INLINE Vec3A vec3a_max(Vec3A a, Vec3A b){ VEC3A_LANES(a.v[i] > b.v[i] ? a.v[i] : b.v[i]); }
+
+VEC3_INLINE Vec3A vec3a_select_zero(Vec3A where, Vec3A if_zero, Vec3A otherwise){
+    VEC3A_LANES(where.v[i] == 0.0f ? if_zero.v[i] : otherwise.v[i]);
+}
+
+VEC3_INLINE float vec3a_hmax(Vec3A a){
+    float yz = a.v[1] > a.v[2] ? a.v[1] : a.v[2];
+    return a.v[0] > yz ? a.v[0] : yz;
+}
+
+VEC3_INLINE float vec3a_hmin(Vec3A a){
+    float yz = a.v[1] < a.v[2] ? a.v[1] : a.v[2];
+    return a.v[0] < yz ? a.v[0] : yz;
+}
+
+#undef VEC3A_LANES
+
+#endif
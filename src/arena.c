@@ -0,0 +1,46 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "Custom/arena.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Linear (bump) allocator
+// One malloc holds every allocation made from the arena, allocations just move the 'used' offset.
+// Nothing is freed individually, the whole arena is reset or destroyed in O(1).
+// Used for the flattened BVH node array, so that tearing down a tree is a single free.
+
+//----------------------------------------------------------------------------------------------------
+
+Arena arena_create(size_t capacity)
+{
+    Arena arena = {0};
+    arena.base = (unsigned char *)malloc(capacity);
+    if (arena.base)
+        arena.capacity = capacity;
+    return arena;
+}
+
+// Returns NULL if the arena has no room left (alignment must be a power of two)
+void *arena_alloc(Arena *arena, size_t size, size_t alignment)
+{
+    uintptr_t address = (uintptr_t)arena->base + arena->used;
+    size_t padding = (alignment - (address & (alignment - 1))) & (alignment - 1);
+
+    if (arena->used + padding + size > arena->capacity)
+        return NULL;
+
+    arena->used += padding + size;
+    return (void *)(address + padding);
+}
+
+void arena_reset(Arena *arena)
+{
+    arena->used = 0;
+}
+
+void arena_destroy(Arena *arena)
+{
+    free(arena->base);
+    arena->base = NULL;
+    arena->used = arena->capacity = 0;
+}
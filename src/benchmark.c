@@ -2,12 +2,32 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <SDL2/SDL_image.h>
 #include "Custom/benchmark.h"
 #include "Custom/hit.h"
+#include "Custom/bvh_optimize.h"
+#include "Custom/rsah.h"
+#include "Custom/bvh_refit.h"
+#include "Custom/bvh_dynamic.h"
+#include "Custom/bvh_wide.h"
+#include "Custom/bvh_skip.h"
+#include "Custom/bvh_treelet.h"
+#include "Custom/ray_packet.h"
+#include "Custom/ray_stream.h"
+#include "Custom/tile_frustum.h"
+#include "Custom/sphere_soa.h"
+#include "Custom/framebuffer.h"
+#include "Custom/cpu_dispatch.h"
+#include "Custom/camera.h"
+#include "Custom/constants.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #ifndef GNUPLOT_PATH
 #define GNUPLOT_PATH "gnuplot"
@@ -20,6 +40,11 @@
 #include <inttypes.h>
 #endif
 
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
 //----------------------------------------------------------------------------------------------------
 
 // Benchmark Testing
@@ -78,13 +103,39 @@ void run_gnuplot(void)
     }
 }
 
-void free_bvh(BVHNode *node)
+// Wall clock time, clock() adds up the cpu time of all threads on some platforms
+static double get_wall_time(void)
 {
-    if (!node)
-        return;
-    free_bvh(node->left);
-    free_bvh(node->right);
-    free(node);
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Last level cache misses of this process (hardware counter), -1 where there is no counter
+static int llc_miss_counter_open(void)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static long long llc_miss_counter_read(int fd)
+{
+    long long count;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return count;
 }
 
 void create_gnuplot_script(const char *data_filename)
@@ -169,8 +220,10 @@ void save_benchmark_data(const char *filename, int sphere_count, double time_no_
     fclose(file);
 }
 
+// Brute force with the SIMD kernel (sphere_soa.c), the SoA copy is built before the timing
 double benchmark_no_bvh(Sphere *spheres, int num_spheres, int num_rays)
 {
+    SphereSoA *soa = sphere_soa_build(spheres, num_spheres);
     clock_t start = clock();
     long long intersection_tests = 0;
     int intersections = 0;
@@ -187,21 +240,8 @@ double benchmark_no_bvh(Sphere *spheres, int num_spheres, int num_rays)
             {0, 0, 0},
             dir};
 
-        // float closest_dist = INFINITY;
-        bool hit_found = false;
-
-        for (int j = 0; j < num_spheres; j++)
-        {
-            intersection_tests++;
-            HitRecord hit = ray_sphere_intersect(ray, &spheres[j]);
-            if (hit.hit_something)
-            {
-                // closest_dist = hit.t;
-                hit_found = true;
-            }
-        }
-
-        if (hit_found)
+        intersection_tests += num_spheres;
+        if (ray_spheres_closest_soa(ray, spheres, soa).hit_something)
         {
             intersections++;
         }
@@ -209,8 +249,9 @@ double benchmark_no_bvh(Sphere *spheres, int num_spheres, int num_rays)
 
     clock_t end = clock();
     double time_spent = (double)(end - start) / CLOCKS_PER_SEC;
+    sphere_soa_free(soa);
 
-    printf("No BVH:\n");
+    printf("No BVH (%s spheres):\n", cpu_path_name(cpu_get_path()));
     printf("Time: %f seconds\n", time_spent);
 #ifdef _WIN32
     printf("Intersection tests: %" PRIu64 "\n", (uint64_t)intersection_tests);
@@ -222,7 +263,7 @@ double benchmark_no_bvh(Sphere *spheres, int num_spheres, int num_rays)
     return time_spent;
 }
 
-double benchmark_with_bvh(BVHNode *root, int num_spheres, int num_rays)
+double benchmark_with_bvh(BVH *bvh, int num_spheres, int num_rays)
 {
     clock_t start = clock();
     int intersections = 0;
@@ -239,7 +280,7 @@ double benchmark_with_bvh(BVHNode *root, int num_spheres, int num_rays)
             {0, 0, 0},
             dir};
 
-        HitRecord hit = ray_bvh_intersect(ray, root);
+        HitRecord hit = ray_bvh_intersect(ray, bvh);
         if (hit.hit_something)
             intersections++;
     }
@@ -254,6 +295,1462 @@ double benchmark_with_bvh(BVHNode *root, int num_spheres, int num_rays)
     return time_spent;
 }
 
+// Random directions from the origin, the same rays as benchmark_no_bvh() and benchmark_with_bvh() use
+static Ray *create_benchmark_rays(int num_rays)
+{
+    Ray *rays = malloc(num_rays * sizeof(Ray));
+    for (int i = 0; i < num_rays; i++)
+    {
+        Vec3 dir = {
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1};
+        rays[i] = (Ray){{0, 0, 0}, vec3_normalize(dir)};
+    }
+    return rays;
+}
+
+// Pointer tree (one malloc per node) against the flattened 32 byte node array, same rays for both
+void benchmark_bvh_layout(BVHNode *root, BVH *bvh, int num_rays)
+{
+    Ray *rays = create_benchmark_rays(num_rays);
+
+    int pointer_hits = 0, flat_hits = 0;
+    double start = get_wall_time();
+    for (int i = 0; i < num_rays; i++)
+        pointer_hits += ray_bvh_node_intersect(rays[i], root).hit_something;
+    double pointer_time = get_wall_time() - start;
+
+    start = get_wall_time();
+    for (int i = 0; i < num_rays; i++)
+        flat_hits += ray_bvh_intersect(rays[i], bvh).hit_something;
+    double flat_time = get_wall_time() - start;
+
+    printf("BVH layout (%d nodes):\n", bvh->node_count);
+    printf("Pointer tree: %d bytes/node + malloc header, %.0f rays/s, %d hits\n",
+           (int)sizeof(BVHNode), num_rays / pointer_time, pointer_hits);
+    printf("Linear array: %d bytes/node, %zu bytes arena, %.0f rays/s, %d hits\n\n",
+           (int)sizeof(BVHFlatNode), bvh->arena.capacity, num_rays / flat_time, flat_hits);
+    free(rays);
+}
+
+// Single sphere leaves (max_leaf_size = 1) against SAH terminated multi sphere leaves
+void benchmark_leaf_termination(Sphere *spheres, int num_spheres, int num_rays)
+{
+    BVHBuildConfig default_config = bvh_get_build_config();
+    BVHBuildConfig config = default_config;
+    int leaf_sizes[2] = {1, default_config.max_leaf_size};
+    Ray *rays = create_benchmark_rays(num_rays);
+
+    printf("Leaf termination with %d spheres:\n", num_spheres);
+    for (int i = 0; i < 2; i++)
+    {
+        config.max_leaf_size = leaf_sizes[i];
+        bvh_set_build_config(config);
+        BVH *bvh = bvh_build(spheres, num_spheres);
+
+        int hits = 0;
+        double start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+            hits += ray_bvh_intersect(rays[r], bvh).hit_something;
+        double time = get_wall_time() - start;
+
+        printf("Max leaf size %2d: %d nodes, %zu bytes, %.0f rays/s, %d hits\n",
+               leaf_sizes[i], bvh->node_count, bvh->node_count * sizeof(BVHFlatNode), num_rays / time, hits);
+        bvh_free(bvh);
+    }
+    printf("\n");
+
+    bvh_set_build_config(default_config);
+    free(rays);
+}
+
+// Spheres in num_clusters gaussian blobs (Box-Muller) around random points of the benchmark world
+void create_clustered_spheres(Sphere *spheres, int num_spheres, int num_clusters, float world_size, float spread)
+{
+    Vec3 *centers = malloc(num_clusters * sizeof(Vec3));
+    for (int c = 0; c < num_clusters; c++)
+    {
+        centers[c] = (Vec3){
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2};
+    }
+
+    for (int j = 0; j < num_spheres; j++)
+    {
+        Vec3 offset;
+        float *axes[3] = {&offset.x, &offset.y, &offset.z};
+        for (int a = 0; a < 3; a++)
+        {
+            float u1 = ((float)rand() + 1.0f) / ((float)RAND_MAX + 1.0f);
+            float u2 = (float)rand() / RAND_MAX;
+            *axes[a] = spread * sqrtf(-2.0f * logf(u1)) * cosf(2.0f * (float)M_PI * u2);
+        }
+        spheres[j] = create_benchmark_sphere(vec3_add(centers[rand() % num_clusters], offset));
+    }
+    free(centers);
+}
+
+// Build time, tree quality and trace speed of every builder selectable in BVHBuildConfig
+void benchmark_builders(Sphere *spheres, int num_spheres, int num_rays)
+{
+    BVHBuildConfig default_config = bvh_get_build_config();
+    BVHBuildConfig config = default_config;
+    Sphere *build_spheres = malloc(num_spheres * sizeof(Sphere));
+    Ray *rays = create_benchmark_rays(num_rays);
+
+    printf("BVH builders with %d spheres:\n", num_spheres);
+    for (int builder = 0; builder < BVH_BUILDER_COUNT; builder++)
+    {
+        memcpy(build_spheres, spheres, num_spheres * sizeof(Sphere));
+        config.builder = (BVHBuilder)builder;
+        bvh_set_build_config(config);
+
+        double start = get_wall_time();
+        BVH *bvh = bvh_build(build_spheres, num_spheres);
+        double build_time = get_wall_time() - start;
+
+        int hits = 0;
+        start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+            hits += ray_bvh_intersect(rays[r], bvh).hit_something;
+        double trace_time = get_wall_time() - start;
+
+        printf("%-12s build %f seconds, %d nodes, SAH cost %.2f, %.0f rays/s, %d hits\n",
+               bvh_builder_name((BVHBuilder)builder), build_time, bvh->node_count,
+               bvh_flat_sah_cost(bvh), num_rays / trace_time, hits);
+        bvh_free(bvh);
+    }
+    printf("\n");
+
+    bvh_set_build_config(default_config);
+    free(rays);
+    free(build_spheres);
+}
+
+// SAH cost and trace speed of every builder before and after the treelet optimization pass
+void benchmark_optimize(Sphere *spheres, int num_spheres, int num_rays, int rounds)
+{
+    BVHBuildConfig default_config = bvh_get_build_config();
+    BVHBuildConfig config = default_config;
+    Sphere *build_spheres = malloc(num_spheres * sizeof(Sphere));
+    Ray *rays = create_benchmark_rays(num_rays);
+
+    printf("Treelet optimization (%d rounds) with %d spheres:\n", rounds, num_spheres);
+    for (int builder = 0; builder < BVH_BUILDER_COUNT; builder++)
+    {
+        memcpy(build_spheres, spheres, num_spheres * sizeof(Sphere));
+        config.builder = (BVHBuilder)builder;
+        config.optimize_rounds = 0;
+        bvh_set_build_config(config);
+        BVH *bvh = bvh_build(build_spheres, num_spheres);
+
+        double rays_per_second[2];
+        float sah_cost[2];
+        double optimize_time = 0.0;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            if (pass == 1)
+            {
+                double start = get_wall_time();
+                bvh_optimize(bvh, rounds);
+                optimize_time = get_wall_time() - start;
+            }
+
+            sah_cost[pass] = bvh_flat_sah_cost(bvh);
+            double start = get_wall_time();
+            for (int r = 0; r < num_rays; r++)
+                ray_bvh_intersect(rays[r], bvh);
+            rays_per_second[pass] = num_rays / (get_wall_time() - start);
+        }
+
+        printf("%-12s SAH cost %.2f -> %.2f, %.0f -> %.0f rays/s, optimized in %f seconds\n",
+               bvh_builder_name((BVHBuilder)builder), sah_cost[0], sah_cost[1],
+               rays_per_second[0], rays_per_second[1], optimize_time);
+        bvh_free(bvh);
+    }
+    printf("\n");
+
+    bvh_set_build_config(default_config);
+    free(rays);
+    free(build_spheres);
+}
+
+// Binned SAH against the spatial split builder on scenes of large spheres in a small box (as
+// create_random_sphere makes them), where sibling bounds overlap
+void benchmark_spatial_splits(Sphere *spheres, int num_spheres, int num_rays)
+{
+    BVHBuildConfig default_config = bvh_get_build_config();
+    BVHBuildConfig config = default_config;
+    BVHBuilder builders[2] = {BVH_BUILDER_SAH, BVH_BUILDER_SBVH};
+    Ray *rays = create_benchmark_rays(num_rays);
+
+    printf("Spatial splits with %d overlapping spheres (duplication budget %.2f):\n",
+           num_spheres, default_config.duplication_budget);
+    for (int i = 0; i < 2; i++)
+    {
+        config.builder = builders[i];
+        bvh_set_build_config(config);
+
+        double start = get_wall_time();
+        BVH *bvh = bvh_build(spheres, num_spheres);
+        double build_time = get_wall_time() - start;
+
+        int hits = 0;
+        start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+            hits += ray_bvh_intersect(rays[r], bvh).hit_something;
+        double trace_time = get_wall_time() - start;
+
+        printf("%-12s build %f seconds, %d nodes, %d references (duplication %.3f), overlap %.2f, "
+               "SAH cost %.2f, %.0f rays/s, %d hits\n",
+               bvh_builder_name(builders[i]), build_time, bvh->node_count, bvh->sphere_count,
+               (double)bvh->sphere_count / num_spheres, bvh_flat_overlap(bvh), bvh_flat_sah_cost(bvh),
+               num_rays / trace_time, hits);
+        bvh_free(bvh);
+    }
+    printf("\n");
+
+    bvh_set_build_config(default_config);
+    free(rays);
+}
+
+// Node visits per ray of the plain SAH tree against the RSAH tree along a camera path through the
+// interactive scene. The path starts where main.c puts the camera and flies in while turning, the
+// RSAH tree only sees the (captured and reloaded) ray sample of the first frame.
+void benchmark_ray_distribution(Sphere *spheres, int num_spheres, int frames)
+{
+    BVHBuildConfig default_config = bvh_get_build_config();
+    BVHBuildConfig config = default_config;
+    Camera camera = {.position = {0, 4, 50}, .yaw = -M_PI, .pitch = 0, .fov = 45.0f};
+    camera_update(&camera);
+
+    Ray *sample = rsah_sample_camera_rays(&camera, RSAH_SAMPLE_COLUMNS, RSAH_SAMPLE_ROWS);
+    rsah_save_rays("benchmark_rays.txt", sample, RSAH_SAMPLE_COLUMNS * RSAH_SAMPLE_ROWS);
+    free(sample);
+    int sample_count;
+    sample = rsah_load_rays("benchmark_rays.txt", &sample_count);
+    remove("benchmark_rays.txt");
+
+    BVHBuilder builders[2] = {BVH_BUILDER_SAH, BVH_BUILDER_RSAH};
+    BVH *bvh[2];
+    Sphere *build_spheres[2];
+    double build_time[2];
+    for (int i = 0; i < 2; i++)
+    {
+        build_spheres[i] = malloc(num_spheres * sizeof(Sphere));
+        memcpy(build_spheres[i], spheres, num_spheres * sizeof(Sphere));
+        config.builder = builders[i];
+        config.sample_rays = sample;
+        config.sample_ray_count = sample_count;
+        bvh_set_build_config(config);
+        double start = get_wall_time();
+        bvh[i] = bvh_build(build_spheres[i], num_spheres);
+        build_time[i] = get_wall_time() - start;
+    }
+
+    TraversalStats stats[2] = {{0}};
+    double trace_time[2] = {0};
+    int hits[2] = {0};
+    const int columns = 200, rows = 150;
+    for (int f = 0; f < frames; f++)
+    {
+        camera.position = (Vec3){0.5f * f, 4.0f - 0.25f * f, 50.0f - 2.0f * f};
+        camera.yaw = -M_PI + 0.02f * f;
+        camera_update(&camera);
+        Ray *rays = rsah_sample_camera_rays(&camera, columns, rows);
+
+        for (int i = 0; i < 2; i++)
+        {
+            double start = get_wall_time();
+            for (int r = 0; r < columns * rows; r++)
+                hits[i] += ray_bvh_intersect_stats(rays[r], bvh[i], &stats[i]).hit_something;
+            trace_time[i] += get_wall_time() - start;
+        }
+        free(rays);
+    }
+
+    int num_rays = frames * columns * rows;
+    printf("Ray distribution SAH with %d spheres, %d sample rays, %d frames:\n", num_spheres, sample_count, frames);
+    for (int i = 0; i < 2; i++)
+    {
+        printf("%-12s build %f seconds, SAH cost %.2f, %.2f node visits/ray, %.2f sphere tests/ray, "
+               "%.0f rays/s, %d hits\n",
+               bvh_builder_name(builders[i]), build_time[i], bvh_flat_sah_cost(bvh[i]),
+               (double)stats[i].node_visits / num_rays, (double)stats[i].sphere_tests / num_rays,
+               num_rays / trace_time[i], hits[i]);
+        bvh_free(bvh[i]);
+        free(build_spheres[i]);
+    }
+    printf("\n");
+
+    bvh_set_build_config(default_config);
+    free(sample);
+}
+
+// One animation step : spheres swirl around the y axis, the inner ones faster, so the scene shears
+static void swirl_spheres(Sphere *spheres, int num_spheres)
+{
+    for (int i = 0; i < num_spheres; i++)
+    {
+        Vec3 c = spheres[i].center;
+        float angle = 0.05f / (1.0f + sqrtf(c.x * c.x + c.z * c.z) / 100.0f);
+        float s = sinf(angle), co = cosf(angle);
+        spheres[i].center = (Vec3){c.x * co - c.z * s, c.y, c.x * s + c.z * co};
+    }
+}
+
+// Moving spheres : full rebuild every frame, refit only, and refit with automatic rebuilds
+void benchmark_refit(Sphere *spheres, int num_spheres, int frames, int num_rays)
+{
+    BVHBuildConfig default_config = bvh_get_build_config();
+    const char *names[3] = {"Rebuild", "Refit only", "Refit+rebuild"};
+    Ray *rays = create_benchmark_rays(num_rays);
+
+    printf("Moving spheres (%d spheres, %d frames):\n", num_spheres, frames);
+    for (int mode = 0; mode < 3; mode++)
+    {
+        BVHBuildConfig config = default_config;
+        if (mode == 1)
+            config.rebuild_growth = config.subtree_rebuild_growth = INFINITY;
+        bvh_set_build_config(config);
+
+        Sphere *scene = malloc(num_spheres * sizeof(Sphere));
+        memcpy(scene, spheres, num_spheres * sizeof(Sphere));
+        BVH *bvh = bvh_build(scene, num_spheres);
+        BVHRefitter *refitter = mode ? bvh_refitter_create(bvh) : NULL;
+
+        double update_time = 0.0, max_update_time = 0.0;
+        float sah_sum = 0.0f, max_sah = 0.0f;
+        int subtree_rebuilds = 0, full_rebuilds = 0, rebuilt_spheres = 0;
+        for (int f = 0; f < frames; f++)
+        {
+            swirl_spheres(mode ? refitter->bvh->spheres : scene, num_spheres);
+
+            double start = get_wall_time();
+            float sah;
+            if (mode == 0)
+            {
+                bvh_free(bvh);
+                bvh = bvh_build(scene, num_spheres);
+                sah = bvh_flat_sah_cost(bvh);
+            }
+            else
+            {
+                BVHRefitStats stats = bvh_refitter_update(refitter);
+                subtree_rebuilds += stats.full_rebuild ? 0 : stats.rebuilt_subtrees;
+                full_rebuilds += stats.full_rebuild;
+                rebuilt_spheres += stats.rebuilt_spheres;
+                sah = stats.sah_cost;
+            }
+            double time = get_wall_time() - start;
+            update_time += time;
+            max_update_time = time > max_update_time ? time : max_update_time;
+            sah_sum += sah;
+            max_sah = sah > max_sah ? sah : max_sah;
+        }
+
+        BVH *final_bvh = mode ? refitter->bvh : bvh;
+        int hits = 0;
+        double start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+            hits += ray_bvh_intersect(rays[r], final_bvh).hit_something;
+        double trace_time = get_wall_time() - start;
+
+        printf("%-14s %f ms/frame (max %f), SAH cost avg %.2f max %.2f, %d full + %d subtree rebuilds "
+               "(%.0f spheres/frame), last frame %.0f rays/s, %d hits\n",
+               names[mode], 1000.0 * update_time / frames, 1000.0 * max_update_time, sah_sum / frames, max_sah,
+               full_rebuilds, subtree_rebuilds, (double)rebuilt_spheres / frames, num_rays / trace_time, hits);
+
+        if (refitter)
+            bvh_refitter_destroy(refitter);
+        else
+            bvh_free(bvh);
+        free(scene);
+    }
+    printf("\n");
+
+    bvh_set_build_config(default_config);
+    free(rays);
+}
+
+// Editing a live scene one sphere at a time : moves and remove + insert pairs in the dynamic BVH,
+// against building the edited scene from scratch
+void benchmark_dynamic_bvh(Sphere *spheres, int num_spheres, int num_edits, int num_rays)
+{
+    Ray *rays = create_benchmark_rays(num_rays);
+    Sphere *scene = malloc(num_spheres * sizeof(Sphere));
+    int *handles = malloc(num_spheres * sizeof(int));
+    memcpy(scene, spheres, num_spheres * sizeof(Sphere));
+
+    AABB world = create_empty_aabb();
+    for (int i = 0; i < num_spheres; i++)
+        world = combine_aabb(world, create_aabb_from_sphere(&scene[i]));
+
+    DynamicBVH *tree = bvh_dynamic_create(num_spheres);
+    double start = get_wall_time();
+    for (int i = 0; i < num_spheres; i++)
+        handles[i] = bvh_dynamic_insert(tree, scene[i]);
+    double insert_time = get_wall_time() - start;
+    int insert_height = bvh_dynamic_height(tree);
+
+    // Small moves, as when dragging a sphere around in an editor
+    start = get_wall_time();
+    for (int e = 0; e < num_edits; e++)
+    {
+        int i = rand() % num_spheres;
+        Vec3 offset = {(float)rand() / RAND_MAX * 20 - 10, (float)rand() / RAND_MAX * 20 - 10,
+                       (float)rand() / RAND_MAX * 20 - 10};
+        scene[i].center = vec3_add(scene[i].center, offset);
+        bvh_dynamic_update(tree, handles[i], scene[i]);
+    }
+    double move_time = get_wall_time() - start;
+
+    // Streaming : a sphere is deleted and a new one appears anywhere in the scene
+    start = get_wall_time();
+    for (int e = 0; e < num_edits; e++)
+    {
+        int i = rand() % num_spheres;
+        bvh_dynamic_remove(tree, handles[i]);
+        Vec3 center = {world.min.x + (float)rand() / RAND_MAX * (world.max.x - world.min.x),
+                       world.min.y + (float)rand() / RAND_MAX * (world.max.y - world.min.y),
+                       world.min.z + (float)rand() / RAND_MAX * (world.max.z - world.min.z)};
+        scene[i] = create_benchmark_sphere(center);
+        handles[i] = bvh_dynamic_insert(tree, scene[i]);
+    }
+    double replace_time = get_wall_time() - start;
+
+    start = get_wall_time();
+    const BVH *flat = bvh_dynamic_flat(tree);
+    double flat_time = get_wall_time() - start;
+
+    Sphere *rebuild_spheres = malloc(num_spheres * sizeof(Sphere));
+    memcpy(rebuild_spheres, scene, num_spheres * sizeof(Sphere));
+    start = get_wall_time();
+    BVH *rebuilt = bvh_build(rebuild_spheres, num_spheres);
+    double rebuild_time = get_wall_time() - start;
+
+    const BVH *bvh[2] = {flat, rebuilt};
+    double trace_time[2];
+    int hits[2] = {0, 0};
+    for (int b = 0; b < 2; b++)
+    {
+        start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+            hits[b] += ray_bvh_intersect(rays[r], bvh[b]).hit_something;
+        trace_time[b] = get_wall_time() - start;
+    }
+
+    printf("Dynamic BVH (%d spheres, %d edits of each kind):\n", num_spheres, num_edits);
+    printf("Insert        %f us/sphere (%f seconds for the scene), height %d\n",
+           1e6 * insert_time / num_spheres, insert_time, insert_height);
+    printf("Move          %f us/edit\n", 1e6 * move_time / num_edits);
+    printf("Remove+insert %f us/edit, %lld rotations in total, height %d\n",
+           1e6 * replace_time / num_edits, tree->rotations, bvh_dynamic_height(tree));
+    printf("Flat copy     %f ms for ray_bvh_intersect()\n", 1000.0 * flat_time);
+    printf("Dynamic       SAH cost %.2f, %.0f rays/s, %d hits\n", bvh_flat_sah_cost(flat), num_rays / trace_time[0], hits[0]);
+    printf("%-13s rebuild %f ms, SAH cost %.2f, %.0f rays/s, %d hits\n\n",
+           bvh_builder_name(bvh_get_build_config().builder), 1000.0 * rebuild_time, bvh_flat_sah_cost(rebuilt),
+           num_rays / trace_time[1], hits[1]);
+
+    bvh_free(rebuilt);
+    bvh_dynamic_destroy(tree);
+    free(rebuild_spheres);
+    free(handles);
+    free(scene);
+    free(rays);
+}
+
+// Repeated objects : instances of one shared BLAS under a TLAS, against every copy of every sphere
+// transformed into world space under one BVH
+void benchmark_instancing(int copies, int object_spheres, int num_rays)
+{
+    float world_size = 1000.0f, object_size = 20.0f;
+    Ray *rays = create_benchmark_rays(num_rays);
+
+    Sphere *object = malloc(object_spheres * sizeof(Sphere));
+    for (int i = 0; i < object_spheres; i++)
+    {
+        Vec3 center = {(float)rand() / RAND_MAX * object_size - object_size / 2,
+                       (float)rand() / RAND_MAX * object_size - object_size / 2,
+                       (float)rand() / RAND_MAX * object_size - object_size / 2};
+        object[i] = create_benchmark_sphere(center);
+    }
+
+    // Random placement, rotation and uniform scale, so the flattened copies stay spheres
+    Transform *transforms = malloc(copies * sizeof(Transform));
+    float *scales = malloc(copies * sizeof(float));
+    for (int c = 0; c < copies; c++)
+    {
+        Vec3 offset = {(float)rand() / RAND_MAX * world_size - world_size / 2,
+                       (float)rand() / RAND_MAX * world_size - world_size / 2,
+                       (float)rand() / RAND_MAX * world_size - world_size / 2};
+        scales[c] = 0.5f + 1.5f * rand() / RAND_MAX;
+        Transform rotate = transform_rotate(vec3_random(-1.0f, 1.0f), (float)rand() / RAND_MAX * 6.2831853f);
+        transforms[c] = transform_multiply(transform_translate(offset),
+                                           transform_multiply(rotate, transform_scale((Vec3){scales[c], scales[c], scales[c]})));
+    }
+
+    double start = get_wall_time();
+    BVH *blas = bvh_build(object, object_spheres);
+    Instance *instances = malloc(copies * sizeof(Instance));
+    for (int c = 0; c < copies; c++)
+        instances[c] = instance_create(blas, transforms[c]);
+    TLAS *tlas = tlas_build(instances, copies);
+    double instanced_time = get_wall_time() - start;
+    size_t instanced_bytes = object_spheres * sizeof(Sphere) + blas->arena.capacity + tlas->arena.capacity;
+
+    long long flat_count = (long long)copies * object_spheres;
+    Sphere *flat_spheres = malloc(flat_count * sizeof(Sphere));
+    BVH *flat = NULL;
+    double flat_time = 0.0;
+    if (flat_spheres)
+    {
+        for (int c = 0; c < copies; c++)
+        {
+            for (int i = 0; i < object_spheres; i++)
+            {
+                Sphere *sphere = &flat_spheres[(long long)c * object_spheres + i];
+                *sphere = object[i];
+                sphere->center = transform_point(&transforms[c], object[i].center);
+                sphere->radius = object[i].radius * scales[c];
+            }
+        }
+        start = get_wall_time();
+        flat = bvh_build(flat_spheres, (int)flat_count);
+        flat_time = get_wall_time() - start;
+    }
+
+    int instanced_hits = 0, flat_hits = 0;
+    start = get_wall_time();
+    for (int r = 0; r < num_rays; r++)
+        instanced_hits += ray_tlas_intersect(rays[r], tlas).hit_something;
+    double instanced_trace = get_wall_time() - start;
+
+    printf("Instancing (%d copies of a %d sphere object):\n", copies, object_spheres);
+    printf("Two-level  build %f seconds, %.2f MB, %.0f rays/s, %d hits\n",
+           instanced_time, instanced_bytes / (1024.0 * 1024.0), num_rays / instanced_trace, instanced_hits);
+    if (flat)
+    {
+        start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+            flat_hits += ray_bvh_intersect(rays[r], flat).hit_something;
+        double flat_trace = get_wall_time() - start;
+        size_t flat_bytes = flat_count * sizeof(Sphere) + flat->arena.capacity;
+        printf("Flattened  build %f seconds, %.2f MB, %.0f rays/s, %d hits (%lld spheres)\n",
+               flat_time, flat_bytes / (1024.0 * 1024.0), num_rays / flat_trace, flat_hits, flat_count);
+    }
+    else
+    {
+        printf("Flattened  %lld spheres do not fit in memory\n", flat_count);
+    }
+    printf("\n");
+
+    bvh_free(flat);
+    free(flat_spheres);
+    tlas_free(tlas);
+    free(instances);
+    bvh_free(blas);
+    free(scales);
+    free(transforms);
+    free(object);
+    free(rays);
+}
+
+// Binary traversal against the BVH4 / BVH8 / quantized BVH8 collapsed from the same tree, same rays
+// for all of them. Sizes count the nodes only, every format shares the sphere array.
+void benchmark_wide_bvh(Sphere *spheres, int num_spheres, int num_rays)
+{
+    Ray *rays = create_benchmark_rays(num_rays);
+    Sphere *build_spheres = malloc(num_spheres * sizeof(Sphere));
+    memcpy(build_spheres, spheres, num_spheres * sizeof(Sphere));
+    BVH *bvh = bvh_build(build_spheres, num_spheres);
+
+    int binary_hits = 0;
+    double start = get_wall_time();
+    for (int r = 0; r < num_rays; r++)
+        binary_hits += ray_bvh_intersect(rays[r], bvh).hit_something;
+    double binary_time = get_wall_time() - start;
+
+    size_t binary_bytes = bvh->node_count * sizeof(BVHFlatNode);
+    printf("Wide BVH (%d spheres, %.2f MB of spheres):\n", num_spheres, num_spheres * sizeof(Sphere) / (1024.0 * 1024.0));
+    printf("Binary       %d nodes, %d bytes/node, %.1f bytes/sphere, %.2f MB, %.0f rays/s, %d hits\n",
+           bvh->node_count, (int)sizeof(BVHFlatNode), (double)binary_bytes / num_spheres,
+           binary_bytes / (1024.0 * 1024.0), num_rays / binary_time, binary_hits);
+
+    // BVH4, BVH8, quantized BVH8
+    for (int format = 0; format < 3; format++)
+    {
+        int width = format ? 8 : 4;
+        start = get_wall_time();
+        BVHWide *wide = format == 2 ? bvh_wide_build_quantized(bvh) : bvh_wide_build(bvh, width);
+        double collapse_time = get_wall_time() - start;
+        if (!wide)
+            continue;
+
+        int hits = 0;
+        start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+            hits += ray_bvh_wide_intersect(rays[r], wide).hit_something;
+        double trace_time = get_wall_time() - start;
+
+        size_t node_bytes = wide->node_count * bvh_wide_node_size(wide);
+        printf("BVH%d%s %-7s %d nodes, %d bytes/node, %.1f bytes/sphere, %.2f MB, collapse %f seconds, "
+               "%.0f rays/s (%.2fx), %d hits\n",
+               width, format == 2 ? "Q" : " ", bvh_wide_simd_path(width), wide->node_count,
+               (int)bvh_wide_node_size(wide), (double)node_bytes / num_spheres, node_bytes / (1024.0 * 1024.0),
+               collapse_time, num_rays / trace_time, binary_time / trace_time, hits);
+        bvh_wide_free(wide);
+    }
+    printf("\n");
+
+    bvh_free(bvh);
+    free(build_spheres);
+    free(rays);
+}
+
+// Stack based traversal (ray_bvh_intersect) against the stackless skip link walk over the same tree,
+// for the primary rays of the interactive camera and one diffuse bounce from each primary hit.
+void benchmark_stackless(Sphere *spheres, int num_spheres)
+{
+    Sphere *build_spheres = malloc(num_spheres * sizeof(Sphere));
+    memcpy(build_spheres, spheres, num_spheres * sizeof(Sphere));
+    BVH *bvh = bvh_build(build_spheres, num_spheres);
+    BVHSkip *skip = bvh_skip_build(bvh);
+    if (!skip)
+    {
+        bvh_free(bvh);
+        free(build_spheres);
+        return;
+    }
+
+    Camera camera = {.position = {0, 4, 50}, .yaw = -M_PI, .pitch = 0, .fov = 45.0f};
+    camera_update(&camera);
+    const int columns = 400, rows = 300;
+    Ray *rays[2];
+    int ray_count[2] = {columns * rows, 0};
+    rays[0] = rsah_sample_camera_rays(&camera, columns, rows);
+    rays[1] = malloc(ray_count[0] * sizeof(Ray));
+    for (int r = 0; r < ray_count[0]; r++)
+    {
+        HitRecord hit = ray_bvh_intersect(rays[0][r], bvh);
+        if (hit.hit_something)
+            rays[1][ray_count[1]++] = (Ray){hit.point, random_on_hemisphere(hit.normal)};
+    }
+
+    printf("Stackless traversal (%d spheres, %d nodes):\n", num_spheres, bvh->node_count);
+    const char *names[2] = {"Primary", "Diffuse"};
+    for (int set = 0; set < 2; set++)
+    {
+        int stack_hits = 0, skip_hits = 0;
+        double start = get_wall_time();
+        for (int r = 0; r < ray_count[set]; r++)
+            stack_hits += ray_bvh_intersect(rays[set][r], bvh).hit_something;
+        double stack_time = get_wall_time() - start;
+
+        start = get_wall_time();
+        for (int r = 0; r < ray_count[set]; r++)
+            skip_hits += ray_bvh_skip_intersect(rays[set][r], skip).hit_something;
+        double skip_time = get_wall_time() - start;
+
+        printf("%-8s %6d rays  stack %.0f rays/s, %d hits  stackless %.0f rays/s (%.2fx), %d hits\n",
+               names[set], ray_count[set], ray_count[set] / stack_time, stack_hits,
+               ray_count[set] / skip_time, stack_time / skip_time, skip_hits);
+    }
+    printf("\n");
+
+    free(rays[0]);
+    free(rays[1]);
+    bvh_skip_free(skip);
+    bvh_free(bvh);
+    free(build_spheres);
+}
+
+// Shadow rays from the primary hits of the interactive camera to a point light: closest hit (with
+// t_max at the light) against the any-hit occlusion query, for the BVH and for brute force. One light
+// in front of the scene (most rays reach it) and one at its side behind the spheres (most rays are
+// blocked). Brute force only traces the first 2000 rays.
+void benchmark_occlusion(Sphere *spheres, int num_spheres)
+{
+    Sphere *build_spheres = malloc(num_spheres * sizeof(Sphere));
+    memcpy(build_spheres, spheres, num_spheres * sizeof(Sphere));
+    BVH *bvh = bvh_build(build_spheres, num_spheres);
+
+    Camera camera = {.position = {0, 4, 50}, .yaw = -M_PI, .pitch = 0, .fov = 45.0f};
+    camera_update(&camera);
+    const int columns = 200, rows = 150;
+    Ray *primary = rsah_sample_camera_rays(&camera, columns, rows);
+    HitRecord *primary_hits = malloc(columns * rows * sizeof(HitRecord));
+    int num_rays = 0;
+    for (int r = 0; r < columns * rows; r++)
+    {
+        HitRecord hit = ray_bvh_intersect(primary[r], bvh);
+        if (hit.hit_something)
+            primary_hits[num_rays++] = hit;
+    }
+    free(primary);
+
+    const Vec3 lights[2] = {{30.0f, 40.0f, 30.0f}, {-100.0f, 5.0f, -5.0f}};
+    Ray *rays = malloc(num_rays * sizeof(Ray));
+    int brute_rays = num_rays < 2000 ? num_rays : 2000;
+    printf("Shadow rays (%d spheres, %d rays):\n", num_spheres, num_rays);
+    for (int l = 0; l < 2; l++)
+    {
+        // t runs from the hit point (0) to the light (1)
+        for (int r = 0; r < num_rays; r++)
+            rays[r] = (Ray){primary_hits[r].point, vec3_sub(lights[l], primary_hits[r].point)};
+
+        int closest_count = 0, any_count = 0;
+        double start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+            closest_count += ray_bvh_intersect_range(rays[r], bvh, EPSILON, 1.0f).hit_something;
+        double closest_time = get_wall_time() - start;
+
+        start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+            any_count += ray_bvh_occluded(rays[r], bvh, EPSILON, 1.0f);
+        double any_time = get_wall_time() - start;
+
+        int brute_closest_count = 0, brute_any_count = 0;
+        start = get_wall_time();
+        for (int r = 0; r < brute_rays; r++)
+        {
+            HitRecord closest = {0};
+            float t_max = 1.0f;
+            for (int i = 0; i < num_spheres; i++)
+            {
+                HitRecord hit = ray_sphere_intersect_range(rays[r], &build_spheres[i], EPSILON, t_max);
+                if (hit.hit_something)
+                {
+                    closest = hit;
+                    t_max = hit.t;
+                }
+            }
+            brute_closest_count += closest.hit_something;
+        }
+        double brute_closest_time = get_wall_time() - start;
+
+        start = get_wall_time();
+        for (int r = 0; r < brute_rays; r++)
+            brute_any_count += ray_spheres_occluded(rays[r], build_spheres, num_spheres, EPSILON, 1.0f);
+        double brute_any_time = get_wall_time() - start;
+
+        printf("Light at {%.0f,%.0f,%.0f}:\n", lights[l].x, lights[l].y, lights[l].z);
+        printf("BVH          closest hit %.0f rays/s, any hit %.0f rays/s (%.2fx), occluded %d / %d\n",
+               num_rays / closest_time, num_rays / any_time, closest_time / any_time, closest_count, any_count);
+        printf("Brute force  closest hit %.0f rays/s, any hit %.0f rays/s (%.2fx), occluded %d / %d of %d rays\n",
+               brute_rays / brute_closest_time, brute_rays / brute_any_time, brute_closest_time / brute_any_time,
+               brute_closest_count, brute_any_count, brute_rays);
+    }
+    printf("\n");
+
+    free(rays);
+    free(primary_hits);
+    bvh_free(bvh);
+    free(build_spheres);
+}
+
+// Single rays (ray_bvh_intersect) against packets of 4, 8 and 16 rays from 2x2, 4x2 and 4x4 pixel
+// blocks, for the primary rays of a full frame from the interactive camera and for one diffuse bounce
+// from each primary hit (packed by the same blocks).
+void benchmark_packets(Sphere *spheres, int num_spheres)
+{
+    Sphere *build_spheres = malloc(num_spheres * sizeof(Sphere));
+    memcpy(build_spheres, spheres, num_spheres * sizeof(Sphere));
+    BVH *bvh = bvh_build(build_spheres, num_spheres);
+
+    Camera camera = {.position = {0, 4, 50}, .yaw = -M_PI, .pitch = 0, .fov = 45.0f};
+    camera_update(&camera);
+    int num_pixels = WIDTH * HEIGHT;
+    Ray *rays[2];
+    HitRecord *single_hits[2];
+    int *has_ray[2];
+    rays[0] = rsah_sample_camera_rays(&camera, WIDTH, HEIGHT);
+    rays[1] = malloc(num_pixels * sizeof(Ray));
+    for (int set = 0; set < 2; set++)
+    {
+        single_hits[set] = malloc(num_pixels * sizeof(HitRecord));
+        has_ray[set] = malloc(num_pixels * sizeof(int));
+    }
+
+    printf("Ray packets (%d spheres, %dx%d frame, %s box tests):\n", num_spheres, WIDTH, HEIGHT, cpu_path_name(cpu_get_path()));
+    const char *names[2] = {"Primary", "Bounce"};
+    for (int set = 0; set < 2; set++)
+    {
+        int num_rays = 0, hits = 0;
+        double start = get_wall_time();
+        for (int p = 0; p < num_pixels; p++)
+        {
+            has_ray[set][p] = set == 0 || single_hits[0][p].hit_something;
+            if (has_ray[set][p])
+            {
+                single_hits[set][p] = ray_bvh_intersect(rays[set][p], bvh);
+                hits += single_hits[set][p].hit_something;
+                num_rays++;
+            }
+        }
+        double single_time = get_wall_time() - start;
+        printf("%-8s %6d rays  single    %.0f rays/s, %d hits\n", names[set], num_rays, num_rays / single_time, hits);
+
+        const int block_sizes[3][2] = {{2, 2}, {4, 2}, {4, 4}};
+        for (int b = 0; b < 3; b++)
+        {
+            int block_w = block_sizes[b][0], block_h = block_sizes[b][1];
+            int packet_hits = 0, mismatches = 0;
+            start = get_wall_time();
+            for (int block_y = 0; block_y < HEIGHT; block_y += block_h)
+            {
+                for (int block_x = 0; block_x < WIDTH; block_x += block_w)
+                {
+                    Ray packet[RAY_PACKET_MAX];
+                    int pixels[RAY_PACKET_MAX], count = 0;
+                    for (int y = block_y; y < block_y + block_h && y < HEIGHT; y++)
+                    {
+                        for (int x = block_x; x < block_x + block_w && x < WIDTH; x++)
+                        {
+                            if (has_ray[set][y * WIDTH + x])
+                            {
+                                pixels[count] = y * WIDTH + x;
+                                packet[count++] = rays[set][y * WIDTH + x];
+                            }
+                        }
+                    }
+                    if (count == 0)
+                        continue;
+
+                    HitRecord packet_hits_out[RAY_PACKET_MAX];
+                    ray_packet_intersect(packet, count, bvh, NULL, packet_hits_out);
+                    for (int i = 0; i < count; i++)
+                    {
+                        const HitRecord *single = &single_hits[set][pixels[i]];
+                        packet_hits += packet_hits_out[i].hit_something;
+                        mismatches += packet_hits_out[i].hit_something != single->hit_something ||
+                                      (single->hit_something && packet_hits_out[i].t != single->t);
+                    }
+                }
+            }
+            double packet_time = get_wall_time() - start;
+            printf("%-8s %6d rays  packet %2d %.0f rays/s (%.2fx), %d hits, %d differ from single rays\n",
+                   names[set], num_rays, block_w * block_h, num_rays / packet_time, single_time / packet_time,
+                   packet_hits, mismatches);
+        }
+
+        // Diffuse bounces of the primary hits, in pixel order so the blocks above pack them
+        if (set == 0)
+        {
+            for (int p = 0; p < num_pixels; p++)
+            {
+                if (single_hits[0][p].hit_something)
+                    rays[1][p] = (Ray){single_hits[0][p].point, random_on_hemisphere(single_hits[0][p].normal)};
+            }
+        }
+    }
+    printf("\n");
+
+    for (int set = 0; set < 2; set++)
+    {
+        free(rays[set]);
+        free(single_hits[set]);
+        free(has_ray[set]);
+    }
+    bvh_free(bvh);
+    free(build_spheres);
+}
+
+// Diffuse bounces of a frame of primary rays, traced as they come (pixel order) and as sorted ray streams
+// (ray_stream.c), one ray at a time and as packets of RAY_PACKET_MAX neighbours in the stream.
+// For every bounce up to MAX_DEPTH : the sort time against the traversal time it saves.
+void benchmark_ray_stream(Sphere *spheres, int num_spheres)
+{
+    Sphere *build_spheres = malloc(num_spheres * sizeof(Sphere));
+    memcpy(build_spheres, spheres, num_spheres * sizeof(Sphere));
+    BVH *bvh = bvh_build(build_spheres, num_spheres);
+
+    Camera camera = {.position = {0, 4, 50}, .yaw = -M_PI, .pitch = 0, .fov = 45.0f};
+    camera_update(&camera);
+    int num_pixels = WIDTH * HEIGHT;
+    Ray *rays = rsah_sample_camera_rays(&camera, WIDTH, HEIGHT);
+    Ray *sorted_rays = malloc(num_pixels * sizeof(Ray));
+    uint32_t *ids = malloc(num_pixels * sizeof(uint32_t));
+    RayStreamScratch *scratch = ray_stream_scratch_create(num_pixels);
+    HitRecord *hits = malloc(num_pixels * sizeof(HitRecord));
+    HitRecord *stream_hits = malloc(num_pixels * sizeof(HitRecord));
+
+    // Primary hits, in pixel order
+    int num_rays = 0;
+    for (int p = 0; p < num_pixels; p++)
+    {
+        HitRecord hit = ray_bvh_intersect(rays[p], bvh);
+        if (hit.hit_something)
+            rays[num_rays++] = (Ray){hit.point, random_on_hemisphere(hit.normal)};
+    }
+
+    printf("Ray streams (%d spheres, %dx%d frame, %d bit origin cells per axis):\n", num_spheres, WIDTH, HEIGHT,
+           RAY_STREAM_CELL_BITS);
+    for (int bounce = 1; bounce < MAX_DEPTH && num_rays > 0; bounce++)
+    {
+        double start = get_wall_time();
+        for (int i = 0; i < num_rays; i++)
+            hits[i] = ray_bvh_intersect(rays[i], bvh);
+        double single_time = get_wall_time() - start;
+
+        start = get_wall_time();
+        for (int i = 0; i < num_rays; i += RAY_PACKET_MAX)
+            ray_packet_intersect(&rays[i], num_rays - i < RAY_PACKET_MAX ? num_rays - i : RAY_PACKET_MAX, bvh, NULL, &stream_hits[i]);
+        double packet_time = get_wall_time() - start;
+
+        memcpy(sorted_rays, rays, num_rays * sizeof(Ray));
+        for (int i = 0; i < num_rays; i++)
+            ids[i] = (uint32_t)i;
+        start = get_wall_time();
+        ray_stream_sort(sorted_rays, ids, num_rays, bvh->nodes[0].bounds, scratch);
+        double sort_time = get_wall_time() - start;
+
+        start = get_wall_time();
+        for (int i = 0; i < num_rays; i++)
+            stream_hits[i] = ray_bvh_intersect(sorted_rays[i], bvh);
+        double sorted_single_time = get_wall_time() - start;
+
+        int mismatches = 0;
+        for (int i = 0; i < num_rays; i++)
+        {
+            const HitRecord *hit = &hits[ids[i]];
+            mismatches += stream_hits[i].hit_something != hit->hit_something ||
+                          (hit->hit_something && (stream_hits[i].t != hit->t || stream_hits[i].object != hit->object));
+        }
+
+        start = get_wall_time();
+        for (int i = 0; i < num_rays; i += RAY_PACKET_MAX)
+            ray_packet_intersect(&sorted_rays[i], num_rays - i < RAY_PACKET_MAX ? num_rays - i : RAY_PACKET_MAX, bvh, NULL, &stream_hits[i]);
+        double sorted_packet_time = get_wall_time() - start;
+
+        for (int i = 0; i < num_rays; i++)
+        {
+            const HitRecord *hit = &hits[ids[i]];
+            mismatches += stream_hits[i].hit_something != hit->hit_something ||
+                          (hit->hit_something && (stream_hits[i].t != hit->t || stream_hits[i].object != hit->object));
+        }
+
+        printf("Bounce %d %7d rays  sort %6.2f ms  single %7.2f -> %7.2f ms (%.2fx with the sort)"
+               "  packets %7.2f -> %7.2f ms (%.2fx with the sort), %d hits differ\n",
+               bounce, num_rays, sort_time * 1000.0,
+               single_time * 1000.0, sorted_single_time * 1000.0, single_time / (sort_time + sorted_single_time),
+               packet_time * 1000.0, sorted_packet_time * 1000.0, packet_time / (sort_time + sorted_packet_time),
+               mismatches);
+
+        // Next bounce from the hits of this one, still in pixel order
+        int next = 0;
+        for (int i = 0; i < num_rays; i++)
+        {
+            if (hits[i].hit_something)
+                rays[next++] = (Ray){hits[i].point, random_on_hemisphere(hits[i].normal)};
+        }
+        num_rays = next;
+    }
+    printf("\n");
+
+    free(rays);
+    free(sorted_rays);
+    free(ids);
+    ray_stream_scratch_free(scratch);
+    free(hits);
+    free(stream_hits);
+    bvh_free(bvh);
+    free(build_spheres);
+}
+
+// Treelet ray queues (bvh_treelet.c) against ray_bvh_intersect() as the scene grows past the caches.
+// Spheres keep the same density, every scene is ten times bigger than the last up to max_spheres.
+// Memory traffic per ray : LLC misses where the hardware counter is available, and always the node and
+// sphere bytes a ray touches (standard) against the treelet bytes loaded per queue run (treelets).
+// LBVH builds keep the build time of the biggest scenes reasonable.
+void benchmark_treelets(int max_spheres, int num_rays)
+{
+    BVHBuildConfig default_config = bvh_get_build_config();
+    BVHBuildConfig config = default_config;
+    config.builder = BVH_BUILDER_LBVH;
+    bvh_set_build_config(config);
+
+    Ray *rays = create_benchmark_rays(num_rays);
+    HitRecord *hits = malloc(num_rays * sizeof(HitRecord));
+    HitRecord *treelet_hits = malloc(num_rays * sizeof(HitRecord));
+    int counter = llc_miss_counter_open();
+
+    printf("Treelet ray queues (%d rays, %d KB treelets, %s):\n", num_rays, BVH_TREELET_BYTES / 1024,
+           counter >= 0 ? "LLC misses from the hardware counter" : "no hardware counter for LLC misses");
+    for (int num_spheres = 100000; num_spheres <= max_spheres; num_spheres *= 10)
+    {
+        float world_size = 1000.0f * cbrtf(num_spheres / 100000.0f);
+        Sphere *spheres = malloc(num_spheres * sizeof(Sphere));
+        for (int j = 0; j < num_spheres; j++)
+        {
+            Vec3 center = {
+                (float)rand() / RAND_MAX * world_size - world_size / 2,
+                (float)rand() / RAND_MAX * world_size - world_size / 2,
+                (float)rand() / RAND_MAX * world_size - world_size / 2};
+            spheres[j] = create_benchmark_sphere(center);
+        }
+        BVH *bvh = bvh_build(spheres, num_spheres);
+        BVHTreelets *treelets = bvh_treelets_build(bvh, BVH_TREELET_BYTES);
+        if (!treelets)
+        {
+            bvh_free(bvh);
+            free(spheres);
+            break;
+        }
+
+        TraversalStats traversal = {0};
+        for (int i = 0; i < num_rays; i++)
+            ray_bvh_intersect_stats(rays[i], bvh, &traversal);
+        double touched_bytes = (traversal.node_visits * sizeof(BVHFlatNode) + traversal.sphere_tests * sizeof(Sphere)) /
+                               (double)num_rays;
+
+        long long misses = llc_miss_counter_read(counter);
+        double start = get_wall_time();
+        for (int i = 0; i < num_rays; i++)
+            hits[i] = ray_bvh_intersect(rays[i], bvh);
+        double standard_time = get_wall_time() - start;
+        long long standard_misses = llc_miss_counter_read(counter) - misses;
+
+        TreeletStats stats = {0};
+        misses = llc_miss_counter_read(counter);
+        start = get_wall_time();
+        ray_treelet_intersect(treelets, rays, num_rays, treelet_hits, &stats);
+        double treelet_time = get_wall_time() - start;
+        long long treelet_misses = llc_miss_counter_read(counter) - misses;
+
+        int mismatches = 0;
+        for (int i = 0; i < num_rays; i++)
+        {
+            mismatches += hits[i].hit_something != treelet_hits[i].hit_something ||
+                          (hits[i].hit_something && (hits[i].t != treelet_hits[i].t || hits[i].object != treelet_hits[i].object));
+        }
+
+        double scene_mb = ((double)bvh->node_count * sizeof(BVHFlatNode) + (double)num_spheres * sizeof(Sphere)) / (1024.0 * 1024.0);
+        printf("%8d spheres (%.0f MB, %d treelets)\n", num_spheres, scene_mb, treelets->treelet_count);
+        if (counter >= 0)
+        {
+            printf("  standard %8.0f rays/s, %6.0f bytes touched per ray, %.1f LLC misses per ray\n",
+                   num_rays / standard_time, touched_bytes, (double)standard_misses / num_rays);
+            printf("  treelets %8.0f rays/s (%.2fx), %6.0f treelet bytes per ray, %.1f LLC misses per ray, %.1f queue entries per ray, %d hits differ\n",
+                   num_rays / treelet_time, standard_time / treelet_time, (double)stats.treelet_bytes / num_rays,
+                   (double)treelet_misses / num_rays, (double)stats.ray_entries / num_rays, mismatches);
+        }
+        else
+        {
+            printf("  standard %8.0f rays/s, %6.0f bytes touched per ray\n", num_rays / standard_time, touched_bytes);
+            printf("  treelets %8.0f rays/s (%.2fx), %6.0f treelet bytes per ray, %.1f queue entries per ray, %d hits differ\n",
+                   num_rays / treelet_time, standard_time / treelet_time, (double)stats.treelet_bytes / num_rays,
+                   (double)stats.ray_entries / num_rays, mismatches);
+        }
+
+        bvh_treelets_free(treelets);
+        bvh_free(bvh);
+        free(spheres);
+    }
+    printf("\n");
+
+    if (counter >= 0)
+        close(counter);
+    bvh_set_build_config(default_config);
+    free(rays);
+    free(hits);
+    free(treelet_hits);
+}
+
+// Primary rays with and without the tile frustum cuts (tile_frustum.c), single rays and 4x4 packets,
+// at 800x600 and 4K. Both resolutions cover the view of the render loop in main.c. Rays are ordered
+// tile by tile, block by block inside a tile. Times with the cuts include building them.
+void benchmark_tile_frustum(Sphere *spheres, int num_spheres)
+{
+    Sphere *build_spheres = malloc(num_spheres * sizeof(Sphere));
+    memcpy(build_spheres, spheres, num_spheres * sizeof(Sphere));
+    BVH *bvh = bvh_build(build_spheres, num_spheres);
+
+    Camera camera = {.position = {0, 4, 50}, .yaw = -M_PI, .pitch = 0, .fov = 45.0f};
+    camera_update(&camera);
+    const int resolutions[2][2] = {{800, 600}, {3840, 2160}};
+
+    printf("Tile frustum culling (%d spheres, %dx%d pixel tiles, up to %d roots, %s packets):\n", num_spheres,
+           RAY_TILE_SIZE, RAY_TILE_SIZE, TILE_CUT_MAX, cpu_path_name(cpu_get_path()));
+    for (int r = 0; r < 2; r++)
+    {
+        int width = resolutions[r][0], height = resolutions[r][1];
+        float aspect_ratio = (float)width / (float)height;
+        int tiles_x = (width + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE, tiles_y = (height + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE;
+        int num_tiles = tiles_x * tiles_y, num_rays = width * height;
+        Ray *rays = malloc(num_rays * sizeof(Ray));
+        int *tile_start = malloc((num_tiles + 1) * sizeof(int));
+        HitRecord *hits = malloc(num_rays * sizeof(HitRecord));
+        HitRecord *cut_hits = malloc(num_rays * sizeof(HitRecord));
+        TileCut *cuts = malloc(num_tiles * sizeof(TileCut));
+
+        int count = 0, tile = 0;
+        for (int tile_y = 0; tile_y < height; tile_y += RAY_TILE_SIZE)
+        {
+            for (int tile_x = 0; tile_x < width; tile_x += RAY_TILE_SIZE)
+            {
+                tile_start[tile++] = count;
+                for (int block_y = tile_y; block_y < tile_y + RAY_TILE_SIZE && block_y < height; block_y += RAY_BLOCK_HEIGHT)
+                {
+                    for (int block_x = tile_x; block_x < tile_x + RAY_TILE_SIZE && block_x < width; block_x += RAY_BLOCK_WIDTH)
+                    {
+                        for (int y = block_y; y < block_y + RAY_BLOCK_HEIGHT && y < height; y++)
+                        {
+                            for (int x = block_x; x < block_x + RAY_BLOCK_WIDTH && x < width; x++)
+                            {
+                                float u = ((float)x / width - 0.5f) * aspect_ratio;
+                                float v = (float)y / height - 0.5f;
+                                rays[count++] = get_camera_ray(&camera, u, -v);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        tile_start[num_tiles] = count;
+
+        double start = get_wall_time();
+        for (int i = 0; i < num_rays; i++)
+            hits[i] = ray_bvh_intersect(rays[i], bvh);
+        double single_time = get_wall_time() - start;
+
+        start = get_wall_time();
+        for (int i = 0; i < num_rays; i += RAY_PACKET_MAX)
+            ray_packet_intersect(&rays[i], num_rays - i < RAY_PACKET_MAX ? num_rays - i : RAY_PACKET_MAX, bvh, NULL, &cut_hits[i]);
+        double packet_time = get_wall_time() - start;
+
+        // Same corners as build_tile_cuts() in main.c, one pixel outside the tile
+        long long roots = 0;
+        start = get_wall_time();
+        for (int tile_y = 0, t = 0; tile_y < tiles_y; tile_y++)
+        {
+            for (int tile_x = 0; tile_x < tiles_x; tile_x++, t++)
+            {
+                int x0 = tile_x * RAY_TILE_SIZE, y0 = tile_y * RAY_TILE_SIZE;
+                int end_x = x0 + RAY_TILE_SIZE < width ? x0 + RAY_TILE_SIZE : width;
+                int end_y = y0 + RAY_TILE_SIZE < height ? y0 + RAY_TILE_SIZE : height;
+                float u0 = ((float)(x0 - 1) / width - 0.5f) * aspect_ratio;
+                float u1 = ((float)end_x / width - 0.5f) * aspect_ratio;
+                float v0 = (float)(y0 - 1) / height - 0.5f;
+                float v1 = (float)end_y / height - 0.5f;
+                tile_cut_build(bvh, &camera, u0, -v0, u1, -v1, &cuts[t]);
+                roots += cuts[t].count;
+            }
+        }
+        double cut_time = get_wall_time() - start;
+
+        start = get_wall_time();
+        for (int t = 0; t < num_tiles; t++)
+        {
+            for (int i = tile_start[t]; i < tile_start[t + 1]; i++)
+                cut_hits[i] = ray_bvh_intersect_subtrees(rays[i], bvh, cuts[t].roots, cuts[t].count);
+        }
+        double single_cut_time = get_wall_time() - start + cut_time;
+
+        // Distances only, spheres touching at the same t may be found in another order
+        int mismatches = 0;
+        for (int i = 0; i < num_rays; i++)
+        {
+            mismatches += hits[i].hit_something != cut_hits[i].hit_something ||
+                          (hits[i].hit_something && hits[i].t != cut_hits[i].t);
+        }
+
+        start = get_wall_time();
+        for (int t = 0; t < num_tiles; t++)
+        {
+            for (int i = tile_start[t]; i < tile_start[t + 1]; i += RAY_PACKET_MAX)
+            {
+                int packet_count = tile_start[t + 1] - i < RAY_PACKET_MAX ? tile_start[t + 1] - i : RAY_PACKET_MAX;
+                ray_packet_intersect_subtrees(&rays[i], packet_count, bvh, NULL, cuts[t].roots, cuts[t].count, &cut_hits[i]);
+            }
+        }
+        double packet_cut_time = get_wall_time() - start + cut_time;
+
+        for (int i = 0; i < num_rays; i++)
+        {
+            mismatches += hits[i].hit_something != cut_hits[i].hit_something ||
+                          (hits[i].hit_something && hits[i].t != cut_hits[i].t);
+        }
+
+        printf("%4dx%-4d %5d tiles, %.1f roots per tile, cuts built in %.2f ms, %d hits differ\n", width, height,
+               num_tiles, (double)roots / num_tiles, cut_time * 1000.0, mismatches);
+        printf("  single   %9.0f rays/s from the root, %9.0f rays/s from the cuts (%.2fx)\n",
+               num_rays / single_time, num_rays / single_cut_time, single_time / single_cut_time);
+        printf("  packets  %9.0f rays/s from the root, %9.0f rays/s from the cuts (%.2fx)\n",
+               num_rays / packet_time, num_rays / packet_cut_time, packet_time / packet_cut_time);
+
+        free(rays);
+        free(tile_start);
+        free(hits);
+        free(cut_hits);
+        free(cuts);
+    }
+    printf("\n");
+
+    bvh_free(bvh);
+    free(build_spheres);
+}
+
+// Brute force and BVH leaves with the sphere at a time test against the SIMD SoA kernel (sphere_soa.c),
+// on benchmark scenes of 4 to 16384 spheres. Reports the smallest scene where the BVH beats brute
+// force with the same sphere test (the crossover of the plot). SoA copies are built outside the timing.
+void benchmark_sphere_soa(int num_rays)
+{
+    Ray *rays = create_benchmark_rays(num_rays);
+    HitRecord *hits = malloc(num_rays * sizeof(HitRecord));
+    float world_size = 1000.0f;
+    int scalar_crossover = 0, soa_crossover = 0, mismatches = 0;
+
+    printf("SoA spheres (%s kernel, %d rays):\n", cpu_path_name(cpu_get_path()), num_rays);
+    printf("%8s %14s %14s %8s %14s %14s %8s\n", "spheres", "brute scalar", "brute SoA", "speedup", "BVH scalar",
+           "BVH SoA", "speedup");
+    for (int num_spheres = 4; num_spheres <= 16384; num_spheres *= 2)
+    {
+        Sphere *spheres = malloc(num_spheres * sizeof(Sphere));
+        for (int j = 0; j < num_spheres; j++)
+        {
+            Vec3 center = {
+                (float)rand() / RAND_MAX * world_size - world_size / 2,
+                (float)rand() / RAND_MAX * world_size - world_size / 2,
+                (float)rand() / RAND_MAX * world_size - world_size / 2};
+            spheres[j] = create_benchmark_sphere(center);
+        }
+
+        double start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+        {
+            Sphere *closest = NULL;
+            float t_max = INFINITY, t;
+            for (int j = 0; j < num_spheres; j++)
+            {
+                if (ray_sphere_hit_t(rays[r], &spheres[j], EPSILON, t_max, &t))
+                {
+                    closest = &spheres[j];
+                    t_max = t;
+                }
+            }
+            hits[r] = closest ? ray_sphere_hit_record(rays[r], closest, t_max) : (HitRecord){0};
+        }
+        double brute_time = get_wall_time() - start;
+
+        SphereSoA *soa = sphere_soa_build(spheres, num_spheres);
+        start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+        {
+            HitRecord hit = ray_spheres_closest_soa(rays[r], spheres, soa);
+            mismatches += hit.hit_something != hits[r].hit_something || hit.object != hits[r].object || hit.t != hits[r].t;
+        }
+        double brute_soa_time = get_wall_time() - start;
+        sphere_soa_free(soa);
+
+        // The build reorders the spheres, hits are compared by distance from here on
+        BVH *bvh = bvh_build(spheres, num_spheres);
+        start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+        {
+            HitRecord hit = ray_bvh_intersect(rays[r], bvh);
+            mismatches += hit.hit_something != hits[r].hit_something || hit.t != hits[r].t;
+        }
+        double bvh_time = get_wall_time() - start;
+
+        soa = sphere_soa_build(bvh->spheres, bvh->sphere_count);
+        start = get_wall_time();
+        for (int r = 0; r < num_rays; r++)
+        {
+            HitRecord hit = ray_bvh_intersect_soa(rays[r], bvh, soa);
+            mismatches += hit.hit_something != hits[r].hit_something || hit.t != hits[r].t;
+        }
+        double bvh_soa_time = get_wall_time() - start;
+        sphere_soa_free(soa);
+
+        if (!scalar_crossover && bvh_time < brute_time)
+            scalar_crossover = num_spheres;
+        if (!soa_crossover && bvh_soa_time < brute_soa_time)
+            soa_crossover = num_spheres;
+
+        printf("%8d %10.0f r/s %10.0f r/s %7.2fx %10.0f r/s %10.0f r/s %7.2fx\n", num_spheres, num_rays / brute_time,
+               num_rays / brute_soa_time, brute_time / brute_soa_time, num_rays / bvh_time, num_rays / bvh_soa_time,
+               bvh_time / bvh_soa_time);
+
+        bvh_free(bvh);
+        free(spheres);
+    }
+    printf("BVH faster than brute force from %d spheres (scalar), from %d spheres (SoA), %d hits differ\n\n",
+           scalar_crossover, soa_crossover, mismatches);
+
+    free(rays);
+    free(hits);
+}
+
+// The kernels of the runtime dispatch (cpu_dispatch.c) on every path this CPU supports, on the
+// interactive view : SoA brute force (every 97th primary ray), single rays through the BVH with SoA
+// leaves, ray packets of 16 pixels of a row and BVH8 (all primary rays), and the framebuffer
+// accumulation of 16 frames. Every path's results are
+// compared with the scalar path's.
+void benchmark_cpu_dispatch(Sphere *spheres, int num_spheres)
+{
+    Sphere *build_spheres = malloc(num_spheres * sizeof(Sphere));
+    memcpy(build_spheres, spheres, num_spheres * sizeof(Sphere));
+    BVH *bvh = bvh_build(build_spheres, num_spheres);
+    SphereSoA *soa = sphere_soa_build(bvh->spheres, bvh->sphere_count);
+    BVHWide *wide = bvh_wide_build(bvh, 8);
+
+    Camera camera = {.position = {0, 4, 50}, .yaw = -M_PI, .pitch = 0, .fov = 45.0f};
+    camera_update(&camera);
+    int num_pixels = WIDTH * HEIGHT, brute_step = 97, frames = 16;
+    Ray *rays = rsah_sample_camera_rays(&camera, WIDTH, HEIGHT);
+    HitRecord *hits = malloc(num_pixels * sizeof(HitRecord));
+    float *t[3];
+    for (int k = 0; k < 3; k++)
+        t[k] = malloc(num_pixels * sizeof(float));
+    SDL_Color *colors = malloc(num_pixels * sizeof(SDL_Color));
+    SDL_Color *shown = malloc(num_pixels * sizeof(SDL_Color));
+    SDL_Color *reference_shown = malloc(num_pixels * sizeof(SDL_Color));
+    float *accumulation = malloc(4 * num_pixels * sizeof(float));
+
+    // Scalar results
+    CpuPath active = cpu_get_path();
+    cpu_set_path(CPU_PATH_SCALAR);
+    for (int i = 0; i < num_pixels; i++)
+    {
+        HitRecord hit = ray_bvh_intersect(rays[i], bvh);
+        t[0][i] = t[1][i] = t[2][i] = hit.hit_something ? hit.t : INFINITY;
+        colors[i] = hit.hit_something ? hit.object->color : (SDL_Color){128, 178, 255, 255};
+    }
+    for (int frame = 1; frame <= frames; frame++)
+        framebuffer_accumulate(accumulation, colors, num_pixels, frame, reference_shown);
+
+    printf("CPU dispatch (%d spheres, %dx%d primary rays, widest path %s):\n", num_spheres, WIDTH, HEIGHT,
+           cpu_path_name(cpu_detect_path()));
+    for (CpuPath path = CPU_PATH_SCALAR; path < CPU_PATH_COUNT; path++)
+    {
+        if (!cpu_path_supported(path))
+            continue;
+        cpu_set_path(path);
+        int mismatches = 0;
+
+        double start = get_wall_time();
+        for (int i = 0; i < num_pixels; i += brute_step)
+        {
+            HitRecord hit = ray_spheres_closest_soa(rays[i], bvh->spheres, soa);
+            mismatches += (hit.hit_something ? hit.t : INFINITY) != t[0][i];
+        }
+        double brute_time = get_wall_time() - start;
+
+        start = get_wall_time();
+        for (int i = 0; i < num_pixels; i++)
+            hits[i] = ray_bvh_intersect_soa(rays[i], bvh, soa);
+        double single_time = get_wall_time() - start;
+        for (int i = 0; i < num_pixels; i++)
+            mismatches += (hits[i].hit_something ? hits[i].t : INFINITY) != t[0][i];
+
+        start = get_wall_time();
+        for (int i = 0; i < num_pixels; i += RAY_PACKET_MAX)
+            ray_packet_intersect(&rays[i], RAY_PACKET_MAX, bvh, soa, &hits[i]);
+        double packet_time = get_wall_time() - start;
+        for (int i = 0; i < num_pixels; i++)
+            mismatches += (hits[i].hit_something ? hits[i].t : INFINITY) != t[1][i];
+
+        start = get_wall_time();
+        for (int i = 0; i < num_pixels; i++)
+            hits[i] = ray_bvh_wide_intersect(rays[i], wide);
+        double wide_time = get_wall_time() - start;
+        for (int i = 0; i < num_pixels; i++)
+            mismatches += (hits[i].hit_something ? hits[i].t : INFINITY) != t[2][i];
+
+        start = get_wall_time();
+        for (int frame = 1; frame <= frames; frame++)
+            framebuffer_accumulate(accumulation, colors, num_pixels, frame, shown);
+        double framebuffer_time = get_wall_time() - start;
+        mismatches += memcmp(shown, reference_shown, num_pixels * sizeof(SDL_Color)) != 0;
+
+        printf("%-8s brute force %8.0f rays/s, BVH %9.0f rays/s, packets %9.0f rays/s, BVH8 %9.0f rays/s, "
+               "framebuffer %.3f ms, %d differ\n",
+               cpu_path_name(path), (num_pixels / brute_step) / brute_time, num_pixels / single_time,
+               num_pixels / packet_time, num_pixels / wide_time, framebuffer_time * 1000.0 / frames, mismatches);
+    }
+    printf("\n");
+    cpu_set_path(active);
+
+    for (int k = 0; k < 3; k++)
+        free(t[k]);
+    free(rays);
+    free(hits);
+    free(colors);
+    free(shown);
+    free(reference_shown);
+    free(accumulation);
+    bvh_wide_free(wide);
+    sphere_soa_free(soa);
+    bvh_free(bvh);
+    free(build_spheres);
+}
+
+static int bvh_trees_identical(BVHNode *a, Sphere *spheres_a, BVHNode *b, Sphere *spheres_b)
+{
+    if (!a || !b)
+        return a == b;
+    if (memcmp(&a->bounds, &b->bounds, sizeof(AABB)) != 0 || a->sphere_count != b->sphere_count)
+        return 0;
+    if ((a->sphere == NULL) != (b->sphere == NULL))
+        return 0;
+    if (a->sphere && (a->sphere - spheres_a != b->sphere - spheres_b ||
+                      memcmp(a->sphere, b->sphere, a->sphere_count * sizeof(Sphere)) != 0))
+        return 0;
+    return bvh_trees_identical(a->left, spheres_a, b->left, spheres_b) &&
+           bvh_trees_identical(a->right, spheres_a, b->right, spheres_b);
+}
+
+// Build time speedup against the thread count used by build_bvh_node.
+// Every parallel tree is compared with the serial (1 thread) tree, they have to be identical.
+void benchmark_parallel_build(Sphere *spheres, int num_spheres)
+{
+#ifdef _OPENMP
+    BVHBuildConfig default_config = bvh_get_build_config();
+    BVHBuildConfig config = default_config;
+    Sphere *serial_spheres = malloc(num_spheres * sizeof(Sphere));
+    Sphere *build_spheres = malloc(num_spheres * sizeof(Sphere));
+    int max_threads = omp_get_num_procs();
+
+    printf("Parallel BVH build with %d spheres (%d cores):\n", num_spheres, max_threads);
+
+    memcpy(serial_spheres, spheres, num_spheres * sizeof(Sphere));
+    config.thread_count = 1;
+    bvh_set_build_config(config);
+    double start = get_wall_time();
+    BVHNode *serial_root = build_bvh_node(serial_spheres, 0, num_spheres, 0);
+    double serial_time = get_wall_time() - start;
+    printf("Threads %3d: %f seconds, speedup 1.00x\n", 1, serial_time);
+
+    for (int threads = 2; threads < 2 * max_threads; threads *= 2)
+    {
+        if (threads > max_threads)
+            threads = max_threads;
+
+        memcpy(build_spheres, spheres, num_spheres * sizeof(Sphere));
+        config.thread_count = threads;
+        bvh_set_build_config(config);
+        start = get_wall_time();
+        BVHNode *root = build_bvh_node(build_spheres, 0, num_spheres, 0);
+        double time = get_wall_time() - start;
+
+        printf("Threads %3d: %f seconds, speedup %.2fx, tree %s\n", threads, time, serial_time / time,
+               bvh_trees_identical(serial_root, serial_spheres, root, build_spheres) ? "identical" : "DIFFERENT");
+        free_bvh(root);
+    }
+
+    bvh_set_build_config(default_config);
+    free_bvh(serial_root);
+    free(serial_spheres);
+    free(build_spheres);
+    printf("\n");
+#else
+    printf("Parallel BVH build benchmark skipped, compiled without OpenMP\n\n");
+#endif
+}
+
 void print_sphere_info(Sphere *spheres, int num_spheres) {
     printf("\nSphere Distribution Info:\n");
     float min_x = INFINITY, max_x = -INFINITY;
@@ -314,18 +1811,111 @@ void run_benchmark_with_plotting()
         }
         // print_sphere_info(spheres, num_spheres);
 
-        BVHNode *root = build_bvh_node(spheres, 0, num_spheres - 1, 20);
+        // Build time and SAH cost of the binned builder against the fixed 1/8 grid builder
+        Sphere *grid_spheres = malloc(num_spheres * sizeof(Sphere));
+        memcpy(grid_spheres, spheres, num_spheres * sizeof(Sphere));
+        clock_t build_start = clock();
+        BVHNode *grid_root = build_bvh_node_grid(grid_spheres, 0, num_spheres, 0);
+        double grid_build_time = (double)(clock() - build_start) / CLOCKS_PER_SEC;
+
+        build_start = clock();
+        BVHNode *root = build_bvh_node(spheres, 0, num_spheres, 0);
+        double binned_build_time = (double)(clock() - build_start) / CLOCKS_PER_SEC;
+
+        printf("BVH build (grid 1/8):  %f seconds, SAH cost %.2f\n", grid_build_time, bvh_sah_cost(grid_root));
+        printf("BVH build (binned %d): %f seconds, SAH cost %.2f\n\n",
+               bvh_get_build_config().bin_count, binned_build_time, bvh_sah_cost(root));
+        free_bvh(grid_root);
+        free(grid_spheres);
+
+        BVH *bvh = bvh_flatten(root, spheres, num_spheres);
+        benchmark_bvh_layout(root, bvh, num_rays);
+        free_bvh(root);
 
         double time_no_bvh = benchmark_no_bvh(spheres, num_spheres, num_rays);
-        double time_with_bvh = benchmark_with_bvh(root, num_spheres, num_rays);
+        double time_with_bvh = benchmark_with_bvh(bvh, num_spheres, num_rays);
+        benchmark_wide_bvh(spheres, num_spheres, num_rays);
 
         save_benchmark_data("benchmark_data.txt", num_spheres, time_no_bvh, time_with_bvh);
-        free_bvh(root);
+        bvh_free(bvh);
         free(spheres);
 
         printf("----------------------------------------\n");
     }
 
+    // Scene load time is dominated by the BVH build for large scenes, so build scaling is
+    // measured on a bigger scene than the ray tests above.
+    int build_test_spheres = 1000000;
+    Sphere *spheres = malloc(build_test_spheres * sizeof(Sphere));
+    for (int j = 0; j < 50000; j++)
+    {
+        Vec3 center = {
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2};
+        spheres[j] = create_benchmark_sphere(center);
+    }
+    benchmark_leaf_termination(spheres, 50000, num_rays);
+    benchmark_sphere_soa(num_rays);
+    benchmark_optimize(spheres, 50000, num_rays, 3);
+
+    // Interactive scene, then the same scene with a long tail of large radii (0.5 to 20)
+    for (int j = 0; j < 10000; j++)
+        spheres[j] = create_random_sphere();
+    benchmark_spatial_splits(spheres, 10000, num_rays);
+    for (int j = 0; j < 10000; j++)
+    {
+        float u = (float)rand() / RAND_MAX;
+        spheres[j].radius = 0.5f + 19.5f * u * u * u * u;
+    }
+    printf("Radii 0.5 to 20 - ");
+    benchmark_spatial_splits(spheres, 10000, num_rays);
+    for (int j = 0; j < 10000; j++)
+        spheres[j] = create_random_sphere();
+    benchmark_ray_distribution(spheres, 10000, 16);
+    printf("Interactive scene - ");
+    benchmark_wide_bvh(spheres, 10000, num_rays);
+    printf("Interactive scene - ");
+    benchmark_stackless(spheres, 10000);
+    benchmark_occlusion(spheres, 10000);
+    benchmark_packets(spheres, 10000);
+    benchmark_ray_stream(spheres, 10000);
+    benchmark_tile_frustum(spheres, 10000);
+    benchmark_cpu_dispatch(spheres, 10000);
+
+    for (int j = 0; j < 100000; j++)
+    {
+        Vec3 center = {
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2};
+        spheres[j] = create_benchmark_sphere(center);
+    }
+    benchmark_stackless(spheres, 100000);
+    benchmark_ray_stream(spheres, 100000);
+    benchmark_refit(spheres, 100000, 100, num_rays);
+    benchmark_dynamic_bvh(spheres, 100000, 10000, num_rays);
+    benchmark_instancing(1000, 1000, num_rays);
+
+    for (int j = 0; j < build_test_spheres; j++)
+    {
+        Vec3 center = {
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2};
+        spheres[j] = create_benchmark_sphere(center);
+    }
+    benchmark_builders(spheres, build_test_spheres, num_rays);
+    benchmark_parallel_build(spheres, build_test_spheres);
+    create_clustered_spheres(spheres, build_test_spheres, 200, world_size, 10.0f);
+    printf("Clustered scene (200 clusters) - ");
+    benchmark_builders(spheres, build_test_spheres, num_rays);
+    printf("Clustered scene (200 clusters) - ");
+    benchmark_wide_bvh(spheres, build_test_spheres, num_rays);
+    free(spheres);
+
+    benchmark_treelets(10000000, 100000);
+
     create_gnuplot_script("benchmark_data.txt");
     run_gnuplot();
     printf("\nBenchmark plot has been saved as 'benchmark_results.png'\n");
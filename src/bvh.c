@@ -1,11 +1,20 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "Custom/bvh.h"
 #include "Custom/ray.h"
 #include "Custom/vec3.h"
 #include "Custom/hit.h"
 #include "Custom/constants.h"
+#include "Custom/lbvh.h"
+#include "Custom/ploc.h"
+#include "Custom/sbvh.h"
+#include "Custom/rsah.h"
+#include "Custom/bvh_optimize.h"
 
 //----------------------------------------------------------------------------------------------------
 
@@ -25,24 +34,14 @@ AABB create_empty_aabb()
 
 AABB create_aabb_from_sphere(Sphere *sphere)
 {
-    return (AABB){
-        {sphere->center.x - sphere->radius,
-         sphere->center.y - sphere->radius,
-         sphere->center.z - sphere->radius},
-        {sphere->center.x + sphere->radius,
-         sphere->center.y + sphere->radius,
-         sphere->center.z + sphere->radius}};
+    Vec3A center = vec3a_load(sphere->center), radius = vec3a_set1(sphere->radius);
+    return (AABB){vec3a_store(vec3a_sub(center, radius)), vec3a_store(vec3a_add(center, radius))};
 }
 
 AABB combine_aabb(AABB a, AABB b)
 {
-    return (AABB){
-        {fmin(a.min.x, b.min.x),
-         fmin(a.min.y, b.min.y),
-         fmin(a.min.z, b.min.z)},
-        {fmax(a.max.x, b.max.x),
-         fmax(a.max.y, b.max.y),
-         fmax(a.max.z, b.max.z)}};
+    return (AABB){vec3a_store(vec3a_min(vec3a_load(a.min), vec3a_load(b.min))),
+                  vec3a_store(vec3a_max(vec3a_load(a.max), vec3a_load(b.max)))};
 }
 
 float get_aabb_surface_area(AABB box)
@@ -98,13 +97,10 @@ float evaluate_sah(Sphere *spheres, int start, int end, int axis, float split)
 
 //----------------------------------------------------------------------------------------------------
 
-// BVH (Bounding Volume Hierarchy) construction using a top-down approach.
-// Top-Down BVH Construction :
-// - Root Node Creation : contains all spheres as AABB.
-// - Object Partition : AABB partition with Surface Area Heurestics (SAH).
-// - Child Nodes Creation: Recursive creation and partitioning of child node.
-// - Repeat Until Leaf Nodes: Partioning until each subset contains a single sphere
-//                           or depth limit is reached (20 here)
+// Reference builder with the original fixed grid split search.
+// Every node tries 7 split planes (1/8 .. 7/8 of the node bounds) on each of the 3 axes and
+// rescans all of its spheres for every candidate with evaluate_sah().
+// Kept only so that the benchmark can compare build time and SAH cost against build_bvh_node().
 
 //----------------------------------------------------------------------------------------------------
 
@@ -114,7 +110,7 @@ static void debug_aabb(AABB box, const char* label) {
            box.max.x, box.max.y, box.max.z);
 }
 
-BVHNode *build_bvh_node(Sphere *spheres, int start, int end, int depth)
+BVHNode *build_bvh_node_grid(Sphere *spheres, int start, int end, int depth)
 {
     BVHNode *node = (BVHNode *)malloc(sizeof(BVHNode));
     node->bounds = create_empty_aabb();
@@ -200,10 +196,730 @@ BVHNode *build_bvh_node(Sphere *spheres, int start, int end, int depth)
         }
     }
 
-    node->left = build_bvh_node(spheres, start, mid, depth + 1);
-    node->right = build_bvh_node(spheres, mid, end, depth + 1);
+    node->left = build_bvh_node_grid(spheres, start, mid, depth + 1);
+    node->right = build_bvh_node_grid(spheres, mid, end, depth + 1);
+    node->sphere = NULL;
+    node->sphere_count = 0;
+
+    return node;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// BVH (Bounding Volume Hierarchy) construction using a top-down approach.
+// Top-Down BVH Construction :
+// - Root Node Creation : contains all spheres as AABB.
+// - Object Partition : AABB partition with binned Surface Area Heurestics (SAH).
+// - Child Nodes Creation: Recursive creation and partitioning of child node.
+// - Repeat Until Leaf Nodes: Partioning until splitting a subset costs more (SAH) than intersecting
+//                           all of its spheres (at most max_leaf_size), it contains a single
+//                           sphere or depth limit is reached (40 here)
+
+// Binned SAH :
+// - One pass over the spheres of a node computes its bounds, the bounds of the sphere centers
+//   and drops every sphere into one of bin_count bins per axis (by its center).
+// - A prefix sweep (left to right) and a suffix sweep (right to left) over the bins give the
+//   count and bounds on both sides of each of the bin_count - 1 candidate planes.
+// - Cost of a split = traversal_cost + intersection_cost * (nL * SA(L) + nR * SA(R)) / SA(node)
+// So a node costs O(n + bins) instead of the 21 full rescans of the grid builder.
+
+// Parallel build (OpenMP) :
+// - Subtrees with at least parallel_threshold spheres are built as tasks on the OpenMP thread pool.
+// - Nodes with at least parallel_split_threshold spheres also split the bounds/binning pass and the
+//   partition into fixed size chunks (BVH_PARALLEL_CHUNK) that run as tasks. Per chunk results are
+//   merged in chunk order and the partition of such nodes is stable, so the tree only depends on
+//   the node sizes and never on the number of threads - it is identical to the serial build.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    AABB bounds;
+    int count;
+} SAHBin;
+
+typedef struct
+{
+    AABB bounds;
+    AABB centroid_bounds;
+    SAHBin bins[3][BVH_MAX_SAH_BINS];
+    int left_count;
+} BuildChunk;
+
+#define BVH_DEFAULT_BUILD_CONFIG                                  \
+    {                                                             \
+        .builder = BVH_BUILDER_SAH,                               \
+        .bin_count = BVH_SAH_BINS,                                \
+        .traversal_cost = BVH_TRAVERSAL_COST,                     \
+        .intersection_cost = BVH_INTERSECTION_COST,               \
+        .thread_count = BVH_BUILD_THREADS,                        \
+        .parallel_threshold = BVH_PARALLEL_THRESHOLD,             \
+        .parallel_split_threshold = BVH_PARALLEL_SPLIT_THRESHOLD, \
+        .max_leaf_size = BVH_MAX_LEAF_SIZE,                       \
+        .morton_bits = LBVH_MORTON_BITS,                          \
+        .ploc_radius = PLOC_SEARCH_RADIUS,                        \
+        .optimize_rounds = BVH_OPTIMIZE_ROUNDS,                   \
+        .spatial_split_alpha = SBVH_SPATIAL_SPLIT_ALPHA,          \
+        .duplication_budget = SBVH_DUPLICATION_BUDGET,            \
+        .sample_rays = NULL,                                      \
+        .sample_ray_count = 0,                                    \
+        .ray_weight = RSAH_RAY_WEIGHT,                            \
+        .rebuild_growth = BVH_REFIT_REBUILD_GROWTH,               \
+        .subtree_rebuild_growth = BVH_REFIT_SUBTREE_GROWTH}
+
+static BVHBuildConfig build_config = BVH_DEFAULT_BUILD_CONFIG;
+
+BVHBuildConfig bvh_default_build_config()
+{
+    return (BVHBuildConfig)BVH_DEFAULT_BUILD_CONFIG;
+}
+
+BVHBuildConfig bvh_get_build_config()
+{
+    return build_config;
+}
+
+void bvh_set_build_config(BVHBuildConfig config)
+{
+    if (config.bin_count < 2)
+        config.bin_count = 2;
+    if (config.bin_count > BVH_MAX_SAH_BINS)
+        config.bin_count = BVH_MAX_SAH_BINS;
+    if (config.thread_count < 0)
+        config.thread_count = 0;
+    if (config.parallel_split_threshold < BVH_PARALLEL_CHUNK)
+        config.parallel_split_threshold = BVH_PARALLEL_CHUNK;
+    if (config.max_leaf_size < 1)
+        config.max_leaf_size = 1;
+    if (config.max_leaf_size > BVH_MAX_LEAF_LIMIT)
+        config.max_leaf_size = BVH_MAX_LEAF_LIMIT;
+    if (config.morton_bits != 30)
+        config.morton_bits = 63;
+    if (config.ploc_radius < 1)
+        config.ploc_radius = 1;
+    if (config.optimize_rounds < 0)
+        config.optimize_rounds = 0;
+    if (config.spatial_split_alpha < 0.0f)
+        config.spatial_split_alpha = 0.0f;
+    if (config.duplication_budget < 0.0f)
+        config.duplication_budget = 0.0f;
+    if (config.sample_ray_count < 0)
+        config.sample_ray_count = 0;
+    if (config.ray_weight < 0.0f)
+        config.ray_weight = 0.0f;
+    if (config.ray_weight > 1.0f)
+        config.ray_weight = 1.0f;
+    if (config.rebuild_growth < 1.0f)
+        config.rebuild_growth = 1.0f;
+    if (config.subtree_rebuild_growth < 1.0f)
+        config.subtree_rebuild_growth = 1.0f;
+    build_config = config;
+}
+
+static inline int sah_bin_index(float center, float min, float scale, int bin_count)
+{
+    int bin = (int)((center - min) * scale);
+    return bin < 0 ? 0 : (bin >= bin_count ? bin_count - 1 : bin);
+}
+
+static void compute_bounds_range(Sphere *spheres, int start, int end, AABB *bounds, AABB *centroid_bounds)
+{
+    *bounds = create_empty_aabb();
+    *centroid_bounds = create_empty_aabb();
+    for (int i = start; i < end; i++)
+    {
+        *bounds = combine_aabb(*bounds, create_aabb_from_sphere(&spheres[i]));
+        *centroid_bounds = combine_aabb(*centroid_bounds, (AABB){spheres[i].center, spheres[i].center});
+    }
+}
+
+static void fill_bins_range(Sphere *spheres, int start, int end, AABB centroid_bounds,
+                            const float scale[3], int bin_count, SAHBin bins[3][BVH_MAX_SAH_BINS])
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        for (int b = 0; b < bin_count; b++)
+        {
+            bins[axis][b].bounds = create_empty_aabb();
+            bins[axis][b].count = 0;
+        }
+    }
+
+    for (int i = start; i < end; i++)
+    {
+        AABB box = create_aabb_from_sphere(&spheres[i]);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (scale[axis] == 0.0f)
+                continue;
+            int b = sah_bin_index(vec3_axis(spheres[i].center, axis),
+                                  vec3_axis(centroid_bounds.min, axis), scale[axis], bin_count);
+            bins[axis][b].count++;
+            bins[axis][b].bounds = combine_aabb(bins[axis][b].bounds, box);
+        }
+    }
+}
+
+static int count_left_range(Sphere *spheres, int start, int end, int axis, float axis_min,
+                            float scale, int bin_count, int split_bin)
+{
+    int count = 0;
+    for (int i = start; i < end; i++)
+    {
+        if (sah_bin_index(vec3_axis(spheres[i].center, axis), axis_min, scale, bin_count) < split_bin)
+            count++;
+    }
+    return count;
+}
+
+// Picks the cheapest plane from the filled bins, returns 0 if no plane separates the spheres
+static int find_best_split(SAHBin bins[3][BVH_MAX_SAH_BINS], const float scale[3], int bin_count,
+                           AABB bounds, int *best_axis, int *best_bin, float *split_cost)
+{
+    float best_cost = INFINITY;
+    float parent_area = get_aabb_surface_area(bounds);
+    *best_axis = -1;
+    *split_cost = INFINITY;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (scale[axis] == 0.0f)
+            continue;
+
+        // left_cost[b] : nL * SA(L) for the plane between bin b and b + 1
+        float left_cost[BVH_MAX_SAH_BINS];
+        AABB left_bounds = create_empty_aabb();
+        int left_count = 0;
+        for (int b = 0; b < bin_count - 1; b++)
+        {
+            left_bounds = combine_aabb(left_bounds, bins[axis][b].bounds);
+            left_count += bins[axis][b].count;
+            left_cost[b] = left_count ? left_count * get_aabb_surface_area(left_bounds) : INFINITY;
+        }
+
+        AABB right_bounds = create_empty_aabb();
+        int right_count = 0;
+        for (int b = bin_count - 1; b > 0; b--)
+        {
+            right_bounds = combine_aabb(right_bounds, bins[axis][b].bounds);
+            right_count += bins[axis][b].count;
+            if (!right_count)
+                continue;
+
+            float cost = build_config.traversal_cost +
+                         build_config.intersection_cost *
+                             (left_cost[b - 1] + right_count * get_aabb_surface_area(right_bounds)) / parent_area;
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                *best_axis = axis;
+                *best_bin = b;
+            }
+        }
+    }
+
+    *split_cost = best_cost;
+    return *best_axis >= 0;
+}
+
+// Leaf termination : keep the spheres together when intersecting all of them is not more expensive
+// than the cheapest split (same normalisation as the split cost, so the leaf costs Ci * n).
+// If no plane separates the spheres (all centers coincide) split_cost is INFINITY.
+static int should_make_leaf(int num_spheres, float split_cost)
+{
+    return num_spheres <= build_config.max_leaf_size &&
+           build_config.intersection_cost * num_spheres <= split_cost;
+}
+
+// Bounds, binning and stable partition of a large node, split into chunks that run as tasks.
+// Returns the partition point, or -1 if the node should become a leaf.
+static int split_node_chunked(Sphere *spheres, int start, int end, AABB *node_bounds)
+{
+    const int bin_count = build_config.bin_count;
+    int num_spheres = end - start;
+    int num_chunks = (num_spheres + BVH_PARALLEL_CHUNK - 1) / BVH_PARALLEL_CHUNK;
+    BuildChunk *chunks = (BuildChunk *)malloc(num_chunks * sizeof(BuildChunk));
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < num_chunks; c++)
+    {
+        int chunk_start = start + c * BVH_PARALLEL_CHUNK;
+        int chunk_end = chunk_start + BVH_PARALLEL_CHUNK < end ? chunk_start + BVH_PARALLEL_CHUNK : end;
+        compute_bounds_range(spheres, chunk_start, chunk_end, &chunks[c].bounds, &chunks[c].centroid_bounds);
+    }
+
+    AABB bounds = create_empty_aabb();
+    AABB centroid_bounds = create_empty_aabb();
+    for (int c = 0; c < num_chunks; c++)
+    {
+        bounds = combine_aabb(bounds, chunks[c].bounds);
+        centroid_bounds = combine_aabb(centroid_bounds, chunks[c].centroid_bounds);
+    }
+    *node_bounds = bounds;
+
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float extent = vec3_axis(centroid_bounds.max, axis) - vec3_axis(centroid_bounds.min, axis);
+        scale[axis] = extent > 0.0f ? bin_count / extent : 0.0f;
+    }
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < num_chunks; c++)
+    {
+        int chunk_start = start + c * BVH_PARALLEL_CHUNK;
+        int chunk_end = chunk_start + BVH_PARALLEL_CHUNK < end ? chunk_start + BVH_PARALLEL_CHUNK : end;
+        fill_bins_range(spheres, chunk_start, chunk_end, centroid_bounds, scale, bin_count, chunks[c].bins);
+    }
+
+    SAHBin bins[3][BVH_MAX_SAH_BINS];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        for (int b = 0; b < bin_count; b++)
+        {
+            bins[axis][b].bounds = create_empty_aabb();
+            bins[axis][b].count = 0;
+            for (int c = 0; c < num_chunks; c++)
+            {
+                bins[axis][b].bounds = combine_aabb(bins[axis][b].bounds, chunks[c].bins[axis][b].bounds);
+                bins[axis][b].count += chunks[c].bins[axis][b].count;
+            }
+        }
+    }
+
+    int best_axis, best_bin;
+    float split_cost;
+    // Chunked nodes are always far bigger than a leaf, so there is no leaf test here
+    if (!find_best_split(bins, scale, bin_count, bounds, &best_axis, &best_bin, &split_cost))
+    {
+        free(chunks);
+        return start + num_spheres / 2;
+    }
+    float axis_min = vec3_axis(centroid_bounds.min, best_axis);
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < num_chunks; c++)
+    {
+        int chunk_start = start + c * BVH_PARALLEL_CHUNK;
+        int chunk_end = chunk_start + BVH_PARALLEL_CHUNK < end ? chunk_start + BVH_PARALLEL_CHUNK : end;
+        chunks[c].left_count = count_left_range(spheres, chunk_start, chunk_end, best_axis, axis_min,
+                                                scale[best_axis], bin_count, best_bin);
+    }
+
+    // Exclusive prefix sums give every chunk its write offsets on both sides of the split
+    int total_left = 0;
+    for (int c = 0; c < num_chunks; c++)
+        total_left += chunks[c].left_count;
+
+    int *left_offset = (int *)malloc(2 * num_chunks * sizeof(int));
+    int *right_offset = left_offset + num_chunks;
+    int left_sum = 0, right_sum = total_left;
+    for (int c = 0; c < num_chunks; c++)
+    {
+        int chunk_size = (c == num_chunks - 1) ? num_spheres - c * BVH_PARALLEL_CHUNK : BVH_PARALLEL_CHUNK;
+        left_offset[c] = left_sum;
+        right_offset[c] = right_sum;
+        left_sum += chunks[c].left_count;
+        right_sum += chunk_size - chunks[c].left_count;
+    }
+
+    Sphere *scratch = (Sphere *)malloc(num_spheres * sizeof(Sphere));
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < num_chunks; c++)
+    {
+        int chunk_start = start + c * BVH_PARALLEL_CHUNK;
+        int chunk_end = chunk_start + BVH_PARALLEL_CHUNK < end ? chunk_start + BVH_PARALLEL_CHUNK : end;
+        int l = left_offset[c], r = right_offset[c];
+        for (int i = chunk_start; i < chunk_end; i++)
+        {
+            int b = sah_bin_index(vec3_axis(spheres[i].center, best_axis), axis_min, scale[best_axis], bin_count);
+            scratch[b < best_bin ? l++ : r++] = spheres[i];
+        }
+    }
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < num_chunks; c++)
+    {
+        int chunk_start = c * BVH_PARALLEL_CHUNK;
+        int chunk_size = (c == num_chunks - 1) ? num_spheres - chunk_start : BVH_PARALLEL_CHUNK;
+        memcpy(&spheres[start + chunk_start], &scratch[chunk_start], chunk_size * sizeof(Sphere));
+    }
+
+    free(scratch);
+    free(left_offset);
+    free(chunks);
+    return start + total_left;
+}
+
+// Bounds, binning and in place partition of a node on the calling thread.
+// Returns the partition point, or -1 if the node should become a leaf.
+static int split_node_serial(Sphere *spheres, int start, int end, AABB *node_bounds)
+{
+    const int bin_count = build_config.bin_count;
+    AABB centroid_bounds;
+    compute_bounds_range(spheres, start, end, node_bounds, &centroid_bounds);
+
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float extent = vec3_axis(centroid_bounds.max, axis) - vec3_axis(centroid_bounds.min, axis);
+        scale[axis] = extent > 0.0f ? bin_count / extent : 0.0f;
+    }
+
+    SAHBin bins[3][BVH_MAX_SAH_BINS];
+    fill_bins_range(spheres, start, end, centroid_bounds, scale, bin_count, bins);
+
+    int best_axis, best_bin;
+    float split_cost;
+    int found_split = find_best_split(bins, scale, bin_count, *node_bounds, &best_axis, &best_bin, &split_cost);
+    if (should_make_leaf(end - start, split_cost))
+        return -1;
+    if (!found_split)
+        return start + (end - start) / 2; // too many spheres for one leaf, split the range in half
+
+    float axis_min = vec3_axis(centroid_bounds.min, best_axis);
+    int mid = start;
+    for (int i = start; i < end; i++)
+    {
+        int b = sah_bin_index(vec3_axis(spheres[i].center, best_axis), axis_min, scale[best_axis], bin_count);
+        if (b < best_bin)
+        {
+            Sphere temp = spheres[i];
+            spheres[i] = spheres[mid];
+            spheres[mid] = temp;
+            mid++;
+        }
+    }
+    return mid;
+}
+
+static BVHNode *build_bvh_recursive(Sphere *spheres, int start, int end, int depth)
+{
+    BVHNode *node = (BVHNode *)malloc(sizeof(BVHNode));
+    int num_spheres = end - start;
+
+    if (num_spheres <= 1 || depth >= 40)
+    {
+        AABB centroid_bounds;
+        compute_bounds_range(spheres, start, end, &node->bounds, &centroid_bounds);
+        node->left = node->right = NULL;
+        node->sphere = &spheres[start];
+        node->sphere_count = num_spheres;
+        return node;
+    }
+
+    int mid;
+    if (num_spheres >= build_config.parallel_split_threshold)
+        mid = split_node_chunked(spheres, start, end, &node->bounds);
+    else
+        mid = split_node_serial(spheres, start, end, &node->bounds);
+
+    if (mid < 0)
+    {
+        node->left = node->right = NULL;
+        node->sphere = &spheres[start];
+        node->sphere_count = num_spheres;
+        return node;
+    }
+
+    if (num_spheres >= build_config.parallel_threshold)
+    {
+#pragma omp task
+        node->left = build_bvh_recursive(spheres, start, mid, depth + 1);
+#pragma omp task
+        node->right = build_bvh_recursive(spheres, mid, end, depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        node->left = build_bvh_recursive(spheres, start, mid, depth + 1);
+        node->right = build_bvh_recursive(spheres, mid, end, depth + 1);
+    }
     node->sphere = NULL;
     node->sphere_count = 0;
 
     return node;
 }
+
+BVHNode *build_bvh_node(Sphere *spheres, int start, int end, int depth)
+{
+#ifdef _OPENMP
+    if (build_config.thread_count != 1 && !omp_in_parallel() && end - start >= build_config.parallel_threshold)
+    {
+        BVHNode *root = NULL;
+        int threads = build_config.thread_count > 0 ? build_config.thread_count : omp_get_max_threads();
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+        root = build_bvh_recursive(spheres, start, end, depth);
+        return root;
+    }
+#endif
+    return build_bvh_recursive(spheres, start, end, depth);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// bvh_sah_cost() - SAH cost of a built tree, normalised by the surface area of the root
+// cost = sum(interior) Ct * SA(n) / SA(root) + sum(leaves) Ci * count * SA(n) / SA(root)
+// Used for comparing the quality of trees from different builders.
+
+//----------------------------------------------------------------------------------------------------
+
+static float bvh_sah_cost_recursive(BVHNode *node)
+{
+    float area = get_aabb_surface_area(node->bounds);
+    if (!node->left)
+        return build_config.intersection_cost * node->sphere_count * area;
+
+    return build_config.traversal_cost * area +
+           bvh_sah_cost_recursive(node->left) +
+           bvh_sah_cost_recursive(node->right);
+}
+
+float bvh_sah_cost(BVHNode *root)
+{
+    if (!root)
+        return 0.0f;
+    return bvh_sah_cost_recursive(root) / get_aabb_surface_area(root->bounds);
+}
+
+int bvh_count_nodes(BVHNode *node)
+{
+    if (!node)
+        return 0;
+    return 1 + bvh_count_nodes(node->left) + bvh_count_nodes(node->right);
+}
+
+void free_bvh(BVHNode *node)
+{
+    if (!node)
+        return;
+    free_bvh(node->left);
+    free_bvh(node->right);
+    free(node);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Linear BVH
+// The pointer tree from build_bvh_node() is flattened into one contiguous array of 32 byte nodes
+// in depth first order - the left child of node i is node i + 1, only the right child index is stored.
+// Leaves store the index of their first sphere in the (already reordered) sphere array.
+// The BVH struct and its nodes share one arena, so bvh_free() is a single free.
+
+//----------------------------------------------------------------------------------------------------
+
+static uint32_t flatten_recursive(BVHNode *node, BVH *bvh, uint32_t *next)
+{
+    uint32_t index = (*next)++;
+    BVHFlatNode *flat = &bvh->nodes[index];
+    flat->bounds = node->bounds;
+
+    if (!node->left)
+    {
+        flat->right_or_first = (uint32_t)(node->sphere - bvh->spheres);
+        flat->count = (uint32_t)node->sphere_count;
+        return index;
+    }
+
+    flatten_recursive(node->left, bvh, next);
+    flat->right_or_first = flatten_recursive(node->right, bvh, next);
+    flat->count = 0;
+    return index;
+}
+
+static BVH *allocate_linear_bvh(int num_spheres, int node_count, size_t sphere_bytes)
+{
+    Arena arena = arena_create(sizeof(BVH) + node_count * sizeof(BVHFlatNode) + sphere_bytes + 128);
+    if (!arena.base)
+    {
+        printf("Failed to allocate memory for the BVH (%d nodes)\n", node_count);
+        return NULL;
+    }
+
+    BVH *bvh = (BVH *)arena_alloc(&arena, sizeof(BVH), 64);
+    bvh->nodes = (BVHFlatNode *)arena_alloc(&arena, node_count * sizeof(BVHFlatNode), 32);
+    bvh->node_count = node_count;
+    bvh->spheres = sphere_bytes ? (Sphere *)arena_alloc(&arena, sphere_bytes, 32) : NULL;
+    bvh->sphere_count = num_spheres;
+    bvh->owns_spheres = sphere_bytes != 0;
+    bvh->arena = arena;
+    return bvh;
+}
+
+// Allocates an empty linear BVH with room for node_count nodes, used by every builder
+BVH *bvh_allocate(Sphere *spheres, int num_spheres, int node_count)
+{
+    BVH *bvh = allocate_linear_bvh(num_spheres, node_count, 0);
+    if (bvh)
+        bvh->spheres = spheres;
+    return bvh;
+}
+
+// Same as bvh_allocate(), but the BVH gets its own sphere array of num_spheres entries in the arena.
+// Used by builders that reference a sphere from more than one leaf (sbvh.c).
+BVH *bvh_allocate_owned(int num_spheres, int node_count)
+{
+    return allocate_linear_bvh(num_spheres, node_count, num_spheres * sizeof(Sphere));
+}
+
+static inline float node_center(const BVHFlatNode *node, int axis)
+{
+    switch (axis)
+    {
+    case 0:
+        return node->bounds.min.x + node->bounds.max.x;
+    case 1:
+        return node->bounds.min.y + node->bounds.max.y;
+    default:
+        return node->bounds.min.z + node->bounds.max.z;
+    }
+}
+
+// Sets axis / axis_flip of every node from the centers of its children, so the traversal can
+// visit the nearer child first from the sign of the ray direction. Leaves get axis 0.
+// Called by every producer of flat nodes once the nodes are written.
+void bvh_assign_split_axes(BVHFlatNode *nodes, int node_count)
+{
+    for (int i = 0; i < node_count; i++)
+    {
+        BVHFlatNode *node = &nodes[i];
+        node->axis = 0;
+        node->axis_flip = 0;
+        if (node->count)
+            continue;
+
+        const BVHFlatNode *left = &nodes[i + 1], *right = &nodes[node->right_or_first];
+        float best = -1.0f;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float d = node_center(right, axis) - node_center(left, axis);
+            if (fabsf(d) > best)
+            {
+                best = fabsf(d);
+                node->axis = axis;
+                node->axis_flip = d < 0.0f;
+            }
+        }
+    }
+}
+
+BVH *bvh_flatten(BVHNode *root, Sphere *spheres, int num_spheres)
+{
+    int node_count = bvh_count_nodes(root);
+    if (root && !root->left && root->sphere_count == 0)
+        node_count = 0;
+
+    BVH *bvh = bvh_allocate(spheres, num_spheres, node_count);
+    if (!bvh)
+        return NULL;
+
+    uint32_t next = 0;
+    if (node_count)
+        flatten_recursive(root, bvh, &next);
+    bvh_assign_split_axes(bvh->nodes, node_count);
+    return bvh;
+}
+
+// Builds a linear BVH over the spheres with the configured builder, followed by the optional
+// treelet optimization pass (bvh_optimize.c) when optimize_rounds is set.
+// Reorders the given sphere array, the BVH keeps pointing to it.
+BVH *bvh_build(Sphere *spheres, int num_spheres)
+{
+    BVH *bvh;
+    switch (build_config.builder)
+    {
+    case BVH_BUILDER_LBVH:
+        bvh = lbvh_build(spheres, num_spheres);
+        break;
+    case BVH_BUILDER_PLOC:
+        bvh = ploc_build(spheres, num_spheres);
+        break;
+    case BVH_BUILDER_SBVH:
+        bvh = sbvh_build(spheres, num_spheres);
+        break;
+    case BVH_BUILDER_RSAH:
+        bvh = rsah_build(spheres, num_spheres);
+        break;
+    case BVH_BUILDER_SAH:
+    default:
+    {
+        BVHNode *root = build_bvh_node(spheres, 0, num_spheres, 0);
+        bvh = bvh_flatten(root, spheres, num_spheres);
+        free_bvh(root);
+        break;
+    }
+    }
+
+    if (bvh && build_config.optimize_rounds > 0)
+        bvh_optimize(bvh, build_config.optimize_rounds);
+    return bvh;
+}
+
+const char *bvh_builder_name(BVHBuilder builder)
+{
+    switch (builder)
+    {
+    case BVH_BUILDER_LBVH:
+        return "LBVH";
+    case BVH_BUILDER_PLOC:
+        return "PLOC";
+    case BVH_BUILDER_SBVH:
+        return "SBVH";
+    case BVH_BUILDER_RSAH:
+        return "RSAH";
+    case BVH_BUILDER_SAH:
+    default:
+        return "Binned SAH";
+    }
+}
+
+void bvh_free(BVH *bvh)
+{
+    if (!bvh)
+        return;
+    Arena arena = bvh->arena;
+    arena_destroy(&arena);
+}
+
+// Same cost as bvh_sah_cost(), for the linear BVH of any builder
+float bvh_flat_sah_cost(const BVH *bvh)
+{
+    if (!bvh || bvh->node_count == 0)
+        return 0.0f;
+
+    float cost = 0.0f;
+    for (int i = 0; i < bvh->node_count; i++)
+    {
+        const BVHFlatNode *node = &bvh->nodes[i];
+        float area = get_aabb_surface_area(node->bounds);
+        cost += node->count ? build_config.intersection_cost * node->count * area
+                            : build_config.traversal_cost * area;
+    }
+    return cost / get_aabb_surface_area(bvh->nodes[0].bounds);
+}
+
+// Sum of the surface area shared by the two children of every interior node, relative to the root.
+// Rays through the shared volume have to visit both children, 0 means no sibling overlaps.
+float bvh_flat_overlap(const BVH *bvh)
+{
+    if (!bvh || bvh->node_count == 0)
+        return 0.0f;
+
+    float overlap = 0.0f;
+    for (int i = 0; i < bvh->node_count; i++)
+    {
+        const BVHFlatNode *node = &bvh->nodes[i];
+        if (node->count)
+            continue;
+
+        AABB left = bvh->nodes[i + 1].bounds;
+        AABB right = bvh->nodes[node->right_or_first].bounds;
+        AABB shared = {vec3a_store(vec3a_max(vec3a_load(left.min), vec3a_load(right.min))),
+                       vec3a_store(vec3a_min(vec3a_load(left.max), vec3a_load(right.max)))};
+        if (shared.min.x < shared.max.x && shared.min.y < shared.max.y && shared.min.z < shared.max.z)
+            overlap += get_aabb_surface_area(shared);
+    }
+    return overlap / get_aabb_surface_area(bvh->nodes[0].bounds);
+}
@@ -0,0 +1,430 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/bvh_dynamic.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Dynamic BVH for scenes edited one sphere at a time (insert / remove / move without a rebuild)
+// Binary tree in a growable node pool (indices, not pointers), one sphere per leaf. A free list
+// reuses removed nodes, so handles (leaf indices) of other spheres stay valid.
+// - Insert picks the sibling for the new leaf by SAH : pairing the leaf with node S costs the area of
+//   the new parent plus the area growth of every ancestor of S. The search starts at the root and
+//   goes down into the child with the lower bound on that cost, stopping when neither child can beat
+//   the best sibling found so far (Bittner et al. 2012, greedy descent as in Box2D).
+// - Remove replaces the leaf's parent with the leaf's sibling.
+// - Update removes the leaf and inserts it again unless its bounds did not change.
+// After every change the ancestors are refitted bottom-up and each of them tries tree rotations
+// (Kopta et al. 2012) : a child is swapped with one of its sibling's children when that shrinks the
+// sibling. This keeps the tree close to an SAH build without ever touching more than O(depth) nodes.
+// ray_bvh_intersect() needs the depth first node layout, bvh_dynamic_flat() writes it (O(n), only
+// when the tree changed since the last call).
+
+//----------------------------------------------------------------------------------------------------
+
+static int allocate_node(DynamicBVH *tree)
+{
+    if (tree->free_list == -1)
+    {
+        int capacity = tree->capacity ? tree->capacity * 2 : 16;
+        DynamicBVHNode *nodes = realloc(tree->nodes, capacity * sizeof(DynamicBVHNode));
+        if (!nodes)
+        {
+            printf("Failed to grow the dynamic BVH to %d nodes\n", capacity);
+            return -1;
+        }
+        for (int i = tree->capacity; i < capacity; i++)
+        {
+            nodes[i].parent = i + 1 < capacity ? i + 1 : -1;
+            nodes[i].height = -1;
+        }
+        tree->nodes = nodes;
+        tree->free_list = tree->capacity;
+        tree->capacity = capacity;
+    }
+
+    int index = tree->free_list;
+    DynamicBVHNode *node = &tree->nodes[index];
+    tree->free_list = node->parent;
+    node->parent = node->child1 = node->child2 = -1;
+    node->height = 0;
+    return index;
+}
+
+static void free_node(DynamicBVH *tree, int index)
+{
+    tree->nodes[index].parent = tree->free_list;
+    tree->nodes[index].height = -1;
+    tree->free_list = index;
+}
+
+DynamicBVH *bvh_dynamic_create(int capacity)
+{
+    DynamicBVH *tree = calloc(1, sizeof(DynamicBVH));
+    if (!tree)
+        return NULL;
+
+    tree->root = -1;
+    tree->free_list = -1;
+    if (capacity > 0)
+    {
+        // A tree over n spheres has 2n - 1 nodes, growing the empty pool allocates exactly this many
+        tree->nodes = malloc((2 * capacity - 1) * sizeof(DynamicBVHNode));
+        if (tree->nodes)
+        {
+            tree->capacity = 2 * capacity - 1;
+            for (int i = 0; i < tree->capacity; i++)
+            {
+                tree->nodes[i].parent = i + 1 < tree->capacity ? i + 1 : -1;
+                tree->nodes[i].height = -1;
+            }
+            tree->free_list = 0;
+        }
+    }
+    return tree;
+}
+
+void bvh_dynamic_destroy(DynamicBVH *tree)
+{
+    if (!tree)
+        return;
+    bvh_free(tree->flat);
+    free(tree->nodes);
+    free(tree);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Sibling selection and rotations
+
+//----------------------------------------------------------------------------------------------------
+
+static int find_best_sibling(const DynamicBVH *tree, AABB leaf_bounds)
+{
+    const DynamicBVHNode *nodes = tree->nodes;
+    float leaf_area = get_aabb_surface_area(leaf_bounds);
+
+    int index = tree->root;
+    float area = get_aabb_surface_area(nodes[index].bounds);
+    float direct_cost = get_aabb_surface_area(combine_aabb(nodes[index].bounds, leaf_bounds));
+    float inherited_cost = 0.0f;
+
+    int best_sibling = index;
+    float best_cost = direct_cost;
+
+    while (nodes[index].height > 0)
+    {
+        // Every node from here up grows to hold the leaf, whichever descendant becomes the sibling
+        inherited_cost += direct_cost - area;
+
+        int children[2] = {nodes[index].child1, nodes[index].child2};
+        float child_area[2], child_direct[2], lower_bound[2];
+        for (int c = 0; c < 2; c++)
+        {
+            const DynamicBVHNode *child = &nodes[children[c]];
+            child_area[c] = get_aabb_surface_area(child->bounds);
+            child_direct[c] = get_aabb_surface_area(combine_aabb(child->bounds, leaf_bounds));
+
+            float cost = child_direct[c] + inherited_cost;
+            if (cost < best_cost)
+            {
+                best_sibling = children[c];
+                best_cost = cost;
+            }
+
+            // Going deeper still grows this child and adds a parent at least as large as the leaf
+            lower_bound[c] = child->height > 0
+                                 ? inherited_cost + child_direct[c] - child_area[c] + leaf_area
+                                 : INFINITY;
+        }
+
+        if (lower_bound[0] >= best_cost && lower_bound[1] >= best_cost)
+            break;
+
+        int c = lower_bound[1] < lower_bound[0];
+        index = children[c];
+        area = child_area[c];
+        direct_cost = child_direct[c];
+    }
+    return best_sibling;
+}
+
+// Node a has the children child and aunt, the child swaps places with the aunt's child grandchild.
+// Only the aunt's bounds change, a still covers the same subtrees.
+static void swap_with_grandchild(DynamicBVH *tree, int a, int child, int aunt, int grandchild)
+{
+    DynamicBVHNode *nodes = tree->nodes;
+
+    if (nodes[a].child1 == child)
+        nodes[a].child1 = grandchild;
+    else
+        nodes[a].child2 = grandchild;
+
+    int other;
+    if (nodes[aunt].child1 == grandchild)
+    {
+        nodes[aunt].child1 = child;
+        other = nodes[aunt].child2;
+    }
+    else
+    {
+        nodes[aunt].child2 = child;
+        other = nodes[aunt].child1;
+    }
+
+    nodes[grandchild].parent = a;
+    nodes[child].parent = aunt;
+
+    nodes[aunt].bounds = combine_aabb(nodes[child].bounds, nodes[other].bounds);
+    nodes[aunt].height = 1 + (nodes[child].height > nodes[other].height ? nodes[child].height : nodes[other].height);
+    nodes[a].height = 1 + (nodes[grandchild].height > nodes[aunt].height ? nodes[grandchild].height : nodes[aunt].height);
+    tree->rotations++;
+}
+
+// Tries the four rotations at interior node a (each child against each child of its sibling) and
+// applies the one that shrinks the changed sibling the most, if any
+static void rotate_node(DynamicBVH *tree, int a)
+{
+    const DynamicBVHNode *nodes = tree->nodes;
+    int b = nodes[a].child1;
+    int c = nodes[a].child2;
+
+    float best_delta = 0.0f;
+    int best_child = -1, best_aunt = -1, best_grandchild = -1;
+
+    for (int side = 0; side < 2; side++)
+    {
+        int child = side ? c : b;
+        int aunt = side ? b : c;
+        if (nodes[aunt].height == 0)
+            continue;
+
+        float aunt_area = get_aabb_surface_area(nodes[aunt].bounds);
+        int grandchildren[2] = {nodes[aunt].child1, nodes[aunt].child2};
+        for (int g = 0; g < 2; g++)
+        {
+            // The aunt would hold the child and the grandchild that stays
+            AABB bounds = combine_aabb(nodes[child].bounds, nodes[grandchildren[1 - g]].bounds);
+            float delta = get_aabb_surface_area(bounds) - aunt_area;
+            if (delta < best_delta)
+            {
+                best_delta = delta;
+                best_child = child;
+                best_aunt = aunt;
+                best_grandchild = grandchildren[g];
+            }
+        }
+    }
+
+    if (best_child != -1)
+        swap_with_grandchild(tree, a, best_child, best_aunt, best_grandchild);
+}
+
+// Refits the bounds and heights of index and everything above it, rotating on the way up
+static void refit_ancestors(DynamicBVH *tree, int index)
+{
+    while (index != -1)
+    {
+        DynamicBVHNode *node = &tree->nodes[index];
+        const DynamicBVHNode *child1 = &tree->nodes[node->child1];
+        const DynamicBVHNode *child2 = &tree->nodes[node->child2];
+        node->bounds = combine_aabb(child1->bounds, child2->bounds);
+        node->height = 1 + (child1->height > child2->height ? child1->height : child2->height);
+
+        rotate_node(tree, index);
+        index = node->parent;
+    }
+}
+
+// Links a detached leaf into the tree, parent is a free node (unused when the tree is empty)
+static void insert_leaf(DynamicBVH *tree, int leaf, int parent)
+{
+    DynamicBVHNode *nodes = tree->nodes;
+    if (tree->root == -1)
+    {
+        nodes[leaf].parent = -1;
+        tree->root = leaf;
+        return;
+    }
+
+    int sibling = find_best_sibling(tree, nodes[leaf].bounds);
+    int old_parent = nodes[sibling].parent;
+
+    nodes[parent].parent = old_parent;
+    nodes[parent].child1 = sibling;
+    nodes[parent].child2 = leaf;
+    nodes[sibling].parent = parent;
+    nodes[leaf].parent = parent;
+
+    if (old_parent == -1)
+        tree->root = parent;
+    else if (nodes[old_parent].child1 == sibling)
+        nodes[old_parent].child1 = parent;
+    else
+        nodes[old_parent].child2 = parent;
+
+    refit_ancestors(tree, parent);
+}
+
+// Unlinks a leaf, its parent goes back to the free list and the sibling takes the parent's place
+static void remove_leaf(DynamicBVH *tree, int leaf)
+{
+    DynamicBVHNode *nodes = tree->nodes;
+    if (leaf == tree->root)
+    {
+        tree->root = -1;
+        return;
+    }
+
+    int parent = nodes[leaf].parent;
+    int grandparent = nodes[parent].parent;
+    int sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+
+    nodes[sibling].parent = grandparent;
+    if (grandparent == -1)
+        tree->root = sibling;
+    else if (nodes[grandparent].child1 == parent)
+        nodes[grandparent].child1 = sibling;
+    else
+        nodes[grandparent].child2 = sibling;
+
+    free_node(tree, parent);
+    nodes[leaf].parent = -1;
+    refit_ancestors(tree, grandparent);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Public operations, O(depth) each
+
+//----------------------------------------------------------------------------------------------------
+
+static int is_valid_handle(const DynamicBVH *tree, int handle)
+{
+    if (handle >= 0 && handle < tree->capacity && tree->nodes[handle].height == 0)
+        return 1;
+    printf("Invalid dynamic BVH handle %d\n", handle);
+    return 0;
+}
+
+// Returns the handle of the new sphere, -1 if the node pool could not grow
+int bvh_dynamic_insert(DynamicBVH *tree, Sphere sphere)
+{
+    int leaf = allocate_node(tree);
+    if (leaf == -1)
+        return -1;
+
+    int parent = -1;
+    if (tree->root != -1)
+    {
+        parent = allocate_node(tree);
+        if (parent == -1)
+        {
+            free_node(tree, leaf);
+            return -1;
+        }
+    }
+
+    DynamicBVHNode *node = &tree->nodes[leaf];
+    node->sphere = sphere;
+    node->bounds = create_aabb_from_sphere(&node->sphere);
+    insert_leaf(tree, leaf, parent);
+
+    tree->sphere_count++;
+    tree->flat_dirty = 1;
+    return leaf;
+}
+
+void bvh_dynamic_remove(DynamicBVH *tree, int handle)
+{
+    if (!is_valid_handle(tree, handle))
+        return;
+
+    remove_leaf(tree, handle);
+    free_node(tree, handle);
+    tree->sphere_count--;
+    tree->flat_dirty = 1;
+}
+
+// Replaces the sphere behind handle (new center, radius or color), the handle stays the same
+void bvh_dynamic_update(DynamicBVH *tree, int handle, Sphere sphere)
+{
+    if (!is_valid_handle(tree, handle))
+        return;
+
+    DynamicBVHNode *node = &tree->nodes[handle];
+    AABB bounds = create_aabb_from_sphere(&sphere);
+    node->sphere = sphere;
+    tree->flat_dirty = 1;
+    if (memcmp(&bounds, &node->bounds, sizeof(AABB)) == 0)
+        return;
+
+    // Removing frees exactly one node, reinserting takes it back, so the pool does not grow
+    remove_leaf(tree, handle);
+    node->bounds = bounds;
+    insert_leaf(tree, handle, tree->root != -1 ? allocate_node(tree) : -1);
+}
+
+// Levels from the root down to the deepest leaf, 0 for an empty tree
+int bvh_dynamic_height(const DynamicBVH *tree)
+{
+    return tree->root == -1 ? 0 : tree->nodes[tree->root].height + 1;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Flat copy for traversal
+
+//----------------------------------------------------------------------------------------------------
+
+static uint32_t emit_recursive(const DynamicBVHNode *nodes, int index, BVH *bvh, uint32_t *next, uint32_t *next_sphere)
+{
+    uint32_t flat_index = (*next)++;
+    BVHFlatNode *flat = &bvh->nodes[flat_index];
+    flat->bounds = nodes[index].bounds;
+
+    if (nodes[index].height == 0)
+    {
+        bvh->spheres[*next_sphere] = nodes[index].sphere;
+        flat->right_or_first = (*next_sphere)++;
+        flat->count = 1;
+        return flat_index;
+    }
+
+    emit_recursive(nodes, nodes[index].child1, bvh, next, next_sphere);
+    flat->right_or_first = emit_recursive(nodes, nodes[index].child2, bvh, next, next_sphere);
+    flat->count = 0;
+    return flat_index;
+}
+
+// Returns the tree in the linear BVH layout for ray_bvh_intersect(), with its own copy of the
+// spheres. The BVH belongs to the tree and stays valid until the next change.
+const BVH *bvh_dynamic_flat(DynamicBVH *tree)
+{
+    if (tree->flat && !tree->flat_dirty)
+        return tree->flat;
+
+    if (!tree->flat || tree->flat_capacity < tree->sphere_count)
+    {
+        int capacity = tree->flat_capacity * 2 > tree->sphere_count ? tree->flat_capacity * 2 : tree->sphere_count;
+        if (capacity < 1)
+            capacity = 1;
+        bvh_free(tree->flat);
+        tree->flat = bvh_allocate_owned(capacity, 2 * capacity - 1);
+        tree->flat_capacity = tree->flat ? capacity : 0;
+        if (!tree->flat)
+            return NULL;
+    }
+
+    BVH *bvh = tree->flat;
+    bvh->node_count = tree->sphere_count ? 2 * tree->sphere_count - 1 : 0;
+    bvh->sphere_count = tree->sphere_count;
+
+    uint32_t next = 0, next_sphere = 0;
+    if (tree->root != -1)
+        emit_recursive(tree->nodes, tree->root, bvh, &next, &next_sphere);
+    bvh_assign_split_axes(bvh->nodes, bvh->node_count);
+    tree->flat_dirty = 0;
+    return bvh;
+}
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/bvh_instance.h"
+#include "Custom/constants.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Two-level BVH (instancing)
+// A bottom-level BVH (BLAS) is built once over an object's spheres in object space, with any builder.
+// An Instance places a BLAS in the scene with an affine transform, the top-level BVH (TLAS) is built
+// over the world space bounds of the instances. Repeated objects cost one BLAS plus ~200 bytes per
+// instance instead of a copy of every sphere.
+// Traversal (ray_tlas_intersect() in hit.c) transforms the ray into object space at a TLAS leaf and
+// traverses the BLAS. The direction is not renormalised, so t is the same in both spaces and hits of
+// different instances compare directly. Non-uniform scales turn spheres into ellipsoids.
+
+//----------------------------------------------------------------------------------------------------
+
+Transform transform_identity()
+{
+    return (Transform){{{1, 0, 0, 0},
+                        {0, 1, 0, 0},
+                        {0, 0, 1, 0}}};
+}
+
+Transform transform_translate(Vec3 offset)
+{
+    return (Transform){{{1, 0, 0, offset.x},
+                        {0, 1, 0, offset.y},
+                        {0, 0, 1, offset.z}}};
+}
+
+Transform transform_scale(Vec3 scale)
+{
+    return (Transform){{{scale.x, 0, 0, 0},
+                        {0, scale.y, 0, 0},
+                        {0, 0, scale.z, 0}}};
+}
+
+// Rotation by angle (radians) around axis (Rodrigues' formula)
+Transform transform_rotate(Vec3 axis, float angle)
+{
+    Vec3 a = vec3_normalize(axis);
+    float c = cosf(angle), s = sinf(angle), k = 1.0f - c;
+    return (Transform){{{a.x * a.x * k + c, a.x * a.y * k - a.z * s, a.x * a.z * k + a.y * s, 0},
+                        {a.y * a.x * k + a.z * s, a.y * a.y * k + c, a.y * a.z * k - a.x * s, 0},
+                        {a.z * a.x * k - a.y * s, a.z * a.y * k + a.x * s, a.z * a.z * k + c, 0}}};
+}
+
+// a * b, b is applied first
+Transform transform_multiply(Transform a, Transform b)
+{
+    Transform r;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+        }
+        r.m[i][3] += a.m[i][3];
+    }
+    return r;
+}
+
+Transform transform_inverse(Transform t)
+{
+    const float(*m)[4] = t.m;
+    float adjugate[3][3] = {
+        {m[1][1] * m[2][2] - m[1][2] * m[2][1], m[0][2] * m[2][1] - m[0][1] * m[2][2], m[0][1] * m[1][2] - m[0][2] * m[1][1]},
+        {m[1][2] * m[2][0] - m[1][0] * m[2][2], m[0][0] * m[2][2] - m[0][2] * m[2][0], m[0][2] * m[1][0] - m[0][0] * m[1][2]},
+        {m[1][0] * m[2][1] - m[1][1] * m[2][0], m[0][1] * m[2][0] - m[0][0] * m[2][1], m[0][0] * m[1][1] - m[0][1] * m[1][0]}};
+    float det = m[0][0] * adjugate[0][0] + m[0][1] * adjugate[1][0] + m[0][2] * adjugate[2][0];
+    if (det == 0.0f)
+    {
+        printf("Transform is not invertible\n");
+        return transform_identity();
+    }
+
+    Transform r;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+            r.m[i][j] = adjugate[i][j] / det;
+        r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3] + r.m[i][2] * m[2][3]);
+    }
+    return r;
+}
+
+Vec3 transform_point(const Transform *t, Vec3 p)
+{
+    return (Vec3){t->m[0][0] * p.x + t->m[0][1] * p.y + t->m[0][2] * p.z + t->m[0][3],
+                  t->m[1][0] * p.x + t->m[1][1] * p.y + t->m[1][2] * p.z + t->m[1][3],
+                  t->m[2][0] * p.x + t->m[2][1] * p.y + t->m[2][2] * p.z + t->m[2][3]};
+}
+
+Vec3 transform_vector(const Transform *t, Vec3 v)
+{
+    return (Vec3){t->m[0][0] * v.x + t->m[0][1] * v.y + t->m[0][2] * v.z,
+                  t->m[1][0] * v.x + t->m[1][1] * v.y + t->m[1][2] * v.z,
+                  t->m[2][0] * v.x + t->m[2][1] * v.y + t->m[2][2] * v.z};
+}
+
+// Object space normal to world space (inverse transpose of object_to_world), normalised
+Vec3 transform_normal(const Transform *world_to_object, Vec3 n)
+{
+    const float(*m)[4] = world_to_object->m;
+    return vec3_normalize((Vec3){m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+                                 m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+                                 m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z});
+}
+
+Instance instance_create(const BVH *blas, Transform object_to_world)
+{
+    Instance instance = {blas, object_to_world, transform_inverse(object_to_world), create_empty_aabb()};
+    if (!blas || blas->node_count == 0)
+        return instance;
+
+    // Bounds of the 8 transformed corners of the BLAS root
+    AABB box = blas->nodes[0].bounds;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        Vec3 p = {corner & 1 ? box.max.x : box.min.x,
+                  corner & 2 ? box.max.y : box.min.y,
+                  corner & 4 ? box.max.z : box.min.z};
+        p = transform_point(&object_to_world, p);
+        instance.bounds = combine_aabb(instance.bounds, (AABB){p, p});
+    }
+    return instance;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// TLAS construction
+// Binned SAH over the centers of the instance bounds, written depth first straight into the node
+// array. Testing an instance means a BLAS traversal, far more than a box test, so nodes are split
+// down to one instance per leaf unless the remaining centers coincide.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    AABB bounds;
+    int count;
+} InstanceBin;
+
+static inline float instance_center(const Instance *instance, int axis)
+{
+    const AABB *b = &instance->bounds;
+    switch (axis)
+    {
+    case 0:
+        return 0.5f * (b->min.x + b->max.x);
+    case 1:
+        return 0.5f * (b->min.y + b->max.y);
+    default:
+        return 0.5f * (b->min.z + b->max.z);
+    }
+}
+
+static inline int instance_bin(const Instance *instance, int axis, float min, float scale, int bin_count)
+{
+    int bin = (int)((instance_center(instance, axis) - min) * scale);
+    return bin < 0 ? 0 : (bin >= bin_count ? bin_count - 1 : bin);
+}
+
+// Partitions [start, end) at the cheapest bin plane, returns start when the centers coincide
+static int split_instances(Instance *instances, int start, int end)
+{
+    int bin_count = bvh_get_build_config().bin_count;
+    float min[3], extent[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float lo = INFINITY, hi = -INFINITY;
+        for (int i = start; i < end; i++)
+        {
+            float c = instance_center(&instances[i], axis);
+            lo = fminf(lo, c);
+            hi = fmaxf(hi, c);
+        }
+        min[axis] = lo;
+        extent[axis] = hi - lo;
+    }
+
+    float best_cost = INFINITY;
+    int best_axis = -1, best_plane = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (extent[axis] <= 0.0f)
+            continue;
+
+        InstanceBin bins[BVH_MAX_SAH_BINS];
+        for (int b = 0; b < bin_count; b++)
+            bins[b] = (InstanceBin){create_empty_aabb(), 0};
+
+        float scale = bin_count / extent[axis];
+        for (int i = start; i < end; i++)
+        {
+            InstanceBin *bin = &bins[instance_bin(&instances[i], axis, min[axis], scale, bin_count)];
+            bin->bounds = combine_aabb(bin->bounds, instances[i].bounds);
+            bin->count++;
+        }
+
+        // Right side areas and counts swept from the back, then the left side from the front
+        float right_area[BVH_MAX_SAH_BINS];
+        int right_count[BVH_MAX_SAH_BINS];
+        AABB right = create_empty_aabb();
+        int count = 0;
+        for (int b = bin_count - 1; b > 0; b--)
+        {
+            right = combine_aabb(right, bins[b].bounds);
+            count += bins[b].count;
+            right_area[b] = get_aabb_surface_area(right);
+            right_count[b] = count;
+        }
+
+        AABB left = create_empty_aabb();
+        count = 0;
+        for (int plane = 1; plane < bin_count; plane++)
+        {
+            left = combine_aabb(left, bins[plane - 1].bounds);
+            count += bins[plane - 1].count;
+            if (count == 0 || right_count[plane] == 0)
+                continue;
+
+            float cost = get_aabb_surface_area(left) * count + right_area[plane] * right_count[plane];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_plane = plane;
+            }
+        }
+    }
+
+    if (best_axis == -1)
+        return start;
+
+    float scale = bin_count / extent[best_axis];
+    int mid = start;
+    for (int i = start; i < end; i++)
+    {
+        if (instance_bin(&instances[i], best_axis, min[best_axis], scale, bin_count) < best_plane)
+        {
+            Instance temp = instances[i];
+            instances[i] = instances[mid];
+            instances[mid++] = temp;
+        }
+    }
+    return mid;
+}
+
+static uint32_t build_recursive(TLAS *tlas, int start, int end, uint32_t *next)
+{
+    uint32_t index = (*next)++;
+    BVHFlatNode *node = &tlas->nodes[index];
+
+    node->bounds = create_empty_aabb();
+    for (int i = start; i < end; i++)
+        node->bounds = combine_aabb(node->bounds, tlas->instances[i].bounds);
+
+    int mid = end - start > 1 ? split_instances(tlas->instances, start, end) : start;
+    if (mid == start)
+    {
+        node->right_or_first = (uint32_t)start;
+        node->count = (uint32_t)(end - start);
+        return index;
+    }
+
+    build_recursive(tlas, start, mid, next);
+    node->right_or_first = build_recursive(tlas, mid, end, next);
+    node->count = 0;
+    return index;
+}
+
+// Builds the TLAS over a copy of the instances, instances with an empty BLAS are left out
+TLAS *tlas_build(const Instance *instances, int instance_count)
+{
+    int node_capacity = instance_count > 0 ? 2 * instance_count - 1 : 0;
+    Arena arena = arena_create(sizeof(TLAS) + node_capacity * sizeof(BVHFlatNode) +
+                               instance_count * sizeof(Instance) + 128);
+    if (!arena.base)
+    {
+        printf("Failed to allocate memory for the TLAS (%d instances)\n", instance_count);
+        return NULL;
+    }
+
+    TLAS *tlas = (TLAS *)arena_alloc(&arena, sizeof(TLAS), 64);
+    tlas->nodes = (BVHFlatNode *)arena_alloc(&arena, node_capacity * sizeof(BVHFlatNode), 32);
+    tlas->instances = (Instance *)arena_alloc(&arena, instance_count * sizeof(Instance), 32);
+    tlas->instance_count = 0;
+    for (int i = 0; i < instance_count; i++)
+    {
+        if (instances[i].blas && instances[i].blas->node_count > 0)
+            tlas->instances[tlas->instance_count++] = instances[i];
+    }
+
+    uint32_t next = 0;
+    if (tlas->instance_count)
+        build_recursive(tlas, 0, tlas->instance_count, &next);
+    tlas->node_count = (int)next;
+    bvh_assign_split_axes(tlas->nodes, tlas->node_count);
+    tlas->arena = arena;
+    return tlas;
+}
+
+void tlas_free(TLAS *tlas)
+{
+    if (!tlas)
+        return;
+    Arena arena = tlas->arena;
+    arena_destroy(&arena);
+}
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/bvh_optimize.h"
+#include "Custom/constants.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Post-build BVH optimization by treelet restructuring (TRBVH, Karras and Aila 2013)
+// Works on the linear BVH of any builder, in place.
+// - Nodes are processed bottom-up, every node after both of its subtrees.
+// - A treelet is grown from the node by repeatedly expanding the treelet leaf with the largest
+//   surface area, until it has BVH_TREELET_LEAVES leaves (subtrees or BVH leaves).
+// - Dynamic programming over all subsets of the treelet leaves finds the binary tree over them
+//   with the lowest SAH cost, cost(S) = Ct * SA(S) + min over splits (cost(P) + cost(S - P)).
+// - If that tree is cheaper, the treelet is rebuilt in place reusing its internal nodes.
+// Subtrees above the parallel threshold are processed as OpenMP tasks. A node's treelet only
+// contains its own descendants, so every task works on a disjoint part of the tree.
+// Leaves keep their sphere ranges, so the sphere array is not touched. The node array is
+// rewritten depth first at the end, the node count does not change.
+
+//----------------------------------------------------------------------------------------------------
+
+#define BVH_TREELET_SUBSETS (1 << BVH_TREELET_LEAVES)
+
+typedef struct
+{
+    AABB bounds;
+    int child[2]; // -1 for leaves
+    uint32_t first;
+    uint32_t count;
+    int leaves;   // BVH leaves below this node
+    float cost;   // SAH cost of the subtree, not normalised
+} OptimizeNode;
+
+typedef struct
+{
+    OptimizeNode *nodes;
+    float traversal_cost;
+    float intersection_cost;
+    int parallel_threshold;
+} OptimizeContext;
+
+static void update_node(OptimizeContext *ctx, int index)
+{
+    OptimizeNode *node = &ctx->nodes[index];
+    OptimizeNode *left = &ctx->nodes[node->child[0]];
+    OptimizeNode *right = &ctx->nodes[node->child[1]];
+    node->bounds = combine_aabb(left->bounds, right->bounds);
+    node->leaves = left->leaves + right->leaves;
+    node->cost = ctx->traversal_cost * get_aabb_surface_area(node->bounds) + left->cost + right->cost;
+}
+
+// Writes the optimal tree for subset 'set' below node 'index', internal nodes come from the pool
+static void rebuild_treelet(OptimizeContext *ctx, int index, int set, const int *partition,
+                            const int *treelet_leaves, int *pool, int *pool_size)
+{
+    int subsets[2] = {partition[set], set & ~partition[set]};
+
+    for (int c = 0; c < 2; c++)
+    {
+        int subset = subsets[c];
+        if ((subset & (subset - 1)) == 0)
+        {
+            ctx->nodes[index].child[c] = treelet_leaves[__builtin_ctz(subset)];
+            continue;
+        }
+        int child = pool[--(*pool_size)];
+        ctx->nodes[index].child[c] = child;
+        rebuild_treelet(ctx, child, subset, partition, treelet_leaves, pool, pool_size);
+    }
+    update_node(ctx, index);
+}
+
+static void restructure_treelet(OptimizeContext *ctx, int index)
+{
+    int treelet_leaves[BVH_TREELET_LEAVES];
+    int pool[BVH_TREELET_LEAVES];
+    int num_leaves = 2, pool_size = 0;
+    treelet_leaves[0] = ctx->nodes[index].child[0];
+    treelet_leaves[1] = ctx->nodes[index].child[1];
+
+    while (num_leaves < BVH_TREELET_LEAVES)
+    {
+        int largest = -1;
+        float largest_area = -1.0f;
+        for (int i = 0; i < num_leaves; i++)
+        {
+            OptimizeNode *node = &ctx->nodes[treelet_leaves[i]];
+            float area = get_aabb_surface_area(node->bounds);
+            if (node->child[0] >= 0 && area > largest_area)
+            {
+                largest_area = area;
+                largest = i;
+            }
+        }
+        if (largest < 0)
+            break;
+
+        int expanded = treelet_leaves[largest];
+        pool[pool_size++] = expanded;
+        treelet_leaves[largest] = ctx->nodes[expanded].child[0];
+        treelet_leaves[num_leaves++] = ctx->nodes[expanded].child[1];
+    }
+
+    if (num_leaves < 3)
+        return;
+
+    int full = (1 << num_leaves) - 1;
+    float area[BVH_TREELET_SUBSETS];
+    float cost[BVH_TREELET_SUBSETS];
+    int partition[BVH_TREELET_SUBSETS];
+
+    for (int set = 1; set <= full; set++)
+    {
+        AABB bounds = create_empty_aabb();
+        for (int i = 0; i < num_leaves; i++)
+        {
+            if (set & (1 << i))
+                bounds = combine_aabb(bounds, ctx->nodes[treelet_leaves[i]].bounds);
+        }
+        area[set] = get_aabb_surface_area(bounds);
+    }
+
+    // Subsets in increasing order, every proper subset of 'set' is smaller than 'set'
+    for (int set = 1; set <= full; set++)
+    {
+        if ((set & (set - 1)) == 0)
+        {
+            cost[set] = ctx->nodes[treelet_leaves[__builtin_ctz(set)]].cost;
+            continue;
+        }
+
+        // Only splits whose first part holds the lowest leaf of the set, the rest are mirrors
+        int lowest = set & -set;
+        float best = INFINITY;
+        for (int part = (set - 1) & set; part > 0; part = (part - 1) & set)
+        {
+            if (!(part & lowest))
+                continue;
+            float split_cost = cost[part] + cost[set & ~part];
+            if (split_cost < best)
+            {
+                best = split_cost;
+                partition[set] = part;
+            }
+        }
+        cost[set] = ctx->traversal_cost * area[set] + best;
+    }
+
+    if (cost[full] < ctx->nodes[index].cost * (1.0f - 1e-5f))
+        rebuild_treelet(ctx, index, full, partition, treelet_leaves, pool, &pool_size);
+}
+
+static void optimize_recursive(OptimizeContext *ctx, int index)
+{
+    OptimizeNode *node = &ctx->nodes[index];
+    if (node->child[0] < 0)
+        return;
+
+    if (node->leaves >= ctx->parallel_threshold)
+    {
+#pragma omp task
+        optimize_recursive(ctx, node->child[0]);
+#pragma omp task
+        optimize_recursive(ctx, node->child[1]);
+#pragma omp taskwait
+    }
+    else
+    {
+        optimize_recursive(ctx, node->child[0]);
+        optimize_recursive(ctx, node->child[1]);
+    }
+
+    update_node(ctx, index);
+    restructure_treelet(ctx, index);
+}
+
+static void init_costs(OptimizeContext *ctx, int index)
+{
+    OptimizeNode *node = &ctx->nodes[index];
+    if (node->child[0] < 0)
+    {
+        node->leaves = 1;
+        node->cost = ctx->intersection_cost * node->count * get_aabb_surface_area(node->bounds);
+        return;
+    }
+    init_costs(ctx, node->child[0]);
+    init_costs(ctx, node->child[1]);
+    update_node(ctx, index);
+}
+
+static uint32_t write_depth_first(const OptimizeNode *nodes, int index, BVHFlatNode *flat, uint32_t *next)
+{
+    uint32_t flat_index = (*next)++;
+    const OptimizeNode *node = &nodes[index];
+    flat[flat_index].bounds = node->bounds;
+
+    if (node->child[0] < 0)
+    {
+        flat[flat_index].right_or_first = node->first;
+        flat[flat_index].count = node->count;
+        return flat_index;
+    }
+
+    write_depth_first(nodes, node->child[0], flat, next);
+    flat[flat_index].right_or_first = write_depth_first(nodes, node->child[1], flat, next);
+    flat[flat_index].count = 0;
+    return flat_index;
+}
+
+void bvh_optimize(BVH *bvh, int rounds)
+{
+    if (!bvh || bvh->node_count < 3)
+        return;
+
+    BVHBuildConfig config = bvh_get_build_config();
+    OptimizeContext ctx = {
+        malloc(bvh->node_count * sizeof(OptimizeNode)),
+        config.traversal_cost,
+        config.intersection_cost,
+        config.parallel_threshold};
+
+    for (int i = 0; i < bvh->node_count; i++)
+    {
+        BVHFlatNode *flat = &bvh->nodes[i];
+        OptimizeNode *node = &ctx.nodes[i];
+        node->bounds = flat->bounds;
+        node->first = flat->right_or_first;
+        node->count = flat->count;
+        node->child[0] = flat->count ? -1 : i + 1;
+        node->child[1] = flat->count ? -1 : (int)flat->right_or_first;
+    }
+    init_costs(&ctx, 0);
+
+#ifdef _OPENMP
+    int threads = config.thread_count > 0 ? config.thread_count : omp_get_max_threads();
+#endif
+    for (int round = 0; round < rounds; round++)
+    {
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+        optimize_recursive(&ctx, 0);
+    }
+
+    uint32_t next = 0;
+    write_depth_first(ctx.nodes, 0, bvh->nodes, &next);
+    bvh_assign_split_axes(bvh->nodes, bvh->node_count);
+    free(ctx.nodes);
+}
@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/bvh_refit.h"
+#include "Custom/constants.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// BVH refit for moving spheres
+// bvh_refit() - after sphere centers / radii in bvh->spheres changed, recomputes every node's bounds
+// bottom-up, keeping the topology. Subtrees above BVH_REFIT_TASK_NODES nodes run as OpenMP tasks.
+// The tree stays correct but its quality drops as spheres move away from their build time
+// neighbours, so the refitter tracks the SAH cost of every subtree against its value right after the
+// last (re)build. The cost is not normalised by the subtree's surface area : spheres drifting apart
+// grow the subtree bounds, which would hide the loss.
+// - whole tree grown by more than rebuild_growth - the whole tree is rebuilt
+// - otherwise subtrees grown by more than subtree_rebuild_growth are rebuilt. If only one child of
+//   such a subtree degraded as much, the search goes down into that child, so the smallest subtree
+//   holding the degradation gets rebuilt.
+// Rebuilt parts use the binned SAH builder (build_bvh_node) over the spheres of the subtree, then
+// the whole node array and the sphere order are written again depth first (the node count changes).
+// Spheres only move within a rebuilt subtree, a sphere that travels across the scene makes the
+// nodes above it grow until the whole tree is rebuilt.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    BVH *bvh;
+    float *sah; // NULL - costs are not kept
+    float traversal_cost;
+    float intersection_cost;
+} RefitContext;
+
+typedef struct
+{
+    const BVH *old;
+    BVH *bvh;
+    Sphere *spheres;           // new sphere order
+    const int *rebuilt;        // per old node, index of its rebuilt subtree or -1
+    BVHNode *const *subtrees;
+    const float *old_build_sah;
+    float *build_sah;          // -1 for the nodes of rebuilt subtrees
+    uint32_t next;
+    uint32_t written;
+} RebuildContext;
+
+// Refits nodes [index, end) (one subtree), returns its SAH cost, not normalised
+static float refit_recursive(const RefitContext *ctx, uint32_t index, uint32_t end)
+{
+    BVHFlatNode *node = &ctx->bvh->nodes[index];
+    float cost;
+
+    if (node->count)
+    {
+        Sphere *spheres = &ctx->bvh->spheres[node->right_or_first];
+        AABB bounds = create_empty_aabb();
+        for (uint32_t i = 0; i < node->count; i++)
+            bounds = combine_aabb(bounds, create_aabb_from_sphere(&spheres[i]));
+        node->bounds = bounds;
+        cost = ctx->intersection_cost * node->count * get_aabb_surface_area(bounds);
+    }
+    else
+    {
+        uint32_t right = node->right_or_first;
+        float left_cost, right_cost;
+        if (end - index >= BVH_REFIT_TASK_NODES)
+        {
+#pragma omp task shared(left_cost)
+            left_cost = refit_recursive(ctx, index + 1, right);
+#pragma omp task shared(right_cost)
+            right_cost = refit_recursive(ctx, right, end);
+#pragma omp taskwait
+        }
+        else
+        {
+            left_cost = refit_recursive(ctx, index + 1, right);
+            right_cost = refit_recursive(ctx, right, end);
+        }
+        node->bounds = combine_aabb(ctx->bvh->nodes[index + 1].bounds, ctx->bvh->nodes[right].bounds);
+        cost = ctx->traversal_cost * get_aabb_surface_area(node->bounds) + left_cost + right_cost;
+    }
+
+    if (ctx->sah)
+        ctx->sah[index] = cost;
+    return cost;
+}
+
+static void refit_nodes(BVH *bvh, float *sah)
+{
+    BVHBuildConfig config = bvh_get_build_config();
+    RefitContext ctx = {bvh, sah, config.traversal_cost, config.intersection_cost};
+
+#ifdef _OPENMP
+    if (config.thread_count != 1 && !omp_in_parallel() && bvh->node_count >= BVH_REFIT_TASK_NODES)
+    {
+        int threads = config.thread_count > 0 ? config.thread_count : omp_get_max_threads();
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+        refit_recursive(&ctx, 0, (uint32_t)bvh->node_count);
+        return;
+    }
+#endif
+    refit_recursive(&ctx, 0, (uint32_t)bvh->node_count);
+}
+
+// Refits the BVH to the current spheres, returns the new SAH cost (same as bvh_flat_sah_cost)
+float bvh_refit(BVH *bvh)
+{
+    if (!bvh || bvh->node_count == 0)
+        return 0.0f;
+    refit_nodes(bvh, NULL);
+    return bvh_flat_sah_cost(bvh);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Subtree rebuilds
+
+//----------------------------------------------------------------------------------------------------
+
+static inline float subtree_growth(const BVHRefitter *refitter, uint32_t index)
+{
+    return refitter->sah[index] / refitter->build_sah[index];
+}
+
+static int subtree_node_count(const BVH *bvh, uint32_t index)
+{
+    uint32_t last = index;
+    while (!bvh->nodes[last].count)
+        last = bvh->nodes[last].right_or_first;
+    return (int)(last + 1 - index);
+}
+
+static int count_spheres(const BVH *bvh, uint32_t index)
+{
+    const BVHFlatNode *node = &bvh->nodes[index];
+    if (node->count)
+        return (int)node->count;
+    return count_spheres(bvh, index + 1) + count_spheres(bvh, node->right_or_first);
+}
+
+static void gather_spheres(const BVH *bvh, uint32_t index, Sphere *output, int *written)
+{
+    const BVHFlatNode *node = &bvh->nodes[index];
+    if (node->count)
+    {
+        memcpy(&output[*written], &bvh->spheres[node->right_or_first], node->count * sizeof(Sphere));
+        *written += node->count;
+        return;
+    }
+    gather_spheres(bvh, index + 1, output, written);
+    gather_spheres(bvh, node->right_or_first, output, written);
+}
+
+// Collects the subtrees to rebuild below an interior node
+static void select_subtrees(const BVHRefitter *refitter, uint32_t index, float threshold, uint32_t *selected, int *count)
+{
+    const BVHFlatNode *node = &refitter->bvh->nodes[index];
+    if (node->count)
+        return;
+
+    uint32_t children[2] = {index + 1, node->right_or_first};
+    float growth = subtree_growth(refitter, index);
+    if (growth <= threshold)
+    {
+        select_subtrees(refitter, children[0], threshold, selected, count);
+        select_subtrees(refitter, children[1], threshold, selected, count);
+        return;
+    }
+
+    int degraded = -1, num_degraded = 0;
+    for (int c = 0; c < 2; c++)
+    {
+        if (!refitter->bvh->nodes[children[c]].count && subtree_growth(refitter, children[c]) >= growth)
+        {
+            degraded = c;
+            num_degraded++;
+        }
+    }
+    if (num_degraded == 1)
+        select_subtrees(refitter, children[degraded], threshold, selected, count);
+    else
+        selected[(*count)++] = index;
+}
+
+static uint32_t emit_rebuilt(RebuildContext *ctx, const BVHNode *node)
+{
+    uint32_t index = ctx->next++;
+    BVHFlatNode *flat = &ctx->bvh->nodes[index];
+    flat->bounds = node->bounds;
+    ctx->build_sah[index] = -1.0f;
+
+    if (!node->left)
+    {
+        flat->right_or_first = ctx->written;
+        flat->count = (uint32_t)node->sphere_count;
+        memcpy(&ctx->spheres[ctx->written], node->sphere, node->sphere_count * sizeof(Sphere));
+        ctx->written += node->sphere_count;
+        return index;
+    }
+
+    emit_rebuilt(ctx, node->left);
+    flat->right_or_first = emit_rebuilt(ctx, node->right);
+    flat->count = 0;
+    return index;
+}
+
+static uint32_t emit_kept(RebuildContext *ctx, uint32_t old_index)
+{
+    if (ctx->rebuilt[old_index] >= 0)
+        return emit_rebuilt(ctx, ctx->subtrees[ctx->rebuilt[old_index]]);
+
+    const BVHFlatNode *old = &ctx->old->nodes[old_index];
+    uint32_t index = ctx->next++;
+    BVHFlatNode *flat = &ctx->bvh->nodes[index];
+    flat->bounds = old->bounds;
+    ctx->build_sah[index] = ctx->old_build_sah[old_index];
+
+    if (old->count)
+    {
+        flat->right_or_first = ctx->written;
+        flat->count = old->count;
+        memcpy(&ctx->spheres[ctx->written], &ctx->old->spheres[old->right_or_first], old->count * sizeof(Sphere));
+        ctx->written += old->count;
+        return index;
+    }
+
+    emit_kept(ctx, old_index + 1);
+    flat->right_or_first = emit_kept(ctx, old->right_or_first);
+    flat->count = 0;
+    return index;
+}
+
+// Rebuilds the selected subtrees and writes the tree again, the refitter gets the new BVH.
+// Returns 0 and keeps the previous BVH if an allocation fails.
+static int rebuild_subtrees(BVHRefitter *refitter, const uint32_t *selected, int num_selected)
+{
+    BVH *old = refitter->bvh;
+    BVHNode **subtrees = calloc(num_selected, sizeof(BVHNode *));
+    Sphere **subtree_spheres = calloc(num_selected, sizeof(Sphere *));
+    int *rebuilt = malloc(old->node_count * sizeof(int));
+    int allocated = subtrees && subtree_spheres && rebuilt;
+
+    int node_count = old->node_count, rebuilt_spheres = 0;
+    for (int i = 0; allocated && i < old->node_count; i++)
+        rebuilt[i] = -1;
+    for (int s = 0; allocated && s < num_selected; s++)
+    {
+        int count = 0;
+        subtree_spheres[s] = malloc(count_spheres(old, selected[s]) * sizeof(Sphere));
+        if (!subtree_spheres[s])
+        {
+            allocated = 0;
+            break;
+        }
+        gather_spheres(old, selected[s], subtree_spheres[s], &count);
+        subtrees[s] = build_bvh_node(subtree_spheres[s], 0, count, 0);
+        rebuilt[selected[s]] = s;
+        node_count += bvh_count_nodes(subtrees[s]) - subtree_node_count(old, selected[s]);
+        rebuilt_spheres += count;
+    }
+
+    BVH *bvh = NULL;
+    if (allocated)
+    {
+        bvh = old->owns_spheres ? bvh_allocate_owned(old->sphere_count, node_count)
+                                : bvh_allocate(old->spheres, old->sphere_count, node_count);
+        float *build_sah = malloc(node_count * sizeof(float));
+        float *sah = malloc(node_count * sizeof(float));
+        Sphere *spheres = !bvh ? NULL : old->owns_spheres ? bvh->spheres : malloc(old->sphere_count * sizeof(Sphere));
+        if (bvh && build_sah && sah && spheres)
+        {
+            RebuildContext ctx = {old, bvh, spheres, rebuilt, subtrees, refitter->build_sah, build_sah, 0, 0};
+            emit_kept(&ctx, 0);
+            bvh_assign_split_axes(bvh->nodes, bvh->node_count);
+            if (!old->owns_spheres)
+            {
+                memcpy(old->spheres, ctx.spheres, old->sphere_count * sizeof(Sphere));
+                free(ctx.spheres);
+            }
+
+            bvh_free(old);
+            free(refitter->build_sah);
+            free(refitter->sah);
+            refitter->bvh = bvh;
+            refitter->build_sah = build_sah;
+            refitter->sah = sah;
+        }
+        else
+        {
+            if (bvh && !old->owns_spheres)
+                free(spheres);
+            bvh_free(bvh);
+            bvh = NULL;
+            free(build_sah);
+            free(sah);
+        }
+    }
+    if (!bvh)
+        printf("Failed to allocate memory for rebuilding %d BVH subtrees, keeping the refitted tree\n", num_selected);
+
+    for (int s = 0; subtrees && subtree_spheres && s < num_selected; s++)
+    {
+        free_bvh(subtrees[s]);
+        free(subtree_spheres[s]);
+    }
+    free(rebuilt);
+    free(subtree_spheres);
+    free(subtrees);
+    return bvh ? rebuilt_spheres : 0;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Refitter - owns a BVH over spheres that move between frames.
+// Move the spheres in refitter->bvh->spheres (the sphere array given to bvh_build(), in its
+// reordered form), then call bvh_refitter_update() once per frame.
+
+//----------------------------------------------------------------------------------------------------
+
+// Returns NULL if the memory can not be allocated, the BVH then stays with the caller
+BVHRefitter *bvh_refitter_create(BVH *bvh)
+{
+    BVHRefitter *refitter = malloc(sizeof(BVHRefitter));
+    int capacity = bvh->node_count > 0 ? bvh->node_count : 1;
+    float *sah = malloc(capacity * sizeof(float));
+    float *build_sah = malloc(capacity * sizeof(float));
+    if (!refitter || !sah || !build_sah)
+    {
+        printf("Failed to allocate memory for the BVH refitter (%d nodes)\n", bvh->node_count);
+        free(refitter);
+        free(sah);
+        free(build_sah);
+        return NULL;
+    }
+    refitter->bvh = bvh;
+    refitter->sah = sah;
+    refitter->build_sah = build_sah;
+
+    if (bvh->node_count)
+    {
+        refit_nodes(bvh, refitter->sah);
+        memcpy(refitter->build_sah, refitter->sah, bvh->node_count * sizeof(float));
+    }
+    return refitter;
+}
+
+BVHRefitStats bvh_refitter_update(BVHRefitter *refitter)
+{
+    BVHRefitStats stats = {0};
+    BVH *bvh = refitter->bvh;
+    if (bvh->node_count == 0)
+        return stats;
+
+    BVHBuildConfig config = bvh_get_build_config();
+    refit_nodes(bvh, refitter->sah);
+    stats.growth = subtree_growth(refitter, 0);
+
+    uint32_t *selected = malloc(bvh->node_count * sizeof(uint32_t));
+    int num_selected = 0;
+    if (selected && stats.growth > config.rebuild_growth)
+    {
+        selected[num_selected++] = 0;
+        stats.full_rebuild = 1;
+    }
+    else if (selected && !bvh->nodes[0].count)
+    {
+        select_subtrees(refitter, 1, config.subtree_rebuild_growth, selected, &num_selected);
+        select_subtrees(refitter, bvh->nodes[0].right_or_first, config.subtree_rebuild_growth, selected,
+                        &num_selected);
+    }
+
+    if (num_selected)
+    {
+        stats.rebuilt_spheres = rebuild_subtrees(refitter, selected, num_selected);
+        stats.rebuilt_subtrees = stats.rebuilt_spheres ? num_selected : 0;
+
+        // New nodes take their fresh cost as the reference, kept nodes keep theirs
+        bvh = refitter->bvh;
+        refit_nodes(bvh, refitter->sah);
+        for (int i = 0; i < bvh->node_count; i++)
+        {
+            if (refitter->build_sah[i] < 0.0f)
+                refitter->build_sah[i] = refitter->sah[i];
+        }
+    }
+    free(selected);
+
+    stats.sah_cost = bvh_flat_sah_cost(bvh);
+    return stats;
+}
+
+void bvh_refitter_destroy(BVHRefitter *refitter)
+{
+    if (!refitter)
+        return;
+    bvh_free(refitter->bvh);
+    free(refitter->sah);
+    free(refitter->build_sah);
+    free(refitter);
+}
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include "Custom/bvh_skip.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Stackless BVH (skip links / ropes)
+// The depth first node array of a linear BVH of any builder, with every node's right child index
+// replaced by its skip link - the first node after its subtree. The walk only moves forward through
+// the array: into the next node when an interior box is hit, to skip otherwise, so a ray needs no
+// stack, just the current index and the closest hit (ray_bvh_skip_intersect() in hit.c).
+// The order is fixed (left before right for every ray), so unlike ray_bvh_intersect() the nearer
+// child is not always visited first and closest hit culling starts later. What the walk saves is the
+// stack itself, the stack pushes and pops, and the forward only access to the node array.
+// Leaves keep their sphere ranges in the linear BVH's array, first sphere and count are packed into
+// one word, so leaves hold at most 255 spheres and trees at most 2^24 sphere references.
+
+//----------------------------------------------------------------------------------------------------
+
+#define SKIP_MAX_FIRST ((1u << 24) - 1)
+#define SKIP_MAX_COUNT 255u
+
+// Returns NULL when a leaf does not fit the packed first / count word
+BVHSkip *bvh_skip_build(const BVH *bvh)
+{
+    for (int i = 0; i < bvh->node_count; i++)
+    {
+        const BVHFlatNode *node = &bvh->nodes[i];
+        if (node->count > SKIP_MAX_COUNT || (node->count && node->right_or_first > SKIP_MAX_FIRST))
+        {
+            printf("Skip link BVH leaves hold at most %u spheres from the first %u, the BVH has a leaf of %u at %u\n",
+                   SKIP_MAX_COUNT, SKIP_MAX_FIRST + 1, (uint32_t)node->count, node->right_or_first);
+            return NULL;
+        }
+    }
+
+    size_t node_bytes = (size_t)bvh->node_count * sizeof(BVHSkipNode);
+    Arena arena = arena_create(sizeof(BVHSkip) + node_bytes + 128);
+    if (!arena.base)
+    {
+        printf("Failed to allocate memory for the skip link BVH (%d nodes)\n", bvh->node_count);
+        return NULL;
+    }
+
+    BVHSkip *skip = (BVHSkip *)arena_alloc(&arena, sizeof(BVHSkip), 64);
+    skip->nodes = (BVHSkipNode *)arena_alloc(&arena, node_bytes, 32);
+    skip->node_count = bvh->node_count;
+    skip->spheres = bvh->spheres;
+    skip->sphere_count = bvh->sphere_count;
+
+    // Parents come before their children, so a node's skip is known when it is reached :
+    // the left child skips to its sibling, the right child to wherever the parent skips
+    if (bvh->node_count)
+        skip->nodes[0].skip = (uint32_t)bvh->node_count;
+    for (int i = 0; i < bvh->node_count; i++)
+    {
+        const BVHFlatNode *node = &bvh->nodes[i];
+        BVHSkipNode *out = &skip->nodes[i];
+        out->bounds = node->bounds;
+        out->first = node->count ? node->right_or_first : 0;
+        out->count = node->count;
+        if (!node->count)
+        {
+            skip->nodes[i + 1].skip = node->right_or_first;
+            skip->nodes[node->right_or_first].skip = out->skip;
+        }
+    }
+
+    skip->arena = arena;
+    return skip;
+}
+
+void bvh_skip_free(BVHSkip *skip)
+{
+    if (!skip)
+        return;
+    Arena arena = skip->arena;
+    arena_destroy(&arena);
+}
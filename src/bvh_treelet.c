@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "Custom/bvh_treelet.h"
+#include "Custom/constants.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Treelets and ray queues
+// With millions of spheres the nodes and spheres are far bigger than the caches, and single rays
+// walking depth first fetch every node they touch from memory, again for every ray.
+// The linear BVH is cut into treelets of at most treelet_bytes of nodes and leaf spheres : whole
+// subtrees that fit, packed with their neighbours in the depth first node array, and above them the
+// few nodes whose subtrees are too big, packed the same way.
+// Rays are traced in batches of BVH_TREELET_BATCH. Every treelet has a queue of rays waiting to
+// enter it. A ray walks its treelet as in ray_bvh_intersect() (nearer child first, far children kept
+// on the ray's own stack, boxes culled by the closest hit), and the moment its next node lies in
+// another treelet it is queued there. Queues are processed treelet after treelet until every ray is
+// done, so a treelet's data is loaded once for all rays in its queue instead of once per ray.
+// The closest hits are the ones of ray_bvh_intersect().
+
+//----------------------------------------------------------------------------------------------------
+
+#define TREELET_QUEUE_END UINT32_MAX
+
+typedef struct
+{
+    float origin[3];
+    float inv_direction[3];
+    float t_max;
+    Sphere *closest;
+    uint32_t node; // where the ray continues, inside the treelet of its queue
+    uint32_t next; // next ray in the same queue
+    int top;
+} TreeletRay;
+
+// Returns NULL if the memory can not be allocated
+BVHTreelets *bvh_treelets_build(const BVH *bvh, size_t treelet_bytes)
+{
+    int node_count = bvh->node_count;
+    size_t array_bytes = (size_t)node_count * (sizeof(uint32_t) + sizeof(size_t));
+    Arena arena = arena_create(sizeof(BVHTreelets) + array_bytes + 256);
+    size_t *subtree_bytes = malloc(node_count * sizeof(size_t));
+    uint32_t *subtree_nodes = malloc(node_count * sizeof(uint32_t));
+    uint32_t *depth = malloc(node_count * sizeof(uint32_t));
+    if (!arena.base || (node_count && (!subtree_bytes || !subtree_nodes || !depth)))
+    {
+        printf("Failed to allocate memory for the BVH treelets (%d nodes)\n", node_count);
+        arena_destroy(&arena);
+        free(subtree_bytes);
+        free(subtree_nodes);
+        free(depth);
+        return NULL;
+    }
+
+    BVHTreelets *treelets = (BVHTreelets *)arena_alloc(&arena, sizeof(BVHTreelets), 64);
+    treelets->bvh = bvh;
+    treelets->treelet_of = (uint32_t *)arena_alloc(&arena, node_count * sizeof(uint32_t), 64);
+    treelets->bytes = (size_t *)arena_alloc(&arena, node_count * sizeof(size_t), 64);
+    treelets->treelet_count = 0;
+    treelets->max_depth = 0;
+
+    // Children come after their parents : sizes bottom-up, depths top-down
+    for (int i = node_count - 1; i >= 0; i--)
+    {
+        const BVHFlatNode *node = &bvh->nodes[i];
+        subtree_bytes[i] = sizeof(BVHFlatNode) + (size_t)node->count * sizeof(Sphere);
+        subtree_nodes[i] = 1;
+        if (node->count == 0)
+        {
+            subtree_bytes[i] += subtree_bytes[i + 1] + subtree_bytes[node->right_or_first];
+            subtree_nodes[i] += subtree_nodes[i + 1] + subtree_nodes[node->right_or_first];
+        }
+    }
+    for (int i = 0; i < node_count; i++)
+    {
+        if (i == 0)
+            depth[i] = 1;
+        if (bvh->nodes[i].count == 0)
+            depth[i + 1] = depth[bvh->nodes[i].right_or_first] = depth[i] + 1;
+        if ((int)depth[i] > treelets->max_depth)
+            treelets->max_depth = (int)depth[i];
+    }
+
+    // Nodes whose subtree is bigger than a treelet are packed into top treelets. Below them, every
+    // whole subtree that fits is packed with its neighbours in the node array into subtree treelets.
+    // A subtree is a contiguous range of nodes (and of leaf spheres), so treelets are too.
+    int top_treelet = -1, subtree_treelet = -1;
+    size_t top_bytes = 0, packed_bytes = 0;
+    for (int i = 0; i < node_count;)
+    {
+        if (subtree_bytes[i] > treelet_bytes)
+        {
+            if (top_treelet < 0 || top_bytes + sizeof(BVHFlatNode) > treelet_bytes)
+            {
+                if (top_treelet >= 0)
+                    treelets->bytes[top_treelet] = top_bytes;
+                top_treelet = treelets->treelet_count++;
+                top_bytes = 0;
+            }
+            treelets->treelet_of[i] = (uint32_t)top_treelet;
+            top_bytes += sizeof(BVHFlatNode);
+            i++;
+            continue;
+        }
+
+        if (subtree_treelet < 0 || packed_bytes + subtree_bytes[i] > treelet_bytes)
+        {
+            if (subtree_treelet >= 0)
+                treelets->bytes[subtree_treelet] = packed_bytes;
+            subtree_treelet = treelets->treelet_count++;
+            packed_bytes = 0;
+        }
+        for (uint32_t j = 0; j < subtree_nodes[i]; j++)
+            treelets->treelet_of[i + j] = (uint32_t)subtree_treelet;
+        packed_bytes += subtree_bytes[i];
+        i += subtree_nodes[i];
+    }
+    if (top_treelet >= 0)
+        treelets->bytes[top_treelet] = top_bytes;
+    if (subtree_treelet >= 0)
+        treelets->bytes[subtree_treelet] = packed_bytes;
+
+    free(subtree_bytes);
+    free(subtree_nodes);
+    free(depth);
+    treelets->arena = arena;
+    return treelets;
+}
+
+void bvh_treelets_free(BVHTreelets *treelets)
+{
+    if (!treelets)
+        return;
+    Arena arena = treelets->arena;
+    arena_destroy(&arena);
+}
+
+static inline int treelet_box_test(const TreeletRay *ray, const AABB *box)
+{
+    return ray_aabb_slabs_inv(ray->origin, ray->inv_direction, box, ray->t_max);
+}
+
+// Walks the ray inside the treelet. Returns the treelet it continues in (ray->node is its next node)
+// or -1 once its stack is empty.
+static int trace_in_treelet(const BVHTreelets *treelets, uint32_t treelet, Ray source, TreeletRay *ray,
+                            uint32_t *stack)
+{
+    const BVH *bvh = treelets->bvh;
+    const float direction[3] = {source.direction.x, source.direction.y, source.direction.z};
+    uint32_t index = ray->node;
+
+    for (;;)
+    {
+        if (treelets->treelet_of[index] != treelet)
+        {
+            ray->node = index;
+            return (int)treelets->treelet_of[index];
+        }
+
+        const BVHFlatNode *node = &bvh->nodes[index];
+        if (treelet_box_test(ray, &node->bounds))
+        {
+            if (node->count == 0)
+            {
+                uint32_t near = index + 1, far = node->right_or_first;
+                if ((direction[node->axis] < 0.0f) != node->axis_flip)
+                {
+                    near = node->right_or_first;
+                    far = index + 1;
+                }
+                stack[ray->top++] = far;
+                index = near;
+                continue;
+            }
+
+            Sphere *first = &bvh->spheres[node->right_or_first];
+            for (uint32_t i = 0; i < node->count; i++)
+            {
+                float t;
+                if (ray_sphere_hit_t(source, &first[i], EPSILON, ray->t_max, &t))
+                {
+                    ray->closest = &first[i];
+                    ray->t_max = t;
+                }
+            }
+        }
+
+        if (ray->top == 0)
+            return -1;
+        index = stack[--ray->top];
+    }
+}
+
+// Closest hits of count rays, the same as ray_bvh_intersect() on each ray. stats may be NULL.
+// If the ray states can not be allocated, the rays go through ray_bvh_intersect() one at a time.
+void ray_treelet_intersect(const BVHTreelets *treelets, const Ray *rays, int count, HitRecord *hits,
+                           TreeletStats *stats)
+{
+    const BVH *bvh = treelets->bvh;
+    if (bvh->node_count == 0)
+    {
+        for (int i = 0; i < count; i++)
+            hits[i] = (HitRecord){0};
+        return;
+    }
+
+    int batch = count < BVH_TREELET_BATCH ? count : BVH_TREELET_BATCH;
+    TreeletRay *states = malloc(batch * sizeof(TreeletRay));
+    uint32_t *stacks = malloc((size_t)batch * treelets->max_depth * sizeof(uint32_t));
+    uint32_t *queues = malloc(treelets->treelet_count * sizeof(uint32_t));
+    if (!states || !stacks || !queues)
+    {
+        for (int i = 0; i < count; i++)
+            hits[i] = ray_bvh_intersect(rays[i], bvh);
+        free(states);
+        free(stacks);
+        free(queues);
+        return;
+    }
+    for (int t = 0; t < treelets->treelet_count; t++)
+        queues[t] = TREELET_QUEUE_END;
+
+    for (int base = 0; base < count; base += batch)
+    {
+        int batch_count = count - base < batch ? count - base : batch;
+        for (int i = 0; i < batch_count; i++)
+        {
+            Ray ray = rays[base + i];
+            const float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+            const float direction[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+            TreeletRay *state = &states[i];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                state->origin[axis] = origin[axis];
+                state->inv_direction[axis] = ray_inv_direction(direction[axis]);
+            }
+            state->t_max = INFINITY;
+            state->closest = NULL;
+            state->node = 0;
+            state->top = 0;
+            state->next = i + 1 < batch_count ? (uint32_t)(i + 1) : TREELET_QUEUE_END;
+        }
+        queues[treelets->treelet_of[0]] = 0;
+
+        int pending = batch_count;
+        while (pending > 0)
+        {
+            for (int t = 0; t < treelets->treelet_count; t++)
+            {
+                uint32_t i = queues[t];
+                if (i == TREELET_QUEUE_END)
+                    continue;
+                queues[t] = TREELET_QUEUE_END;
+                if (stats)
+                {
+                    stats->queue_runs++;
+                    stats->treelet_bytes += treelets->bytes[t];
+                }
+
+                while (i != TREELET_QUEUE_END)
+                {
+                    TreeletRay *state = &states[i];
+                    uint32_t next = state->next;
+                    int target = trace_in_treelet(treelets, (uint32_t)t, rays[base + i], state,
+                                                  &stacks[(size_t)i * treelets->max_depth]);
+                    if (target < 0)
+                    {
+                        pending--;
+                    }
+                    else
+                    {
+                        state->next = queues[target];
+                        queues[target] = i;
+                    }
+                    if (stats)
+                        stats->ray_entries++;
+                    i = next;
+                }
+            }
+        }
+
+        for (int i = 0; i < batch_count; i++)
+        {
+            const TreeletRay *state = &states[i];
+            hits[base + i] = state->closest ? ray_sphere_hit_record(rays[base + i], state->closest, state->t_max)
+                                            : (HitRecord){0};
+        }
+    }
+
+    free(states);
+    free(stacks);
+    free(queues);
+}
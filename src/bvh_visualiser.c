@@ -96,9 +96,9 @@ static void draw_aabb(SDL_Renderer* renderer, AABB box, Camera* camera,
 }
 
 
-void draw_bvh_recursive(SDL_Renderer* renderer, BVHNode* node, Camera* camera, 
+void draw_bvh_recursive(SDL_Renderer* renderer, const BVH* bvh, uint32_t index, Camera* camera, 
                        int screen_width, int screen_height, int depth) {
-    if (!node) return;
+    const BVHFlatNode* node = &bvh->nodes[index];
     
     Uint8 r = 255 - (depth * 40) % 200;
     Uint8 g = (depth * 80) % 200;
@@ -107,20 +107,22 @@ void draw_bvh_recursive(SDL_Renderer* renderer, BVHNode* node, Camera* camera,
     draw_aabb(renderer, node->bounds, camera, screen_width, screen_height);
     
     
-    if (node->left) draw_bvh_recursive(renderer, node->left, camera, screen_width, screen_height, depth + 1);
-    if (node->right) draw_bvh_recursive(renderer, node->right, camera, screen_width, screen_height, depth + 1);
+    if (node->count == 0) {
+        draw_bvh_recursive(renderer, bvh, index + 1, camera, screen_width, screen_height, depth + 1);
+        draw_bvh_recursive(renderer, bvh, node->right_or_first, camera, screen_width, screen_height, depth + 1);
+    }
 }
 
 
-void render_debug_visualization(SDL_Renderer* renderer, BVHNode* root, Camera* camera) {
+void render_debug_visualization(SDL_Renderer* renderer, const BVH* bvh, Camera* camera) {
 
-    if (!root) {
+    if (!bvh || bvh->node_count == 0) {
         printf("No BVH root node provided!\n");
         return;
     }
     int screen_width, screen_height;
     SDL_GetRendererOutputSize(renderer, &screen_width, &screen_height);
-    draw_bvh_recursive(renderer, root, camera, screen_width, screen_height, 0);
+    draw_bvh_recursive(renderer, bvh, 0, camera, screen_width, screen_height, 0);
     
 
 }
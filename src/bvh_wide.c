@@ -0,0 +1,546 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/bvh_wide.h"
+#include "Custom/constants.h"
+#include "Custom/cpu_dispatch.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Wide BVH (BVH4 / BVH8)
+// Collapses a binary BVH of any builder into nodes with up to 4 or 8 children. Starting from the two
+// children of a binary node, the interior child with the largest surface area is replaced by its two
+// children until the node is full or only leaves are left, so the big boxes (the ones most rays
+// hit) are the ones removed from the tree. Leaves keep their sphere ranges in the binary BVH's array.
+// Child bounds are stored in SoA form, so one ray is tested against all children of a node at once,
+// on the active path (cpu_dispatch.c):
+// - AVX2 and AVX-512 test the 8 children of a BVH8 node in one go
+// - SSE2 tests groups of 4 children, BVH4 nodes in one go
+// - scalar uses the same slab test in a plain loop
+// The slab test uses the precomputed inverse direction and picks the near / far plane per axis from
+// the direction signs, so it needs no min / max between the planes and empty slots never hit.
+// Traversal is iterative : the hit children are pushed far to near, so the nearest is visited first,
+// and entries that start beyond the closest hit found so far are skipped.
+// The quantized BVH8 (bvh_wide_build_quantized) stores the child bounds as bytes on a power of two
+// grid over the node's box, 104 bytes a node instead of 256. Each child bound is rounded outwards
+// and checked against the exact decode (origin + q * 2^e, no rounding in the product), so decoded
+// boxes always contain the real ones. Traversal decodes a node into floats and runs the same slab
+// test, the hits are the same and only the looser boxes let a few more children through.
+
+//----------------------------------------------------------------------------------------------------
+
+static void node_arrays(const BVHWide *wide, uint32_t index, float **bounds, uint32_t **child, uint32_t **count)
+{
+    if (wide->width == 4)
+    {
+        *bounds = &wide->nodes4[index].bounds[0][0];
+        *child = wide->nodes4[index].child;
+        *count = wide->nodes4[index].count;
+    }
+    else
+    {
+        *bounds = &wide->nodes8[index].bounds[0][0];
+        *child = wide->nodes8[index].child;
+        *count = wide->nodes8[index].count;
+    }
+}
+
+// Smallest power of two step whose 255 steps from min reach max
+static int quantization_exponent(float min, float max)
+{
+    int exponent;
+    frexpf((max - min) / 255.0f, &exponent);
+    if (exponent < -100)
+        exponent = -100;
+    while (min + 255.0f * ldexpf(1.0f, exponent) < max)
+        exponent++;
+    return exponent;
+}
+
+static void set_quantized_child(BVH8QNode *node, int slot, AABB box, uint32_t child, uint32_t count)
+{
+    float min[3] = {box.min.x, box.min.y, box.min.z};
+    float max[3] = {box.max.x, box.max.y, box.max.z};
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float origin = node->origin[axis];
+        float scale = ldexpf(1.0f, node->exponent[axis]);
+        if (min[axis] > max[axis])
+        {
+            // Empty slot, inverted bounds never hit
+            node->bounds[axis][slot] = 255;
+            node->bounds[axis + 3][slot] = 0;
+            continue;
+        }
+
+        float lo = floorf((min[axis] - origin) / scale);
+        float hi = ceilf((max[axis] - origin) / scale);
+        int q_min = lo < 0.0f ? 0 : (lo > 255.0f ? 255 : (int)lo);
+        int q_max = hi < 0.0f ? 0 : (hi > 255.0f ? 255 : (int)hi);
+        while (q_min > 0 && origin + (float)q_min * scale > min[axis])
+            q_min--;
+        while (q_max < 255 && origin + (float)q_max * scale < max[axis])
+            q_max++;
+        node->bounds[axis][slot] = (uint8_t)q_min;
+        node->bounds[axis + 3][slot] = (uint8_t)q_max;
+    }
+    node->child[slot] = child;
+    node->count[slot] = (uint8_t)count;
+}
+
+static void set_child(BVHWide *wide, uint32_t index, int slot, AABB box, uint32_t child, uint32_t count)
+{
+    if (wide->quantized)
+    {
+        set_quantized_child(&wide->nodes8q[index], slot, box, child, count);
+        return;
+    }
+
+    float *bounds;
+    uint32_t *children, *counts;
+    node_arrays(wide, index, &bounds, &children, &counts);
+
+    int w = wide->width;
+    bounds[0 * w + slot] = box.min.x;
+    bounds[1 * w + slot] = box.min.y;
+    bounds[2 * w + slot] = box.min.z;
+    bounds[3 * w + slot] = box.max.x;
+    bounds[4 * w + slot] = box.max.y;
+    bounds[5 * w + slot] = box.max.z;
+    children[slot] = child;
+    counts[slot] = count;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Collapse
+
+//----------------------------------------------------------------------------------------------------
+
+// Binary nodes that become the children of the wide node made from binary node index
+static int gather_children(const BVH *bvh, uint32_t index, int width, uint32_t *children)
+{
+    const BVHFlatNode *node = &bvh->nodes[index];
+    if (node->count)
+    {
+        children[0] = index; // leaf root
+        return 1;
+    }
+
+    int n = 0;
+    children[n++] = index + 1;
+    children[n++] = node->right_or_first;
+    while (n < width)
+    {
+        int best = -1;
+        float best_area = -1.0f;
+        for (int i = 0; i < n; i++)
+        {
+            const BVHFlatNode *child = &bvh->nodes[children[i]];
+            float area = get_aabb_surface_area(child->bounds);
+            if (child->count == 0 && area > best_area)
+            {
+                best = i;
+                best_area = area;
+            }
+        }
+        if (best == -1)
+            break;
+
+        uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[n++] = bvh->nodes[opened].right_or_first;
+    }
+    return n;
+}
+
+static int count_recursive(const BVH *bvh, uint32_t index, int width, int depth, int *max_depth, uint32_t *max_leaf)
+{
+    uint32_t children[8];
+    int n = gather_children(bvh, index, width, children);
+    int nodes = 1;
+    if (depth > *max_depth)
+        *max_depth = depth;
+
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t count = bvh->nodes[children[i]].count;
+        if (count == 0)
+            nodes += count_recursive(bvh, children[i], width, depth + 1, max_depth, max_leaf);
+        else if (count > *max_leaf)
+            *max_leaf = count;
+    }
+    return nodes;
+}
+
+static uint32_t collapse_recursive(const BVH *bvh, BVHWide *wide, uint32_t binary_index, uint32_t *next)
+{
+    uint32_t index = (*next)++;
+    uint32_t children[8];
+    int n = gather_children(bvh, binary_index, wide->width, children);
+
+    if (wide->quantized)
+    {
+        AABB box = create_empty_aabb();
+        for (int i = 0; i < n; i++)
+            box = combine_aabb(box, bvh->nodes[children[i]].bounds);
+
+        BVH8QNode *node = &wide->nodes8q[index];
+        float min[3] = {box.min.x, box.min.y, box.min.z};
+        float max[3] = {box.max.x, box.max.y, box.max.z};
+        for (int axis = 0; axis < 3; axis++)
+        {
+            node->origin[axis] = min[axis];
+            node->exponent[axis] = (int8_t)quantization_exponent(min[axis], max[axis]);
+        }
+        node->pad = 0;
+    }
+
+    for (int slot = 0; slot < wide->width; slot++)
+    {
+        if (slot >= n)
+        {
+            set_child(wide, index, slot, create_empty_aabb(), 0, 0);
+            continue;
+        }
+
+        const BVHFlatNode *child = &bvh->nodes[children[slot]];
+        if (child->count)
+            set_child(wide, index, slot, child->bounds, child->right_or_first, child->count);
+        else
+            set_child(wide, index, slot, child->bounds, collapse_recursive(bvh, wide, children[slot], next), 0);
+    }
+    return index;
+}
+
+size_t bvh_wide_node_size(const BVHWide *wide)
+{
+    if (wide->quantized)
+        return sizeof(BVH8QNode);
+    return wide->width == 4 ? sizeof(BVH4Node) : sizeof(BVH8Node);
+}
+
+static BVHWide *build_wide(const BVH *bvh, int width, int quantized)
+{
+    int node_count = 0, max_depth = 0;
+    uint32_t max_leaf = 0;
+    if (bvh->node_count)
+        node_count = count_recursive(bvh, 0, width, 1, &max_depth, &max_leaf);
+
+    // Every visited node pushes at most width entries and pops one
+    if (max_depth * (width - 1) + 1 > BVH_WIDE_STACK_SIZE)
+    {
+        printf("BVH too deep (%d levels) for the %d wide traversal stack\n", max_depth, width);
+        return NULL;
+    }
+    if (quantized && max_leaf > 255)
+    {
+        printf("Quantized BVH leaves hold at most 255 spheres, the BVH has a leaf of %u\n", max_leaf);
+        return NULL;
+    }
+
+    BVHWide layout = {.width = width, .quantized = quantized};
+    size_t node_bytes = (size_t)node_count * bvh_wide_node_size(&layout);
+    Arena arena = arena_create(sizeof(BVHWide) + node_bytes + 128);
+    if (!arena.base)
+    {
+        printf("Failed to allocate memory for the wide BVH (%d nodes)\n", node_count);
+        return NULL;
+    }
+
+    BVHWide *wide = (BVHWide *)arena_alloc(&arena, sizeof(BVHWide), 64);
+    *wide = layout;
+    if (quantized)
+        wide->nodes8q = (BVH8QNode *)arena_alloc(&arena, node_bytes, 8);
+    else if (width == 4)
+        wide->nodes4 = (BVH4Node *)arena_alloc(&arena, node_bytes, 64);
+    else
+        wide->nodes8 = (BVH8Node *)arena_alloc(&arena, node_bytes, 64);
+    wide->node_count = node_count;
+    wide->spheres = bvh->spheres;
+    wide->sphere_count = bvh->sphere_count;
+
+    uint32_t next = 0;
+    if (node_count)
+        collapse_recursive(bvh, wide, 0, &next);
+    wide->arena = arena;
+    return wide;
+}
+
+// Returns NULL for widths other than 4 and 8, or trees too deep for the traversal stack
+BVHWide *bvh_wide_build(const BVH *bvh, int width)
+{
+    if (width != 4 && width != 8)
+    {
+        printf("Wide BVH width must be 4 or 8, not %d\n", width);
+        return NULL;
+    }
+    return build_wide(bvh, width, 0);
+}
+
+// 8 wide with quantized child bounds, also NULL if a leaf holds more than 255 spheres
+BVHWide *bvh_wide_build_quantized(const BVH *bvh)
+{
+    return build_wide(bvh, 8, 1);
+}
+
+void bvh_wide_free(BVHWide *wide)
+{
+    if (!wide)
+        return;
+    Arena arena = wide->arena;
+    arena_destroy(&arena);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Traversal
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    float origin[3];
+    float inv_direction[3];
+    int near_row[3]; // bounds row of the near plane on each axis, the far plane is 3 rows away
+    int far_row[3];
+} WideRay;
+
+typedef struct
+{
+    uint32_t index; // leaf - first sphere, otherwise wide node
+    uint32_t count; // 0 - wide node
+    float t;        // where the ray enters the box
+} WideStackEntry;
+
+static WideRay make_wide_ray(Ray ray)
+{
+    WideRay r;
+    float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    float direction[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+    for (int axis = 0; axis < 3; axis++)
+    {
+        r.origin[axis] = origin[axis];
+        r.inv_direction[axis] = ray_inv_direction(direction[axis]);
+        r.near_row[axis] = r.inv_direction[axis] < 0.0f ? axis + 3 : axis;
+        r.far_row[axis] = r.inv_direction[axis] < 0.0f ? axis : axis + 3;
+    }
+    return r;
+}
+
+// Slab test of the ray against the children of one wide node, returns the bit mask of the children
+// entered before closest and writes their entry distances
+typedef int (*WideBoxTest)(const float *bounds, int width, const WideRay *r, float closest, float *t_near);
+
+static int intersect_children_scalar(const float *bounds, int width, const WideRay *r, float closest, float *t_near)
+{
+    int mask = 0;
+    for (int slot = 0; slot < width; slot++)
+    {
+        float enter = -INFINITY, exit = INFINITY;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float t0 = (bounds[r->near_row[axis] * width + slot] - r->origin[axis]) * r->inv_direction[axis];
+            float t1 = (bounds[r->far_row[axis] * width + slot] - r->origin[axis]) * r->inv_direction[axis];
+            enter = t0 > enter ? t0 : enter;
+            exit = t1 < exit ? t1 : exit;
+        }
+        t_near[slot] = enter;
+        if (exit >= enter && exit > EPSILON && enter < closest)
+            mask |= 1 << slot;
+    }
+    return mask;
+}
+
+#if defined(CPU_DISPATCH_X86)
+
+static int intersect_children_sse2(const float *bounds, int width, const WideRay *r, float closest, float *t_near)
+{
+    int mask = 0;
+    for (int g = 0; g < width; g += 4)
+    {
+        __m128 t0[3], t1[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            __m128 origin = _mm_set1_ps(r->origin[axis]);
+            __m128 inv = _mm_set1_ps(r->inv_direction[axis]);
+            t0[axis] = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds + r->near_row[axis] * width + g), origin), inv);
+            t1[axis] = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds + r->far_row[axis] * width + g), origin), inv);
+        }
+        __m128 enter = _mm_max_ps(_mm_max_ps(t0[0], t0[1]), t0[2]);
+        __m128 exit = _mm_min_ps(_mm_min_ps(t1[0], t1[1]), t1[2]);
+        __m128 hit = _mm_and_ps(_mm_cmpge_ps(exit, enter),
+                                _mm_and_ps(_mm_cmpgt_ps(exit, _mm_set1_ps(EPSILON)),
+                                           _mm_cmplt_ps(enter, _mm_set1_ps(closest))));
+        _mm_storeu_ps(t_near + g, enter);
+        mask |= _mm_movemask_ps(hit) << g;
+    }
+    return mask;
+}
+
+// BVH8 nodes in one go, BVH4 nodes with SSE. A node has at most 8 children, so this is also the
+// AVX-512 path, 16 lanes would be half empty.
+CPU_TARGET_AVX2
+static int intersect_children_avx2(const float *bounds, int width, const WideRay *r, float closest, float *t_near)
+{
+    if (width != 8)
+        return intersect_children_sse2(bounds, width, r, closest, t_near);
+
+    __m256 t0[3], t1[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        __m256 origin = _mm256_set1_ps(r->origin[axis]);
+        __m256 inv = _mm256_set1_ps(r->inv_direction[axis]);
+        t0[axis] = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds + r->near_row[axis] * 8), origin), inv);
+        t1[axis] = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds + r->far_row[axis] * 8), origin), inv);
+    }
+    __m256 enter = _mm256_max_ps(_mm256_max_ps(t0[0], t0[1]), t0[2]);
+    __m256 exit = _mm256_min_ps(_mm256_min_ps(t1[0], t1[1]), t1[2]);
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(exit, enter, _CMP_GE_OQ),
+                               _mm256_and_ps(_mm256_cmp_ps(exit, _mm256_set1_ps(EPSILON), _CMP_GT_OQ),
+                                             _mm256_cmp_ps(enter, _mm256_set1_ps(closest), _CMP_LT_OQ)));
+    _mm256_storeu_ps(t_near, enter);
+    return _mm256_movemask_ps(hit);
+}
+
+#endif
+
+static WideBoxTest wide_box_test()
+{
+    switch (cpu_get_path())
+    {
+#if defined(CPU_DISPATCH_X86)
+    case CPU_PATH_AVX512:
+    case CPU_PATH_AVX2:
+        return intersect_children_avx2;
+    case CPU_PATH_SSE2:
+        return intersect_children_sse2;
+#endif
+    default:
+        return intersect_children_scalar;
+    }
+}
+
+// Quantized node bounds to floats, the same arithmetic as the checks in set_quantized_child()
+static inline void decode_quantized(const BVH8QNode *node, float bounds[6][8])
+{
+    for (int row = 0; row < 6; row++)
+    {
+        int axis = row % 3;
+        float origin = node->origin[axis];
+        float scale = ldexpf(1.0f, node->exponent[axis]);
+#if defined(__SSE2__)
+        __m128i bytes = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)node->bounds[row]), _mm_setzero_si128());
+        __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(bytes, _mm_setzero_si128()));
+        __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(bytes, _mm_setzero_si128()));
+        _mm_storeu_ps(bounds[row], _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(lo, _mm_set1_ps(scale))));
+        _mm_storeu_ps(bounds[row] + 4, _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(hi, _mm_set1_ps(scale))));
+#else
+        for (int slot = 0; slot < 8; slot++)
+            bounds[row][slot] = origin + (float)node->bounds[row][slot] * scale;
+#endif
+    }
+}
+
+static inline HitRecord traverse_wide(Ray ray, const BVHWide *wide, const int width, const int quantized,
+                                      WideBoxTest intersect_children)
+{
+    Sphere *closest_sphere = NULL;
+    float closest = INFINITY;
+    WideRay r = make_wide_ray(ray);
+
+    WideStackEntry stack[BVH_WIDE_STACK_SIZE];
+    int top = 0;
+    stack[top++] = (WideStackEntry){0, 0, -INFINITY};
+
+    while (top > 0)
+    {
+        WideStackEntry entry = stack[--top];
+        if (entry.t >= closest)
+            continue;
+
+        if (entry.count)
+        {
+            Sphere *first = &wide->spheres[entry.index];
+            for (uint32_t i = 0; i < entry.count; i++)
+            {
+                float t;
+                if (ray_sphere_hit_t(ray, &first[i], EPSILON, closest, &t))
+                {
+                    closest_sphere = &first[i];
+                    closest = t;
+                }
+            }
+            continue;
+        }
+
+        float *bounds;
+        uint32_t *child, *count;
+        float decoded[6][8];
+        BVH8QNode *qnode = NULL;
+        if (quantized)
+        {
+            qnode = &wide->nodes8q[entry.index];
+            decode_quantized(qnode, decoded);
+            bounds = &decoded[0][0];
+            child = qnode->child;
+            count = NULL;
+        }
+        else
+        {
+            node_arrays(wide, entry.index, &bounds, &child, &count);
+        }
+
+        float t_near[8];
+        int mask = intersect_children(bounds, width, &r, closest, t_near);
+
+        // Insertion sort of the hit children by entry distance, farthest first
+        WideStackEntry hits[8];
+        int n = 0;
+        while (mask)
+        {
+            int slot = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            WideStackEntry hit = {child[slot], quantized ? qnode->count[slot] : count[slot], t_near[slot]};
+            int i = n++;
+            while (i > 0 && hits[i - 1].t < hit.t)
+            {
+                hits[i] = hits[i - 1];
+                i--;
+            }
+            hits[i] = hit;
+        }
+
+        for (int i = 0; i < n; i++)
+            stack[top++] = hits[i];
+    }
+    return closest_sphere ? ray_sphere_hit_record(ray, closest_sphere, closest) : (HitRecord){0};
+}
+
+// Name of the box test used for the given width, for benchmark output
+const char *bvh_wide_simd_path(int width)
+{
+    CpuPath path = cpu_get_path();
+    if (path >= CPU_PATH_AVX2 && width == 8)
+        return "AVX2";
+    if (path >= CPU_PATH_SSE2)
+        return width == 8 ? "2x SSE2" : "SSE2";
+    return "scalar";
+}
+
+// Closest hit, the same result as ray_bvh_intersect() on the binary BVH the wide one was built from
+HitRecord ray_bvh_wide_intersect(Ray ray, const BVHWide *wide)
+{
+    if (wide->node_count == 0)
+        return (HitRecord){0};
+    WideBoxTest box_test = wide_box_test();
+    if (wide->quantized)
+        return traverse_wide(ray, wide, 8, 1, box_test);
+    return wide->width == 4 ? traverse_wide(ray, wide, 4, 0, box_test) : traverse_wide(ray, wide, 8, 0, box_test);
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+#include "Custom/cpu_dispatch.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Runtime CPU dispatch
+// The binary is built for the baseline of its target (SSE2 on x86-64), the SIMD kernels are compiled
+// once per path and one of them is picked per call by the active path :
+// - AVX-512 (AVX-512F) 16 floats per instruction
+// - AVX2 8 floats
+// - SSE2 4 floats, always there on x86-64
+// - scalar, the plain C loops, the only path of other targets
+// The active path is the widest one cpuid reports (with the OS saving the wider registers), detected
+// on first use. cpu_set_path() forces a narrower one, e.g. from the command line for benchmarking.
+
+//----------------------------------------------------------------------------------------------------
+
+static const char *path_names[CPU_PATH_COUNT] = {"scalar", "SSE2", "AVX2", "AVX-512"};
+static const char *path_options[CPU_PATH_COUNT] = {"scalar", "sse2", "avx2", "avx512"};
+
+// CPU_PATH_COUNT until the first cpu_get_path() or cpu_set_path()
+static CpuPath active_path = CPU_PATH_COUNT;
+
+int cpu_path_supported(CpuPath path)
+{
+    switch (path)
+    {
+    case CPU_PATH_SCALAR:
+        return 1;
+#if defined(CPU_DISPATCH_X86)
+    case CPU_PATH_SSE2:
+        return 1;
+    case CPU_PATH_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    case CPU_PATH_AVX512:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+        return 0;
+    }
+}
+
+// Widest path of this CPU
+CpuPath cpu_detect_path()
+{
+    CpuPath path = CPU_PATH_COUNT - 1;
+    while (path > CPU_PATH_SCALAR && !cpu_path_supported(path))
+        path--;
+    return path;
+}
+
+CpuPath cpu_get_path()
+{
+    if (active_path == CPU_PATH_COUNT)
+        active_path = cpu_detect_path();
+    return active_path;
+}
+
+// Returns 0 and keeps the active path if this CPU (or build) can not run the given one
+int cpu_set_path(CpuPath path)
+{
+    if (path < CPU_PATH_SCALAR || path >= CPU_PATH_COUNT || !cpu_path_supported(path))
+    {
+        printf("The %s path is not supported on this CPU, using %s\n", cpu_path_name(path),
+               cpu_path_name(cpu_get_path()));
+        return 0;
+    }
+    active_path = path;
+    return 1;
+}
+
+const char *cpu_path_name(CpuPath path)
+{
+    return path >= CPU_PATH_SCALAR && path < CPU_PATH_COUNT ? path_names[path] : "unknown";
+}
+
+// Path of a command line name (scalar, sse2, avx2, avx512), returns 0 for an unknown name
+int cpu_path_parse(const char *name, CpuPath *path)
+{
+    for (int i = 0; i < CPU_PATH_COUNT; i++)
+    {
+        if (strcmp(name, path_options[i]) == 0)
+        {
+            *path = (CpuPath)i;
+            return 1;
+        }
+    }
+    return 0;
+}
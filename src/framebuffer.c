@@ -0,0 +1,147 @@
+#include <string.h>
+#include "Custom/framebuffer.h"
+#include "Custom/cpu_dispatch.h"
+
+#if defined(CPU_DISPATCH_X86)
+#include <immintrin.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Framebuffer accumulation
+// While the camera stands still, the render loop (main.c) adds every frame's colors to a float
+// buffer and shows the average of the frames so far. framebuffer_accumulate() does both for a run
+// of pixels : sum += color / 255, shown = min(sum / frames * 255, 255), on the active path
+// (cpu_dispatch.c) :
+// - AVX-512 4 pixels (16 channels) per instruction
+// - AVX2 2 pixels
+// - SSE2 1 pixel, 4 pixels per loop
+// - scalar channel by channel
+// All paths use the same float operations as the scalar one, so they show the same bytes.
+// The first frame (frames == 1) restarts the sums and shows the colors unchanged.
+
+//----------------------------------------------------------------------------------------------------
+
+static void accumulate_scalar(float *accumulation, const SDL_Color *colors, int first, int count, int frames,
+                              SDL_Color *out)
+{
+    for (int i = first; i < count; i++)
+    {
+        const Uint8 in[4] = {colors[i].r, colors[i].g, colors[i].b, colors[i].a};
+        Uint8 avg[4];
+        for (int c = 0; c < 4; c++)
+        {
+            float *sum = &accumulation[4 * i + c];
+            *sum += (float)in[c] / 255.0f;
+            float shown = *sum / frames * 255.0f;
+            avg[c] = (Uint8)(shown < 255.0f ? shown : 255.0f);
+        }
+        out[i] = (SDL_Color){avg[0], avg[1], avg[2], 255};
+    }
+}
+
+#if defined(CPU_DISPATCH_X86)
+
+_Static_assert(sizeof(SDL_Color) == 4, "SIMD accumulation reads SDL_Colors as 4 bytes");
+
+static void accumulate_sse2(float *accumulation, const SDL_Color *colors, int count, int frames, SDL_Color *out)
+{
+    const __m128 scale = _mm_set1_ps(255.0f), frame_count = _mm_set1_ps((float)frames);
+    const __m128i zero = _mm_setzero_si128(), alpha = _mm_set1_epi32((int)0xff000000);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)&colors[i]);
+        __m128i lo = _mm_unpacklo_epi8(bytes, zero), hi = _mm_unpackhi_epi8(bytes, zero);
+        __m128i pixels[4] = {_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+                             _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)};
+        __m128i avg[4];
+        for (int p = 0; p < 4; p++)
+        {
+            float *sum = &accumulation[4 * (i + p)];
+            __m128 total = _mm_add_ps(_mm_loadu_ps(sum), _mm_div_ps(_mm_cvtepi32_ps(pixels[p]), scale));
+            _mm_storeu_ps(sum, total);
+            avg[p] = _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(_mm_div_ps(total, frame_count), scale), scale));
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(avg[0], avg[1]), _mm_packs_epi32(avg[2], avg[3]));
+        _mm_storeu_si128((__m128i *)&out[i], _mm_or_si128(packed, alpha));
+    }
+    accumulate_scalar(accumulation, colors, i, count, frames, out);
+}
+
+CPU_TARGET_AVX2
+static void accumulate_avx2(float *accumulation, const SDL_Color *colors, int count, int frames, SDL_Color *out)
+{
+    const __m256 scale = _mm256_set1_ps(255.0f), frame_count = _mm256_set1_ps((float)frames);
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+    // The packs work per 128 bit lane, the bytes come out as pixels 0 2 4 6 1 3 5 7
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i avg[4];
+        for (int p = 0; p < 4; p++)
+        {
+            float *sum = &accumulation[4 * (i + 2 * p)];
+            __m256i pair = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&colors[i + 2 * p]));
+            __m256 total = _mm256_add_ps(_mm256_loadu_ps(sum), _mm256_div_ps(_mm256_cvtepi32_ps(pair), scale));
+            _mm256_storeu_ps(sum, total);
+            avg[p] = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(_mm256_div_ps(total, frame_count), scale), scale));
+        }
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(avg[0], avg[1]), _mm256_packs_epi32(avg[2], avg[3]));
+        packed = _mm256_permutevar8x32_epi32(packed, order);
+        _mm256_storeu_si256((__m256i *)&out[i], _mm256_or_si256(packed, alpha));
+    }
+    accumulate_scalar(accumulation, colors, i, count, frames, out);
+}
+
+CPU_TARGET_AVX512
+static void accumulate_avx512(float *accumulation, const SDL_Color *colors, int count, int frames, SDL_Color *out)
+{
+    const __m512 scale = _mm512_set1_ps(255.0f), frame_count = _mm512_set1_ps((float)frames);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        float *sum = &accumulation[4 * i];
+        __m512i pixels = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)&colors[i]));
+        __m512 total = _mm512_add_ps(_mm512_loadu_ps(sum), _mm512_div_ps(_mm512_cvtepi32_ps(pixels), scale));
+        _mm512_storeu_ps(sum, total);
+        __m512i avg = _mm512_cvttps_epi32(_mm512_min_ps(_mm512_mul_ps(_mm512_div_ps(total, frame_count), scale), scale));
+        _mm_storeu_si128((__m128i *)&out[i], _mm_or_si128(_mm512_cvtepi32_epi8(avg), alpha));
+    }
+    accumulate_scalar(accumulation, colors, i, count, frames, out);
+}
+
+#endif
+
+// Adds count colors to their accumulation entries and writes the average of frames frames to out
+void framebuffer_accumulate(float *accumulation, const SDL_Color *colors, int count, int frames, SDL_Color *out)
+{
+    if (frames <= 1)
+    {
+        memset(accumulation, 0, 4 * count * sizeof(float));
+        frames = 1;
+    }
+
+    switch (cpu_get_path())
+    {
+#if defined(CPU_DISPATCH_X86)
+    case CPU_PATH_AVX512:
+        accumulate_avx512(accumulation, colors, count, frames, out);
+        break;
+    case CPU_PATH_AVX2:
+        accumulate_avx2(accumulation, colors, count, frames, out);
+        break;
+    case CPU_PATH_SSE2:
+        accumulate_sse2(accumulation, colors, count, frames, out);
+        break;
+#endif
+    default:
+        accumulate_scalar(accumulation, colors, 0, count, frames, out);
+        break;
+    }
+
+    if (frames == 1)
+        memcpy(out, colors, count * sizeof(SDL_Color));
+}
@@ -2,8 +2,13 @@
 #include "Custom/vec3.h"
 #include "Custom/constants.h"
 #include "Custom/bvh.h"
+#include "Custom/cpu_dispatch.h"
 #include <math.h>
 
+#if defined(CPU_DISPATCH_X86)
+#include <immintrin.h>
+#endif
+
 //--------------------------------------------------------------------------------------------------
 
 // ray_sphere_intersect() - Returns the Hitrecord of the ray with the sphere
@@ -17,7 +22,22 @@
 //--------------------------------------------------------------------------------------------------
 
 HitRecord ray_sphere_intersect(Ray ray, Sphere *sphere) {
-    HitRecord rec = {0};
+    return ray_sphere_intersect_range(ray, sphere, EPSILON, INFINITY);
+}
+
+// Same as ray_sphere_intersect(), the near root only counts when t_min < t < t_max
+HitRecord ray_sphere_intersect_range(Ray ray, Sphere *sphere, float t_min, float t_max) {
+    float t;
+    if (ray_sphere_hit_t(ray, sphere, t_min, t_max, &t)) {
+        return ray_sphere_hit_record(ray, sphere, t);
+    }
+    return (HitRecord){0};
+}
+
+// Distance pass of the sphere test, returns 1 and writes the near root to t if t_min < t < t_max.
+// Traversal kernels only keep t and the sphere of the closest hit so far and build the HitRecord
+// once for the winner with ray_sphere_hit_record().
+int ray_sphere_hit_t(Ray ray, const Sphere *sphere, float t_min, float t_max, float *t) {
     Vec3 oc = vec3_sub(ray.origin, sphere->center);
     float a = vec3_dot(ray.direction, ray.direction);
     float b = 2.0f * vec3_dot(oc, ray.direction);
@@ -25,19 +45,29 @@ HitRecord ray_sphere_intersect(Ray ray, Sphere *sphere) {
     float discriminant = b * b - 4 * a * c;
 
     if (discriminant > 0) {
-        float t = (-b - sqrt(discriminant)) / (2.0f * a);
-        if (t > EPSILON) {
-            rec.hit_something = 1;
-            rec.t = t;
-            rec.point = vec3_add(ray.origin, vec3_multiply(ray.direction, t));
-            rec.normal = vec3_normalize(vec3_sub(rec.point, sphere->center));
-            rec.object = sphere;
-            return rec;
-        }
+        *t = (-b - sqrtf(discriminant)) / (2.0f * a);
+        return *t > t_min && *t < t_max;
     }
+    return 0;
+}
+
+// Attribute pass, the HitRecord (point, normal, sphere) of a hit at t found by ray_sphere_hit_t()
+HitRecord ray_sphere_hit_record(Ray ray, Sphere *sphere, float t) {
+    HitRecord rec;
+    rec.hit_something = 1;
+    rec.t = t;
+    rec.point = vec3_add(ray.origin, vec3_multiply(ray.direction, t));
+    rec.normal = vec3_normalize(vec3_sub(rec.point, sphere->center));
+    rec.object = sphere;
     return rec;
 }
 
+// Occlusion test, 1 if ray_sphere_intersect_range() would report a hit
+int ray_sphere_occludes(Ray ray, const Sphere *sphere, float t_min, float t_max) {
+    float t;
+    return ray_sphere_hit_t(ray, sphere, t_min, t_max, &t);
+}
+
 //--------------------------------------------------------------------------------------------------
 
 // ray_aabb_intersect() - Returns 1 if the given AABB is hit with the ray otherwise 0
@@ -46,49 +76,42 @@ HitRecord ray_sphere_intersect(Ray ray, Sphere *sphere) {
 //--------------------------------------------------------------------------------------------------
 
 
+// Slab distances of the ray to the box, entry in tmin and exit in tmax. All three axes at once (vec3.h),
+// an axis the ray runs parallel to does not limit the distances.
+static inline void ray_aabb_slabs(Ray ray, AABB box, float *tmin, float *tmax) {
+    Vec3A origin = vec3a_load(ray.origin);
+    Vec3A direction = vec3a_load(ray.direction);
+    Vec3A t1 = vec3a_div(vec3a_sub(vec3a_load(box.min), origin), direction);
+    Vec3A t2 = vec3a_div(vec3a_sub(vec3a_load(box.max), origin), direction);
+    t1 = vec3a_select_zero(direction, vec3a_set1(-INFINITY), t1);
+    t2 = vec3a_select_zero(direction, vec3a_set1(INFINITY), t2);
+
+    *tmin = vec3a_hmax(vec3a_min(t1, t2));
+    *tmax = vec3a_hmin(vec3a_max(t1, t2));
+}
+
 int ray_aabb_intersect(Ray ray, AABB box) {
-    float tx1, tx2, ty1, ty2, tz1, tz2;
     float tmin, tmax;
-    
-
-    if (ray.direction.x == 0.0f) {
-        tx1 = -INFINITY;
-        tx2 = INFINITY;
-    } else {
-        tx1 = (box.min.x - ray.origin.x) / ray.direction.x;
-        tx2 = (box.max.x - ray.origin.x) / ray.direction.x;
-    }
-    
-    if (ray.direction.y == 0.0f) {
-        ty1 = -INFINITY;
-        ty2 = INFINITY;
-    } else {
-        ty1 = (box.min.y - ray.origin.y) / ray.direction.y;
-        ty2 = (box.max.y - ray.origin.y) / ray.direction.y;
-    }
-    
-    if (ray.direction.z == 0.0f) {
-        tz1 = -INFINITY;
-        tz2 = INFINITY;
-    } else {
-        tz1 = (box.min.z - ray.origin.z) / ray.direction.z;
-        tz2 = (box.max.z - ray.origin.z) / ray.direction.z;
-    }
-    
-    tmin = fmax(fmin(tx1, tx2), fmax(fmin(ty1, ty2), fmin(tz1, tz2)));
-    tmax = fmin(fmax(tx1, tx2), fmin(fmax(ty1, ty2), fmax(tz1, tz2)));
-    
+    ray_aabb_slabs(ray, box, &tmin, &tmax);
     return tmax >= tmin && tmax > EPSILON;  
 }
+
+// Same as ray_aabb_intersect(), but the box only counts when the ray overlaps it within [t_min, t_max]
+int ray_aabb_intersect_range(Ray ray, AABB box, float t_min, float t_max) {
+    float tmin, tmax;
+    ray_aabb_slabs(ray, box, &tmin, &tmax);
+    return tmax >= tmin && tmax > t_min && tmin <= t_max;
+}
 //--------------------------------------------------------------------------------------------------
 
-// ray_bvh_intersect() - Returns the hitrecord for the given ray
-// Main function for intersection test by traversing Bounding Volume Hierarchies (BVH) using DFS
+// ray_bvh_node_intersect() - Returns the hitrecord for the given ray
+// Traverses the pointer tree from build_bvh_node() using DFS.
+// Only used for comparing against the linear BVH, rendering uses ray_bvh_intersect()
 
 //--------------------------------------------------------------------------------------------------
 
 
-HitRecord ray_bvh_intersect(Ray ray, BVHNode* node) {
+HitRecord ray_bvh_node_intersect(Ray ray, BVHNode* node) {
     HitRecord rec = {0};
     
     if (!ray_aabb_intersect(ray, node->bounds)) {
@@ -96,14 +119,477 @@ HitRecord ray_bvh_intersect(Ray ray, BVHNode* node) {
     }
     
     if (node->sphere != NULL) {
-        return ray_sphere_intersect(ray, node->sphere);
+        for (int i = 0; i < node->sphere_count; i++) {
+            HitRecord hit = ray_sphere_intersect(ray, &node->sphere[i]);
+            if (hit.hit_something && (!rec.hit_something || hit.t < rec.t)) {
+                rec = hit;
+            }
+        }
+        return rec;
     }
     
-    HitRecord left_hit = ray_bvh_intersect(ray, node->left);
-    HitRecord right_hit = ray_bvh_intersect(ray, node->right);
+    HitRecord left_hit = ray_bvh_node_intersect(ray, node->left);
+    HitRecord right_hit = ray_bvh_node_intersect(ray, node->right);
     
     if (!left_hit.hit_something) return right_hit;
     if (!right_hit.hit_something) return left_hit;
     
     return (left_hit.t < right_hit.t) ? left_hit : right_hit;
 }
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_bvh_intersect_range() - Returns the closest hit with t_min < t < t_max for the given ray
+// Main function for intersection test, walks the linear Bounding Volume Hierarchy (BVH) iteratively
+// Left child of a node is the next node in the array, the right child index is stored in the node
+// Leaves can hold several spheres, all of them are tested and the closest hit is kept
+// Of the two children the one the ray meets first along the node's split axis is visited first, the
+// other waits on a fixed size stack. Every hit narrows t_max, so boxes entered beyond the closest hit
+// so far are skipped. Only strictly closer hits replace the current one, the answer is the same as
+// testing every sphere. When the stack is full the near subtree is walked by a nested call.
+// The walk only carries t and the sphere of the closest hit, point and normal are computed once at
+// the end for the winner.
+
+//--------------------------------------------------------------------------------------------------
+
+
+// The walk is built once per path (cpu_dispatch.c), each with its own slab test inlined:
+// - AVX2 and AVX-512 the 6 planes of the box in one 8 lane register, one subtraction and one division
+// - SSE2 ray_aabb_slabs(), the min and the max planes 3 lanes each
+// - scalar the same divisions axis by axis
+// All of them compute the ray_aabb_slabs() distances, the walk visits the same nodes on every path.
+// One box fills only 6 lanes, the AVX-512 walk is the AVX2 test built for the AVX-512 target.
+// Single box tests (ray_aabb_intersect()) and the any-hit walk keep ray_aabb_slabs().
+
+typedef void (*SlabTest)(const Ray* ray, const AABB* box, float* tmin, float* tmax);
+
+static inline void slabs_scalar(const Ray* ray, const AABB* box, float* tmin, float* tmax) {
+    const float origin[3] = {ray->origin.x, ray->origin.y, ray->origin.z};
+    const float direction[3] = {ray->direction.x, ray->direction.y, ray->direction.z};
+    const float min[3] = {box->min.x, box->min.y, box->min.z};
+    const float max[3] = {box->max.x, box->max.y, box->max.z};
+    float near[3], far[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float t1 = direction[axis] != 0.0f ? (min[axis] - origin[axis]) / direction[axis] : -INFINITY;
+        float t2 = direction[axis] != 0.0f ? (max[axis] - origin[axis]) / direction[axis] : INFINITY;
+        near[axis] = t1 < t2 ? t1 : t2;
+        far[axis] = t1 > t2 ? t1 : t2;
+    }
+    float near_yz = near[1] > near[2] ? near[1] : near[2];
+    float far_yz = far[1] < far[2] ? far[1] : far[2];
+    *tmin = near[0] > near_yz ? near[0] : near_yz;
+    *tmax = far[0] < far_yz ? far[0] : far_yz;
+}
+
+#if defined(CPU_DISPATCH_X86)
+
+static inline void slabs_sse2(const Ray* ray, const AABB* box, float* tmin, float* tmax) {
+    ray_aabb_slabs(*ray, *box, tmin, tmax);
+}
+
+_Static_assert(sizeof(AABB) == 6 * sizeof(float), "The AVX2 slab test reads an AABB as 6 floats");
+
+// Two overlapping loads of the 6 box floats, lanes 0-2 hold the min planes and lanes 5-7 the max planes
+CPU_TARGET_AVX2
+static inline void slabs_avx2(const Ray* ray, const AABB* box, float* tmin, float* tmax) {
+    const Vec3 o = ray->origin, d = ray->direction;
+    const float* planes = &box->min.x;
+    __m256 origin = _mm256_setr_ps(o.x, o.y, o.z, o.x, o.z, o.x, o.y, o.z);
+    __m256 direction = _mm256_setr_ps(d.x, d.y, d.z, d.x, d.z, d.x, d.y, d.z);
+    __m256 parallel = _mm256_setr_ps(-INFINITY, -INFINITY, -INFINITY, 0.0f, 0.0f, INFINITY, INFINITY, INFINITY);
+
+    __m256 t = _mm256_div_ps(_mm256_sub_ps(_mm256_loadu2_m128(planes + 2, planes), origin), direction);
+    t = _mm256_blendv_ps(t, parallel, _mm256_cmp_ps(direction, _mm256_setzero_ps(), _CMP_EQ_OQ));
+
+    __m128 t1 = _mm256_castps256_ps128(t);
+    __m128 t2 = _mm256_extractf128_ps(t, 1);
+    t2 = _mm_shuffle_ps(t2, t2, _MM_SHUFFLE(0, 3, 2, 1));
+    *tmin = vec3a_hmax(_mm_min_ps(t1, t2));
+    *tmax = vec3a_hmin(_mm_max_ps(t1, t2));
+}
+
+#endif
+
+static Sphere* ray_flat_subtree_closest(Ray ray, const BVH* bvh, const SphereSoA* soa, uint32_t root, float t_min,
+                                        float* t_max, TraversalStats* stats);
+
+// Returns the sphere of the closest hit in the subtree (NULL if none), t_max becomes its t
+static inline __attribute__((always_inline)) Sphere* subtree_closest(Ray ray, const BVH* bvh, const SphereSoA* soa,
+                                                                     uint32_t root, float t_min, float* t_max,
+                                                                     TraversalStats* stats, SlabTest slabs) {
+    Sphere* closest = NULL;
+    float closest_t = *t_max;
+    const float direction[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+    uint32_t stack[BVH_TRAVERSAL_STACK_SIZE];
+    int top = 0;
+    uint32_t index = root;
+
+    for (;;) {
+        const BVHFlatNode* node = &bvh->nodes[index];
+        if (stats) stats->node_visits++;
+
+        float enter, exit;
+        slabs(&ray, &node->bounds, &enter, &exit);
+        if (exit >= enter && exit > t_min && enter <= closest_t) {
+            if (node->count == 0) {
+                uint32_t near = index + 1, far = node->right_or_first;
+                if ((direction[node->axis] < 0.0f) != node->axis_flip) {
+                    near = node->right_or_first;
+                    far = index + 1;
+                }
+
+                if (top < BVH_TRAVERSAL_STACK_SIZE) {
+                    stack[top++] = far;
+                    index = near;
+                    continue;
+                }
+
+                Sphere* hit = ray_flat_subtree_closest(ray, bvh, soa, near, t_min, &closest_t, stats);
+                if (hit) {
+                    closest = hit;
+                }
+                index = far;
+                continue;
+            }
+
+            Sphere* first = &bvh->spheres[node->right_or_first];
+            if (stats) stats->sphere_tests += node->count;
+            if (soa && node->count >= SPHERE_SOA_MIN_LEAF) {
+                int hit = sphere_soa_closest(soa, ray, (int)node->right_or_first, (int)node->count, t_min, &closest_t);
+                if (hit >= 0) {
+                    closest = &bvh->spheres[hit];
+                }
+            } else {
+                for (uint32_t i = 0; i < node->count; i++) {
+                    float t;
+                    if (ray_sphere_hit_t(ray, &first[i], t_min, closest_t, &t)) {
+                        closest = &first[i];
+                        closest_t = t;
+                    }
+                }
+            }
+        }
+
+        if (top == 0) {
+            *t_max = closest_t;
+            return closest;
+        }
+        index = stack[--top];
+    }
+}
+
+static Sphere* subtree_closest_scalar(Ray ray, const BVH* bvh, const SphereSoA* soa, uint32_t root, float t_min,
+                                      float* t_max, TraversalStats* stats) {
+    return subtree_closest(ray, bvh, soa, root, t_min, t_max, stats, slabs_scalar);
+}
+
+#if defined(CPU_DISPATCH_X86)
+
+static Sphere* subtree_closest_sse2(Ray ray, const BVH* bvh, const SphereSoA* soa, uint32_t root, float t_min,
+                                    float* t_max, TraversalStats* stats) {
+    return subtree_closest(ray, bvh, soa, root, t_min, t_max, stats, slabs_sse2);
+}
+
+CPU_TARGET_AVX2
+static Sphere* subtree_closest_avx2(Ray ray, const BVH* bvh, const SphereSoA* soa, uint32_t root, float t_min,
+                                    float* t_max, TraversalStats* stats) {
+    return subtree_closest(ray, bvh, soa, root, t_min, t_max, stats, slabs_avx2);
+}
+
+CPU_TARGET_AVX512
+static Sphere* subtree_closest_avx512(Ray ray, const BVH* bvh, const SphereSoA* soa, uint32_t root, float t_min,
+                                      float* t_max, TraversalStats* stats) {
+    return subtree_closest(ray, bvh, soa, root, t_min, t_max, stats, slabs_avx2);
+}
+
+#endif
+
+// The walk of the active path
+static Sphere* ray_flat_subtree_closest(Ray ray, const BVH* bvh, const SphereSoA* soa, uint32_t root, float t_min,
+                                        float* t_max, TraversalStats* stats) {
+    switch (cpu_get_path()) {
+#if defined(CPU_DISPATCH_X86)
+    case CPU_PATH_AVX512:
+        return subtree_closest_avx512(ray, bvh, soa, root, t_min, t_max, stats);
+    case CPU_PATH_AVX2:
+        return subtree_closest_avx2(ray, bvh, soa, root, t_min, t_max, stats);
+    case CPU_PATH_SSE2:
+        return subtree_closest_sse2(ray, bvh, soa, root, t_min, t_max, stats);
+#endif
+    default:
+        return subtree_closest_scalar(ray, bvh, soa, root, t_min, t_max, stats);
+    }
+}
+
+HitRecord ray_bvh_intersect_range(Ray ray, const BVH* bvh, float t_min, float t_max) {
+    if (bvh->node_count == 0) {
+        return (HitRecord){0};
+    }
+    Sphere* closest = ray_flat_subtree_closest(ray, bvh, NULL, 0, t_min, &t_max, NULL);
+    return closest ? ray_sphere_hit_record(ray, closest, t_max) : (HitRecord){0};
+}
+
+HitRecord ray_bvh_intersect(Ray ray, const BVH* bvh) {
+    return ray_bvh_intersect_range(ray, bvh, EPSILON, INFINITY);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_bvh_intersect_soa() - Same as ray_bvh_intersect(), leaves of SPHERE_SOA_MIN_LEAF spheres or more
+// are tested with the SIMD kernel of sphere_soa.c. soa must be built from bvh->spheres, in that order.
+// ray_spheres_closest_soa() - brute force closest hit over all spheres of a SoA copy of spheres.
+
+//--------------------------------------------------------------------------------------------------
+
+
+HitRecord ray_bvh_intersect_soa(Ray ray, const BVH* bvh, const SphereSoA* soa) {
+    if (bvh->node_count == 0) {
+        return (HitRecord){0};
+    }
+    float t_max = INFINITY;
+    Sphere* closest = ray_flat_subtree_closest(ray, bvh, soa, 0, EPSILON, &t_max, NULL);
+    return closest ? ray_sphere_hit_record(ray, closest, t_max) : (HitRecord){0};
+}
+
+HitRecord ray_spheres_closest_soa(Ray ray, Sphere* spheres, const SphereSoA* soa) {
+    float t_max = INFINITY;
+    int closest = sphere_soa_closest(soa, ray, 0, soa->count, EPSILON, &t_max);
+    return closest >= 0 ? ray_sphere_hit_record(ray, &spheres[closest], t_max) : (HitRecord){0};
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_bvh_intersect_subtrees() - Same as ray_bvh_intersect() for a ray that can only hit spheres
+// below the given roots, e.g. the tile frustum cut of a primary ray (tile_frustum.c). Roots are
+// walked in order with the closest hit so far, front to back roots cull the later ones early.
+
+//--------------------------------------------------------------------------------------------------
+
+
+HitRecord ray_bvh_intersect_subtrees(Ray ray, const BVH* bvh, const uint32_t* roots, int root_count) {
+    Sphere* closest = NULL;
+    float t_max = INFINITY;
+    for (int i = 0; i < root_count; i++) {
+        Sphere* hit = ray_flat_subtree_closest(ray, bvh, NULL, roots[i], EPSILON, &t_max, NULL);
+        if (hit) {
+            closest = hit;
+        }
+    }
+    return closest ? ray_sphere_hit_record(ray, closest, t_max) : (HitRecord){0};
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_bvh_intersect_stats() - Same traversal as ray_bvh_intersect(), also counts the visited nodes
+// (box tests) and sphere tests into stats. Used for measuring trees, not for rendering.
+
+//--------------------------------------------------------------------------------------------------
+
+
+HitRecord ray_bvh_intersect_stats(Ray ray, const BVH* bvh, TraversalStats* stats) {
+    if (bvh->node_count == 0) {
+        return (HitRecord){0};
+    }
+    float t_max = INFINITY;
+    Sphere* closest = ray_flat_subtree_closest(ray, bvh, NULL, 0, EPSILON, &t_max, stats);
+    return closest ? ray_sphere_hit_record(ray, closest, t_max) : (HitRecord){0};
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_bvh_occluded() - Returns 1 if any sphere is hit with t_min < t < t_max, otherwise 0
+// Any-hit query for shadow rays, ambient occlusion and visibility tests. Same walk as
+// ray_bvh_intersect_range() (nearer child first, fixed stack), but it returns at the first sphere
+// hit inside the range and never builds a HitRecord. t_max stays fixed, there is no closest hit.
+// ray_spheres_occluded() - the brute force version over a sphere array.
+
+//--------------------------------------------------------------------------------------------------
+
+
+static int ray_flat_subtree_occluded(Ray ray, const BVH* bvh, uint32_t root, float t_min, float t_max) {
+    const float direction[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+    uint32_t stack[BVH_TRAVERSAL_STACK_SIZE];
+    int top = 0;
+    uint32_t index = root;
+
+    for (;;) {
+        const BVHFlatNode* node = &bvh->nodes[index];
+
+        if (ray_aabb_intersect_range(ray, node->bounds, t_min, t_max)) {
+            if (node->count == 0) {
+                uint32_t near = index + 1, far = node->right_or_first;
+                if ((direction[node->axis] < 0.0f) != node->axis_flip) {
+                    near = node->right_or_first;
+                    far = index + 1;
+                }
+
+                if (top < BVH_TRAVERSAL_STACK_SIZE) {
+                    stack[top++] = far;
+                    index = near;
+                    continue;
+                }
+
+                if (ray_flat_subtree_occluded(ray, bvh, near, t_min, t_max)) {
+                    return 1;
+                }
+                index = far;
+                continue;
+            }
+
+            const Sphere* first = &bvh->spheres[node->right_or_first];
+            for (uint32_t i = 0; i < node->count; i++) {
+                if (ray_sphere_occludes(ray, &first[i], t_min, t_max)) {
+                    return 1;
+                }
+            }
+        }
+
+        if (top == 0) {
+            return 0;
+        }
+        index = stack[--top];
+    }
+}
+
+int ray_bvh_occluded(Ray ray, const BVH* bvh, float t_min, float t_max) {
+    if (bvh->node_count == 0) {
+        return 0;
+    }
+    return ray_flat_subtree_occluded(ray, bvh, 0, t_min, t_max);
+}
+
+int ray_spheres_occluded(Ray ray, const Sphere* spheres, int num_spheres, float t_min, float t_max) {
+    for (int i = 0; i < num_spheres; i++) {
+        if (ray_sphere_occludes(ray, &spheres[i], t_min, t_max)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_bvh_skip_intersect_range() - Stackless alternative to ray_bvh_intersect_range() (bvh_skip.c)
+// Walks the skip link copy of a linear BVH forward only: a hit interior node continues at the next
+// node, a missed node or a finished leaf jumps to its skip link, the walk ends past the last node.
+// Same box and sphere tests and the same closest hit culling, but the children are always visited
+// left first, so the closest t is the same while more nodes may be tested.
+
+//--------------------------------------------------------------------------------------------------
+
+
+HitRecord ray_bvh_skip_intersect_range(Ray ray, const BVHSkip* skip, float t_min, float t_max) {
+    Sphere* closest = NULL;
+    uint32_t end = (uint32_t)skip->node_count;
+    uint32_t index = 0;
+
+    while (index < end) {
+        const BVHSkipNode* node = &skip->nodes[index];
+        if (!ray_aabb_intersect_range(ray, node->bounds, t_min, t_max)) {
+            index = node->skip;
+            continue;
+        }
+
+        if (node->count == 0) {
+            index++;
+            continue;
+        }
+
+        Sphere* first = &skip->spheres[node->first];
+        for (uint32_t i = 0; i < node->count; i++) {
+            float t;
+            if (ray_sphere_hit_t(ray, &first[i], t_min, t_max, &t)) {
+                closest = &first[i];
+                t_max = t;
+            }
+        }
+        index = node->skip;
+    }
+    return closest ? ray_sphere_hit_record(ray, closest, t_max) : (HitRecord){0};
+}
+
+HitRecord ray_bvh_skip_intersect(Ray ray, const BVHSkip* skip) {
+    return ray_bvh_skip_intersect_range(ray, skip, EPSILON, INFINITY);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_tlas_intersect() - Returns the hitrecord for the given ray in a two-level BVH (bvh_instance.c)
+// The TLAS is walked with the ordered stack of the flat BVH, nearer child first by the split axes
+// tlas_build() assigns. At a leaf the ray is moved into each instance's object space and its BLAS is
+// traversed with ray_bvh_intersect_range() up to the closest hit so far. The direction keeps its
+// length, so t is the same in world and object space and culls the BLAS nodes as well. Point and
+// normal of the closest hit are moved back to world space, the sphere pointer refers to the shared
+// BLAS sphere.
+
+//--------------------------------------------------------------------------------------------------
+
+
+static HitRecord ray_instance_intersect(Ray ray, const Instance* instance, float t_max) {
+    Ray object_ray = {
+        transform_point(&instance->world_to_object, ray.origin),
+        transform_vector(&instance->world_to_object, ray.direction)
+    };
+    HitRecord rec = ray_bvh_intersect_range(object_ray, instance->blas, EPSILON, t_max);
+    if (rec.hit_something) {
+        rec.point = vec3_add(ray.origin, vec3_multiply(ray.direction, rec.t));
+        rec.normal = transform_normal(&instance->world_to_object, rec.normal);
+    }
+    return rec;
+}
+
+// Closest instance hit in the subtree with t < *t_max, nearer child first like ray_flat_subtree_closest()
+static void ray_tlas_subtree_closest(Ray ray, const TLAS* tlas, uint32_t root, float* t_max, HitRecord* rec) {
+    const float direction[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+    uint32_t stack[BVH_TRAVERSAL_STACK_SIZE];
+    int top = 0;
+    uint32_t index = root;
+
+    for (;;) {
+        const BVHFlatNode* node = &tlas->nodes[index];
+
+        if (ray_aabb_intersect_range(ray, node->bounds, EPSILON, *t_max)) {
+            if (node->count == 0) {
+                uint32_t near = index + 1, far = node->right_or_first;
+                if ((direction[node->axis] < 0.0f) != node->axis_flip) {
+                    near = node->right_or_first;
+                    far = index + 1;
+                }
+
+                if (top < BVH_TRAVERSAL_STACK_SIZE) {
+                    stack[top++] = far;
+                    index = near;
+                    continue;
+                }
+
+                ray_tlas_subtree_closest(ray, tlas, near, t_max, rec);
+                index = far;
+                continue;
+            }
+
+            const Instance* first = &tlas->instances[node->right_or_first];
+            for (uint32_t i = 0; i < node->count; i++) {
+                HitRecord hit = ray_instance_intersect(ray, &first[i], *t_max);
+                if (hit.hit_something) {
+                    *rec = hit;
+                    *t_max = hit.t;
+                }
+            }
+        }
+
+        if (top == 0) {
+            return;
+        }
+        index = stack[--top];
+    }
+}
+
+HitRecord ray_tlas_intersect(Ray ray, const TLAS* tlas) {
+    if (tlas->node_count == 0) {
+        return (HitRecord){0};
+    }
+    HitRecord rec = {0};
+    float t_max = INFINITY;
+    ray_tlas_subtree_closest(ray, tlas, 0, &t_max, &rec);
+    return rec;
+}
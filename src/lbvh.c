@@ -0,0 +1,378 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/lbvh.h"
+#include "Custom/constants.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Linear BVH (LBVH) construction with Morton codes
+// Time Complexity - O( n ) (radix sort + one pass per internal node)
+// - Sphere centers are quantized inside the bounds of all centers and interleaved into
+//   30 bit (10 bits per axis) or 63 bit (21 bits per axis) Morton codes.
+// - Codes are sorted with a parallel LSD radix sort (8 bits per pass).
+// - The hierarchy comes straight from the sorted codes (Karras 2012) : internal node i finds the
+//   range of codes it covers and its split (the first position where the highest differing bit
+//   flips) only from common prefix lengths, so all n - 1 internal nodes are independent.
+// - Bounds are computed bottom-up and the tree is written to the linear BVH depth first,
+//   collapsing small subtrees into leaves by the same SAH test as the top-down builder.
+// Much faster than build_bvh_node, but splits ignore the sphere sizes, so the SAH cost is higher.
+
+//----------------------------------------------------------------------------------------------------
+
+#define LBVH_LEAF_FLAG 0x80000000u
+
+typedef struct
+{
+    uint32_t child[2]; // internal node index, or sorted sphere index | LBVH_LEAF_FLAG
+    uint32_t first;    // first and last sorted sphere covered by the node
+    uint32_t last;
+    AABB bounds;
+} LBVHNode;
+
+static int build_threads(void)
+{
+#ifdef _OPENMP
+    int threads = bvh_get_build_config().thread_count;
+    return threads > 0 ? threads : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Spreads the lowest 10 / 21 bits of v so that there are two zero bits between each of them
+static uint64_t expand_bits_30(uint32_t v)
+{
+    uint64_t x = v & 0x3ff;
+    x = (x | (x << 16)) & 0x30000ff;
+    x = (x | (x << 8)) & 0x300f00f;
+    x = (x | (x << 4)) & 0x30c30c3;
+    x = (x | (x << 2)) & 0x9249249;
+    return x;
+}
+
+static uint64_t expand_bits_63(uint32_t v)
+{
+    uint64_t x = v & 0x1fffff;
+    x = (x | (x << 32)) & 0x1f00000000ffffull;
+    x = (x | (x << 16)) & 0x1f0000ff0000ffull;
+    x = (x | (x << 8)) & 0x100f00f00f00f00full;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+    x = (x | (x << 2)) & 0x1249249249249249ull;
+    return x;
+}
+
+uint64_t morton_encode(uint32_t x, uint32_t y, uint32_t z, int bits)
+{
+    if (bits == 30)
+        return (expand_bits_30(x) << 2) | (expand_bits_30(y) << 1) | expand_bits_30(z);
+    return (expand_bits_63(x) << 2) | (expand_bits_63(y) << 1) | expand_bits_63(z);
+}
+
+void compute_morton_codes(Sphere *spheres, int num_spheres, int bits, uint64_t *codes, uint32_t *indices)
+{
+    AABB centroid_bounds = create_empty_aabb();
+    for (int i = 0; i < num_spheres; i++)
+        centroid_bounds = combine_aabb(centroid_bounds, (AABB){spheres[i].center, spheres[i].center});
+
+    float cells = (float)((1u << (bits / 3)) - 1);
+    Vec3 extent = vec3_sub(centroid_bounds.max, centroid_bounds.min);
+    Vec3 scale = {
+        extent.x > 0.0f ? cells / extent.x : 0.0f,
+        extent.y > 0.0f ? cells / extent.y : 0.0f,
+        extent.z > 0.0f ? cells / extent.z : 0.0f};
+
+#pragma omp parallel for num_threads(build_threads())
+    for (int i = 0; i < num_spheres; i++)
+    {
+        Vec3 p = vec3_sub(spheres[i].center, centroid_bounds.min);
+        codes[i] = morton_encode((uint32_t)(p.x * scale.x), (uint32_t)(p.y * scale.y),
+                                 (uint32_t)(p.z * scale.z), bits);
+        indices[i] = (uint32_t)i;
+    }
+}
+
+// Histogram rows the radix sort needs for count keys, one per chunk of LBVH_SORT_CHUNK
+int radix_sort_chunk_count(int count)
+{
+    return (count + LBVH_SORT_CHUNK - 1) / LBVH_SORT_CHUNK;
+}
+
+// Stable LSD radix sort of (key, value) pairs, 8 bits per pass.
+// Every chunk of LBVH_SORT_CHUNK keys builds its own digit histogram in parallel, the exclusive
+// prefix over (digit, chunk) gives each chunk its scatter offsets, then chunks scatter in parallel.
+// key_buffer and value_buffer hold count entries, histograms radix_sort_chunk_count(count) rows.
+void radix_sort_morton_buffers(uint64_t *keys, uint32_t *values, int count, int key_bits,
+                               uint64_t *key_buffer, uint32_t *value_buffer, uint32_t (*histograms)[256])
+{
+    int passes = (key_bits + 7) / 8;
+    int num_chunks = radix_sort_chunk_count(count);
+
+    uint64_t *src_keys = keys, *dst_keys = key_buffer;
+    uint32_t *src_values = values, *dst_values = value_buffer;
+
+    for (int pass = 0; pass < passes; pass++)
+    {
+        int shift = pass * 8;
+
+#pragma omp parallel for num_threads(build_threads())
+        for (int c = 0; c < num_chunks; c++)
+        {
+            int start = c * LBVH_SORT_CHUNK;
+            int end = start + LBVH_SORT_CHUNK < count ? start + LBVH_SORT_CHUNK : count;
+            memset(histograms[c], 0, sizeof(histograms[c]));
+            for (int i = start; i < end; i++)
+                histograms[c][(src_keys[i] >> shift) & 0xff]++;
+        }
+
+        uint32_t sum = 0;
+        for (int digit = 0; digit < 256; digit++)
+        {
+            for (int c = 0; c < num_chunks; c++)
+            {
+                uint32_t digit_count = histograms[c][digit];
+                histograms[c][digit] = sum;
+                sum += digit_count;
+            }
+        }
+
+#pragma omp parallel for num_threads(build_threads())
+        for (int c = 0; c < num_chunks; c++)
+        {
+            int start = c * LBVH_SORT_CHUNK;
+            int end = start + LBVH_SORT_CHUNK < count ? start + LBVH_SORT_CHUNK : count;
+            for (int i = start; i < end; i++)
+            {
+                uint32_t position = histograms[c][(src_keys[i] >> shift) & 0xff]++;
+                dst_keys[position] = src_keys[i];
+                dst_values[position] = src_values[i];
+            }
+        }
+
+        uint64_t *swap_keys = src_keys;
+        src_keys = dst_keys;
+        dst_keys = swap_keys;
+        uint32_t *swap_values = src_values;
+        src_values = dst_values;
+        dst_values = swap_values;
+    }
+
+    if (src_keys != keys)
+    {
+        memcpy(keys, src_keys, count * sizeof(uint64_t));
+        memcpy(values, src_values, count * sizeof(uint32_t));
+    }
+}
+
+// Same with its own buffers, for one-off sorts
+void radix_sort_morton(uint64_t *keys, uint32_t *values, int count, int key_bits)
+{
+    uint32_t (*histograms)[256] = malloc(radix_sort_chunk_count(count) * sizeof(*histograms));
+    uint64_t *key_buffer = malloc(count * sizeof(uint64_t));
+    uint32_t *value_buffer = malloc(count * sizeof(uint32_t));
+
+    radix_sort_morton_buffers(keys, values, count, key_bits, key_buffer, value_buffer, histograms);
+
+    free(value_buffer);
+    free(key_buffer);
+    free(histograms);
+}
+
+// Length of the common prefix of codes i and j, duplicate codes are told apart by their index
+static inline int common_prefix(const uint64_t *codes, int count, int i, int j)
+{
+    if (j < 0 || j >= count)
+        return -1;
+    if (codes[i] == codes[j])
+        return 64 + __builtin_clz((uint32_t)i ^ (uint32_t)j);
+    return __builtin_clzll(codes[i] ^ codes[j]);
+}
+
+static void build_internal_node(LBVHNode *nodes, const uint64_t *codes, int count, int i)
+{
+    // Direction of the range : towards the neighbour sharing the longer prefix
+    int d = common_prefix(codes, count, i, i + 1) - common_prefix(codes, count, i, i - 1) > 0 ? 1 : -1;
+    int min_prefix = common_prefix(codes, count, i, i - d);
+
+    // Upper bound for the range length, then binary search for the other end
+    int max_length = 2;
+    while (common_prefix(codes, count, i, i + max_length * d) > min_prefix)
+        max_length *= 2;
+
+    int length = 0;
+    for (int step = max_length / 2; step >= 1; step /= 2)
+    {
+        if (common_prefix(codes, count, i, i + (length + step) * d) > min_prefix)
+            length += step;
+    }
+    int j = i + length * d;
+
+    // Binary search for the split, the last code sharing more than node_prefix bits with code i
+    int node_prefix = common_prefix(codes, count, i, j);
+    int split = 0;
+    int divisor = 2;
+    int step;
+    do
+    {
+        step = (length + divisor - 1) / divisor;
+        if (common_prefix(codes, count, i, i + (split + step) * d) > node_prefix)
+            split += step;
+        divisor *= 2;
+    } while (step > 1);
+    int gamma = i + split * d + (d < 0 ? -1 : 0);
+
+    int first = i < j ? i : j;
+    int last = i < j ? j : i;
+    nodes[i].child[0] = (first == gamma) ? ((uint32_t)gamma | LBVH_LEAF_FLAG) : (uint32_t)gamma;
+    nodes[i].child[1] = (last == gamma + 1) ? ((uint32_t)(gamma + 1) | LBVH_LEAF_FLAG) : (uint32_t)(gamma + 1);
+    nodes[i].first = (uint32_t)first;
+    nodes[i].last = (uint32_t)last;
+}
+
+static AABB child_bounds(const LBVHNode *nodes, Sphere *spheres, uint32_t child)
+{
+    if (child & LBVH_LEAF_FLAG)
+        return create_aabb_from_sphere(&spheres[child & ~LBVH_LEAF_FLAG]);
+    return nodes[child].bounds;
+}
+
+static int child_count(const LBVHNode *nodes, uint32_t child)
+{
+    if (child & LBVH_LEAF_FLAG)
+        return 1;
+    return (int)(nodes[child].last - nodes[child].first + 1);
+}
+
+static void compute_bounds(LBVHNode *nodes, Sphere *spheres, uint32_t index, int parallel_threshold)
+{
+    LBVHNode *node = &nodes[index];
+    int count = (int)(node->last - node->first + 1);
+
+    for (int c = 0; c < 2; c++)
+    {
+        if (node->child[c] & LBVH_LEAF_FLAG)
+            continue;
+        if (count >= parallel_threshold)
+        {
+#pragma omp task
+            compute_bounds(nodes, spheres, node->child[c], parallel_threshold);
+        }
+        else
+        {
+            compute_bounds(nodes, spheres, node->child[c], parallel_threshold);
+        }
+    }
+#pragma omp taskwait
+
+    node->bounds = combine_aabb(child_bounds(nodes, spheres, node->child[0]),
+                                child_bounds(nodes, spheres, node->child[1]));
+}
+
+// Same leaf test as the top-down builder, with the children standing in for the best split
+static int collapse_to_leaf(const LBVHNode *nodes, Sphere *spheres, uint32_t index, BVHBuildConfig config)
+{
+    const LBVHNode *node = &nodes[index];
+    int count = (int)(node->last - node->first + 1);
+    if (count > config.max_leaf_size)
+        return 0;
+
+    float area = get_aabb_surface_area(node->bounds);
+    float split_cost = config.traversal_cost +
+                       config.intersection_cost *
+                           (child_count(nodes, node->child[0]) * get_aabb_surface_area(child_bounds(nodes, spheres, node->child[0])) +
+                            child_count(nodes, node->child[1]) * get_aabb_surface_area(child_bounds(nodes, spheres, node->child[1]))) /
+                           area;
+    return config.intersection_cost * count <= split_cost;
+}
+
+static int count_emitted_nodes(const LBVHNode *nodes, Sphere *spheres, uint32_t child, BVHBuildConfig config)
+{
+    if ((child & LBVH_LEAF_FLAG) || collapse_to_leaf(nodes, spheres, child, config))
+        return 1;
+    return 1 + count_emitted_nodes(nodes, spheres, nodes[child].child[0], config) +
+           count_emitted_nodes(nodes, spheres, nodes[child].child[1], config);
+}
+
+static uint32_t emit_nodes(const LBVHNode *nodes, BVH *bvh, uint32_t child, BVHBuildConfig config, uint32_t *next)
+{
+    uint32_t index = (*next)++;
+    BVHFlatNode *flat = &bvh->nodes[index];
+
+    if (child & LBVH_LEAF_FLAG)
+    {
+        uint32_t sphere = child & ~LBVH_LEAF_FLAG;
+        flat->bounds = create_aabb_from_sphere(&bvh->spheres[sphere]);
+        flat->right_or_first = sphere;
+        flat->count = 1;
+        return index;
+    }
+
+    const LBVHNode *node = &nodes[child];
+    flat->bounds = node->bounds;
+    if (collapse_to_leaf(nodes, bvh->spheres, child, config))
+    {
+        flat->right_or_first = node->first;
+        flat->count = node->last - node->first + 1;
+        return index;
+    }
+
+    emit_nodes(nodes, bvh, node->child[0], config, next);
+    flat->right_or_first = emit_nodes(nodes, bvh, node->child[1], config, next);
+    flat->count = 0;
+    return index;
+}
+
+// Builds a linear BVH over the spheres from their sorted Morton codes.
+// Reorders the given sphere array into Morton order, the BVH keeps pointing to it.
+BVH *lbvh_build(Sphere *spheres, int num_spheres)
+{
+    BVHBuildConfig config = bvh_get_build_config();
+
+    if (num_spheres <= 1)
+    {
+        BVH *bvh = bvh_allocate(spheres, num_spheres, num_spheres);
+        if (bvh && num_spheres == 1)
+            bvh->nodes[0] = (BVHFlatNode){.bounds = create_aabb_from_sphere(&spheres[0]), .right_or_first = 0, .count = 1};
+        return bvh;
+    }
+
+    uint64_t *codes = malloc(num_spheres * sizeof(uint64_t));
+    uint32_t *order = malloc(num_spheres * sizeof(uint32_t));
+    compute_morton_codes(spheres, num_spheres, config.morton_bits, codes, order);
+    radix_sort_morton(codes, order, num_spheres, config.morton_bits);
+
+    // Spheres in Morton order, so that every subtree covers a contiguous range
+    Sphere *sorted = malloc(num_spheres * sizeof(Sphere));
+#pragma omp parallel for num_threads(build_threads())
+    for (int i = 0; i < num_spheres; i++)
+        sorted[i] = spheres[order[i]];
+    memcpy(spheres, sorted, num_spheres * sizeof(Sphere));
+    free(sorted);
+    free(order);
+
+    LBVHNode *nodes = malloc((num_spheres - 1) * sizeof(LBVHNode));
+#pragma omp parallel for num_threads(build_threads())
+    for (int i = 0; i < num_spheres - 1; i++)
+        build_internal_node(nodes, codes, num_spheres, i);
+    free(codes);
+
+#pragma omp parallel num_threads(build_threads())
+#pragma omp single
+    compute_bounds(nodes, spheres, 0, config.parallel_threshold);
+
+    BVH *bvh = bvh_allocate(spheres, num_spheres, count_emitted_nodes(nodes, spheres, 0, config));
+    if (bvh)
+    {
+        uint32_t next = 0;
+        emit_nodes(nodes, bvh, 0, config, &next);
+        bvh_assign_split_axes(bvh->nodes, bvh->node_count);
+    }
+
+    free(nodes);
+    return bvh;
+}
@@ -1,6 +1,7 @@
 #include <SDL2/SDL.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
 #include <SDL2/SDL_image.h>
@@ -14,20 +15,84 @@
 #include "Custom/vec3.h"
 #include "Custom/benchmark.h"
 #include "Custom/bvh_visualiser.h"
+#include "Custom/rsah.h"
+#include "Custom/framebuffer.h"
+#include "Custom/cpu_dispatch.h"
 
 #define NUM_SPHERES 20
 #define MAX_DEPTH 5
 
 
-typedef struct
+double get_time()
 {
-    float r, g, b;
-} FloatColor;
+    return (double)clock() / CLOCKS_PER_SEC;
+}
 
+_Static_assert(WIDTH % RAY_BLOCK_WIDTH == 0 && HEIGHT % RAY_BLOCK_HEIGHT == 0, "Frame must split into whole ray blocks");
 
-double get_time()
+// Primary rays of the RAY_BLOCK_WIDTH x RAY_BLOCK_HEIGHT pixel block at (block_x, block_y), row by row
+static int get_block_rays(Camera *camera, int block_x, int block_y, Ray *rays)
 {
-    return (double)clock() / CLOCKS_PER_SEC;
+    float aspect_ratio = (float)WIDTH / (float)HEIGHT;
+    float u[RAY_PACKET_MAX], v[RAY_PACKET_MAX];
+    int count = 0;
+    for (int y = block_y; y < block_y + RAY_BLOCK_HEIGHT; y++)
+    {
+        for (int x = block_x; x < block_x + RAY_BLOCK_WIDTH; x++)
+        {
+            u[count] = ((float)x / WIDTH - 0.5f) * aspect_ratio;
+            v[count++] = -((float)y / HEIGHT - 0.5f);
+        }
+    }
+    get_camera_rays(camera, u, v, count, rays);
+    return count;
+}
+
+_Static_assert(RAY_TILE_SIZE % RAY_BLOCK_WIDTH == 0 && RAY_TILE_SIZE % RAY_BLOCK_HEIGHT == 0, "Tiles must hold whole ray blocks");
+
+#define TILES_X ((WIDTH + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE)
+#define TILES_Y ((HEIGHT + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE)
+
+// Frustum cuts of all RAY_TILE_SIZE x RAY_TILE_SIZE tiles, row by row (tile_frustum.c). The corners
+// are one pixel outside the tile, so rounding never leaves a pixel's ray outside its tile's frustum.
+static void build_tile_cuts(Camera *camera, const BVH *bvh, TileCut *cuts)
+{
+    float aspect_ratio = (float)WIDTH / (float)HEIGHT;
+    int tile = 0;
+    for (int tile_y = 0; tile_y < HEIGHT; tile_y += RAY_TILE_SIZE)
+    {
+        for (int tile_x = 0; tile_x < WIDTH; tile_x += RAY_TILE_SIZE)
+        {
+            int end_x = tile_x + RAY_TILE_SIZE < WIDTH ? tile_x + RAY_TILE_SIZE : WIDTH;
+            int end_y = tile_y + RAY_TILE_SIZE < HEIGHT ? tile_y + RAY_TILE_SIZE : HEIGHT;
+            float u0 = ((float)(tile_x - 1) / WIDTH - 0.5f) * aspect_ratio;
+            float u1 = ((float)end_x / WIDTH - 0.5f) * aspect_ratio;
+            float v0 = (float)(tile_y - 1) / HEIGHT - 0.5f;
+            float v1 = (float)end_y / HEIGHT - 0.5f;
+            tile_cut_build(bvh, camera, u0, -v0, u1, -v1, &cuts[tile++]);
+        }
+    }
+}
+
+// Colors of the block at (block_x, block_y), row by row. In ray stream mode the whole frame was traced
+// already (frame_colors, block after block), otherwise the block is traced here as a packet, starting
+// at its tile's frustum cut when there is one.
+static int get_block_colors(Camera *camera, int block_x, int block_y, Sphere *spheres, const BVH *bvh,
+                            const SphereSoA *soa, const TileCut *tile_cuts, const SDL_Color *frame_colors,
+                            SDL_Color *colors)
+{
+    if (frame_colors)
+    {
+        int count = RAY_BLOCK_WIDTH * RAY_BLOCK_HEIGHT;
+        memcpy(colors, &frame_colors[block_y * WIDTH + block_x * RAY_BLOCK_HEIGHT], count * sizeof(SDL_Color));
+        return count;
+    }
+
+    Ray rays[RAY_PACKET_MAX];
+    int count = get_block_rays(camera, block_x, block_y, rays);
+    const TileCut *cut = tile_cuts ? &tile_cuts[(block_y / RAY_TILE_SIZE) * TILES_X + block_x / RAY_TILE_SIZE] : NULL;
+    trace_ray_packet(rays, count, spheres, NUM_SPHERES, MAX_DEPTH, bvh, soa, cut, colors);
+    return count;
 }
 
 // Plotting the graph img with sdl renderer, whose data was generated in case 1 (benchmark testing)
@@ -89,6 +154,17 @@ int SDL_main(int argc, char *argv[])
 
     srand(time(NULL));
 
+    // --simd=scalar|sse2|avx2|avx512 forces the SIMD kernels onto one path, e.g. for benchmarking
+    for (int i = 1; i < argc; i++)
+    {
+        CpuPath path;
+        if (strncmp(argv[i], "--simd=", 7) == 0 && cpu_path_parse(argv[i] + 7, &path))
+            cpu_set_path(path);
+        else
+            printf("Unknown option %s (use --simd=scalar, sse2, avx2 or avx512)\n", argv[i]);
+    }
+    printf("SIMD path: %s (widest on this CPU: %s)\n", cpu_path_name(cpu_get_path()), cpu_path_name(cpu_detect_path()));
+
     printf("\nPlease proceed as follows :\n\n");
     printf("Press '1' for benchmark testing with graph plot.\n");
     printf("Press '2' for Realtime CPU Raytracing.\n");
@@ -170,6 +246,7 @@ int SDL_main(int argc, char *argv[])
         // Camera has been added for moving in the defined scene
         // Debug mode is added to see Bounding Volumes by pressing 'o'
         // but its projection is still not properly aligned which needs to be corrected
+        // Pressing 'r' traces whole frames bounce by bounce as sorted ray streams (trace_frame_stream)
 
         //----------------------------------------------------------------------------------------------------
 
@@ -222,11 +299,17 @@ int SDL_main(int argc, char *argv[])
 
         printf("Building BVH...\n");
         double bvh_start = get_time();
-        BVHNode *root = build_bvh_node(spheres, 0, NUM_SPHERES, 0);
+        BVH *bvh = bvh_build(spheres, NUM_SPHERES);
         double bvh_end = get_time();
         double bvh_build_time = bvh_end - bvh_start;
         printf("BVH built in %f seconds\n", bvh_build_time);
 
+        // SoA copies of the spheres : the BVH's leaves (in bvh->spheres order, SBVH may reference a sphere
+        // more than once) and the brute force path (B key), built after the BVH because builders reorder
+        // the spheres. Both are rebuilt with the BVH.
+        SphereSoA *bvh_soa = bvh ? sphere_soa_build(bvh->spheres, bvh->sphere_count) : NULL;
+        SphereSoA *sphere_soa = sphere_soa_build(spheres, NUM_SPHERES);
+
         int quit = 0;
         SDL_Event e;
 
@@ -235,42 +318,40 @@ int SDL_main(int argc, char *argv[])
         double total_render_time = 0;
 
         int use_bvh = 1;
+        int use_ray_stream = 0;
         int show_bvh_visualization = 0;
 
+        // Ray sample of the RSAH builder, from the ray file (C key) if there is one, otherwise the current camera
+        Ray *rsah_rays = NULL;
+
+        // Primary rays and colors of the whole frame in ray stream mode, block after block, and the
+        // work arrays of its bounce streams, frustum cuts of the tiles otherwise
+        Ray *frame_rays = malloc(WIDTH * HEIGHT * sizeof(Ray));
+        SDL_Color *frame_colors = malloc(WIDTH * HEIGHT * sizeof(SDL_Color));
+        FrameStream *frame_stream = frame_stream_create(WIDTH * HEIGHT, MAX_DEPTH);
+        TileCut *tile_cuts = malloc(TILES_X * TILES_Y * sizeof(TileCut));
+
+        // Sums of the frames since the camera last moved, 4 floats per pixel in frame_colors' block order
         int accumulated_frames = 1;
-        FloatColor **accumulated_colors = (FloatColor **)malloc(WIDTH * sizeof(FloatColor *));
-        if (!accumulated_colors)
+        float *accumulation = calloc(4 * WIDTH * HEIGHT, sizeof(float));
+
+        if (!bvh || !bvh_soa || !sphere_soa || !frame_rays || !frame_colors || !frame_stream || !tile_cuts ||
+            !accumulation)
         {
-            printf("Failed to allocate memory for accumulated_colors\n");
+            printf("Failed to allocate memory for the BVH, the frame buffers and tile cuts\n");
+            free(accumulation);
+            free(frame_rays);
+            free(frame_colors);
+            frame_stream_free(frame_stream);
+            free(tile_cuts);
+            bvh_free(bvh);
+            sphere_soa_free(bvh_soa);
+            sphere_soa_free(sphere_soa);
             SDL_DestroyRenderer(renderer);
             SDL_DestroyWindow(window);
             SDL_Quit();
             return 1;
         }
-        for (int i = 0; i < WIDTH; i++)
-        {
-            accumulated_colors[i] = (FloatColor *)malloc(HEIGHT * sizeof(FloatColor));
-            if (!accumulated_colors[i])
-            {
-                printf("Failed to allocate memory for accumulated_colors[%d]\n", i);
-
-                for (int j = 0; j < i; j++)
-                {
-                    free(accumulated_colors[j]);
-                }
-                free(accumulated_colors);
-                SDL_DestroyRenderer(renderer);
-                SDL_DestroyWindow(window);
-                SDL_Quit();
-                return 1;
-            }
-            for (int j = 0; j < HEIGHT; j++)
-            {
-                accumulated_colors[i][j].r = 0.0f;
-                accumulated_colors[i][j].g = 0.0f;
-                accumulated_colors[i][j].b = 0.0f;
-            }
-        }
         while (!quit)
         {
 
@@ -318,10 +399,52 @@ int SDL_main(int argc, char *argv[])
                         use_bvh = !use_bvh;
                         printf("BVH %s\n", use_bvh ? "enabled" : "disabled");
                         break;
+                    case SDLK_r:
+                        use_ray_stream = !use_ray_stream;
+                        printf("Ray streams %s\n", use_ray_stream ? "enabled" : "disabled");
+                        break;
                     case SDLK_o:
                         show_bvh_visualization = !show_bvh_visualization;
                         printf("BVH visualization %s\n", show_bvh_visualization ? "enabled" : "disabled");
                         break;
+                    case SDLK_n:
+                    {
+                        BVHBuildConfig config = bvh_get_build_config();
+                        config.builder = (BVHBuilder)((config.builder + 1) % BVH_BUILDER_COUNT);
+                        if (config.builder == BVH_BUILDER_RSAH)
+                        {
+                            free(rsah_rays);
+                            rsah_rays = rsah_load_rays(RSAH_RAY_FILE, &config.sample_ray_count);
+                            if (!rsah_rays)
+                            {
+                                rsah_rays = rsah_sample_camera_rays(&camera, RSAH_SAMPLE_COLUMNS, RSAH_SAMPLE_ROWS);
+                                config.sample_ray_count = RSAH_SAMPLE_COLUMNS * RSAH_SAMPLE_ROWS;
+                            }
+                            config.sample_rays = rsah_rays;
+                        }
+                        bvh_set_build_config(config);
+
+                        bvh_free(bvh);
+                        bvh_start = get_time();
+                        bvh = bvh_build(spheres, NUM_SPHERES);
+                        bvh_build_time = get_time() - bvh_start;
+                        sphere_soa_free(bvh_soa);
+                        bvh_soa = sphere_soa_build(bvh->spheres, bvh->sphere_count);
+                        sphere_soa_free(sphere_soa);
+                        sphere_soa = sphere_soa_build(spheres, NUM_SPHERES);
+                        printf("BVH rebuilt with %s builder in %f seconds\n",
+                               bvh_builder_name(config.builder), bvh_build_time);
+                        camera.move = 1;
+                        break;
+                    }
+                    case SDLK_c:
+                    {
+                        Ray *rays = rsah_sample_camera_rays(&camera, RSAH_SAMPLE_COLUMNS, RSAH_SAMPLE_ROWS);
+                        if (rsah_save_rays(RSAH_RAY_FILE, rays, RSAH_SAMPLE_COLUMNS * RSAH_SAMPLE_ROWS))
+                            printf("Camera rays captured to %s\n", RSAH_RAY_FILE);
+                        free(rays);
+                        break;
+                    }
                     }
                 }
                 else if (e.type == SDL_MOUSEMOTION)
@@ -341,67 +464,55 @@ int SDL_main(int argc, char *argv[])
                 SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
                 SDL_RenderClear(renderer);
 
-                render_debug_visualization(renderer, root, &camera);
+                render_debug_visualization(renderer, bvh, &camera);
                 SDL_RenderPresent(renderer);
             }
             else
             {
+                if (use_ray_stream)
+                {
+                    int count = 0;
+                    for (int block_y = 0; block_y < HEIGHT; block_y += RAY_BLOCK_HEIGHT)
+                    {
+                        for (int block_x = 0; block_x < WIDTH; block_x += RAY_BLOCK_WIDTH)
+                            count += get_block_rays(&camera, block_x, block_y, &frame_rays[count]);
+                    }
+                    trace_frame_stream(frame_rays, count, spheres, NUM_SPHERES, MAX_DEPTH, use_bvh ? bvh : NULL,
+                                       use_bvh ? bvh_soa : sphere_soa, frame_stream, frame_colors);
+                }
+                else if (use_bvh)
+                {
+                    build_tile_cuts(&camera, bvh, tile_cuts);
+                }
 
                 if (camera.move)
                 {
 
                     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
                     SDL_RenderClear(renderer);
-
-                    float aspect_ratio = (float)WIDTH / (float)HEIGHT;
-
-                    for (int y = 0; y < HEIGHT; y++)
-                    {
-                        for (int x = 0; x < WIDTH; x++)
-                        {
-                            float u = ((float)x / WIDTH - 0.5f) * aspect_ratio;
-                            float v = (float)y / HEIGHT - 0.5f;
-
-                            Ray ray = get_camera_ray(&camera, u, -v);
-                            SDL_Color color = trace_ray(ray, spheres, NUM_SPHERES, MAX_DEPTH, use_bvh ? root : NULL);
-
-                            accumulated_colors[x][y].r = (float)color.r / 255.0f;
-                            accumulated_colors[x][y].g = (float)color.g / 255.0f;
-                            accumulated_colors[x][y].b = (float)color.b / 255.0f;
-                            SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
-                            SDL_RenderDrawPoint(renderer, x, y);
-                        }
-                    }
-
                     accumulated_frames = 1;
                     camera.move = 0;
                 }
                 else
                 {
                     accumulated_frames++;
-                    float aspect_ratio = (float)WIDTH / (float)HEIGHT;
+                }
 
-                    for (int y = 0; y < HEIGHT; y++)
+                for (int block_y = 0; block_y < HEIGHT; block_y += RAY_BLOCK_HEIGHT)
+                {
+                    for (int block_x = 0; block_x < WIDTH; block_x += RAY_BLOCK_WIDTH)
                     {
-                        for (int x = 0; x < WIDTH; x++)
+                        SDL_Color colors[RAY_PACKET_MAX], shown[RAY_PACKET_MAX];
+                        int count = get_block_colors(&camera, block_x, block_y, spheres, use_bvh ? bvh : NULL,
+                                                     use_bvh ? bvh_soa : sphere_soa, use_bvh ? tile_cuts : NULL,
+                                                     use_ray_stream ? frame_colors : NULL, colors);
+                        framebuffer_accumulate(&accumulation[4 * (block_y * WIDTH + block_x * RAY_BLOCK_HEIGHT)], colors,
+                                               count, accumulated_frames, shown);
+
+                        for (int i = 0; i < count; i++)
                         {
-                            float u = ((float)x / WIDTH - 0.5f) * aspect_ratio;
-                            float v = (float)y / HEIGHT - 0.5f;
-
-                            Ray ray = get_camera_ray(&camera, u, -v);
-                            SDL_Color color = trace_ray(ray, spheres, NUM_SPHERES, MAX_DEPTH, use_bvh ? root : NULL);
-
-                            accumulated_colors[x][y].r += (float)color.r / 255.0f;
-                            accumulated_colors[x][y].g += (float)color.g / 255.0f;
-                            accumulated_colors[x][y].b += (float)color.b / 255.0f;
-
-                            SDL_Color avg_color = {
-                                (Uint8)(fmin(accumulated_colors[x][y].r / accumulated_frames * 255.0f, 255.0f)),
-                                (Uint8)(fmin(accumulated_colors[x][y].g / accumulated_frames * 255.0f, 255.0f)),
-                                (Uint8)(fmin(accumulated_colors[x][y].b / accumulated_frames * 255.0f, 255.0f)),
-                                255};
-
-                            SDL_SetRenderDrawColor(renderer, avg_color.r, avg_color.g, avg_color.b, avg_color.a);
+                            int x = block_x + i % RAY_BLOCK_WIDTH, y = block_y + i / RAY_BLOCK_WIDTH;
+                            SDL_SetRenderDrawColor(renderer, shown[i].r, shown[i].g, shown[i].b, shown[i].a);
                             SDL_RenderDrawPoint(renderer, x, y);
                         }
                     }
@@ -428,11 +539,15 @@ int SDL_main(int argc, char *argv[])
         printf("Average FPS: %.2f\n", frame_count / total_render_time);
         printf("BVH build time: %f seconds\n", bvh_build_time);
 
-        for (int i = 0; i < WIDTH; i++)
-        {
-            free(accumulated_colors[i]);
-        }
-        free(accumulated_colors);
+        free(accumulation);
+        free(frame_rays);
+        free(frame_colors);
+        frame_stream_free(frame_stream);
+        free(tile_cuts);
+        bvh_free(bvh);
+        sphere_soa_free(bvh_soa);
+        sphere_soa_free(sphere_soa);
+        free(rsah_rays);
 
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
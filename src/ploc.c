@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/ploc.h"
+#include "Custom/lbvh.h"
+#include "Custom/constants.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Parallel Locally-Ordered Clustering (PLOC) BVH construction (Meister and Bittner 2018)
+// Bottom-up (agglomerative) build :
+// - Spheres are sorted by Morton code (same codes and radix sort as the LBVH builder), every
+//   sphere starts as its own cluster, the cluster array keeps the Morton order.
+// - Each iteration, every cluster looks for its nearest neighbour among the search_radius clusters
+//   on either side (distance = surface area of the merged bounds).
+// - Clusters that are each other's nearest neighbour merge into a new node, the merged node takes
+//   the place of the left one and the array is compacted.
+// - Repeat until a single cluster (the root) is left.
+// Neighbour search, merging and compaction run over fixed size chunks in parallel. Ties are broken
+// by position, so the tree does not depend on the number of threads.
+// Gets close to full-sweep SAH quality, as merges are picked by the actual merged surface area.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    AABB bounds;
+    uint32_t child[2]; // nodes below num_spheres are leaves (the sorted sphere with that index)
+    uint32_t count;    // spheres in the subtree
+} PLOCNode;
+
+typedef struct
+{
+    int merges;
+    int survivors;
+} PLOCChunk;
+
+static int build_threads(void)
+{
+#ifdef _OPENMP
+    int threads = bvh_get_build_config().thread_count;
+    return threads > 0 ? threads : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+static void find_nearest_neighbours(const PLOCNode *nodes, const uint32_t *clusters, int num_clusters,
+                                    int radius, int *neighbours)
+{
+#pragma omp parallel for schedule(static, 1024) num_threads(build_threads())
+    for (int i = 0; i < num_clusters; i++)
+    {
+        AABB box = nodes[clusters[i]].bounds;
+        float best_area = INFINITY;
+        int best = -1;
+        int first = i - radius > 0 ? i - radius : 0;
+        int last = i + radius < num_clusters - 1 ? i + radius : num_clusters - 1;
+
+        // Scanning in position order with a strict compare keeps the lowest position on ties
+        for (int j = first; j <= last; j++)
+        {
+            if (j == i)
+                continue;
+            float area = get_aabb_surface_area(combine_aabb(box, nodes[clusters[j]].bounds));
+            if (area < best_area)
+            {
+                best_area = area;
+                best = j;
+            }
+        }
+        neighbours[i] = best;
+    }
+}
+
+// Merges mutual nearest neighbours and compacts the cluster array into next_clusters.
+// Returns the new number of clusters.
+static int merge_clusters(PLOCNode *nodes, int *node_count, const uint32_t *clusters, int num_clusters,
+                          const int *neighbours, uint32_t *next_clusters)
+{
+    int num_chunks = (num_clusters + PLOC_CHUNK - 1) / PLOC_CHUNK;
+    PLOCChunk *chunks = malloc(num_chunks * sizeof(PLOCChunk));
+
+#pragma omp parallel for num_threads(build_threads())
+    for (int c = 0; c < num_chunks; c++)
+    {
+        int start = c * PLOC_CHUNK;
+        int end = start + PLOC_CHUNK < num_clusters ? start + PLOC_CHUNK : num_clusters;
+        chunks[c].merges = chunks[c].survivors = 0;
+        for (int i = start; i < end; i++)
+        {
+            int mutual = neighbours[neighbours[i]] == i;
+            if (mutual && i < neighbours[i])
+                chunks[c].merges++;
+            if (!mutual || i < neighbours[i])
+                chunks[c].survivors++;
+        }
+    }
+
+    // Exclusive prefix sums, new nodes and surviving clusters keep their relative order
+    int merge_offset = *node_count, survivor_offset = 0;
+    for (int c = 0; c < num_chunks; c++)
+    {
+        int merges = chunks[c].merges, survivors = chunks[c].survivors;
+        chunks[c].merges = merge_offset;
+        chunks[c].survivors = survivor_offset;
+        merge_offset += merges;
+        survivor_offset += survivors;
+    }
+
+#pragma omp parallel for num_threads(build_threads())
+    for (int c = 0; c < num_chunks; c++)
+    {
+        int start = c * PLOC_CHUNK;
+        int end = start + PLOC_CHUNK < num_clusters ? start + PLOC_CHUNK : num_clusters;
+        int node = chunks[c].merges;
+        int survivor = chunks[c].survivors;
+        for (int i = start; i < end; i++)
+        {
+            int neighbour = neighbours[i];
+            int mutual = neighbours[neighbour] == i;
+            if (mutual && i > neighbour)
+                continue;
+
+            if (mutual)
+            {
+                PLOCNode *left = &nodes[clusters[i]];
+                PLOCNode *right = &nodes[clusters[neighbour]];
+                nodes[node] = (PLOCNode){
+                    combine_aabb(left->bounds, right->bounds),
+                    {clusters[i], clusters[neighbour]},
+                    left->count + right->count};
+                next_clusters[survivor++] = (uint32_t)node++;
+            }
+            else
+            {
+                next_clusters[survivor++] = clusters[i];
+            }
+        }
+    }
+
+    free(chunks);
+    *node_count = merge_offset;
+    return survivor_offset;
+}
+
+// Same leaf test as the top-down builder, with the children standing in for the best split
+static int collapse_to_leaf(const PLOCNode *nodes, int num_spheres, uint32_t index, BVHBuildConfig config)
+{
+    const PLOCNode *node = &nodes[index];
+    if (index < (uint32_t)num_spheres)
+        return 1;
+    if (node->count > (uint32_t)config.max_leaf_size)
+        return 0;
+
+    const PLOCNode *left = &nodes[node->child[0]];
+    const PLOCNode *right = &nodes[node->child[1]];
+    float split_cost = config.traversal_cost +
+                       config.intersection_cost *
+                           (left->count * get_aabb_surface_area(left->bounds) +
+                            right->count * get_aabb_surface_area(right->bounds)) /
+                           get_aabb_surface_area(node->bounds);
+    return config.intersection_cost * node->count <= split_cost;
+}
+
+static int count_emitted_nodes(const PLOCNode *nodes, int num_spheres, uint32_t index, BVHBuildConfig config)
+{
+    if (collapse_to_leaf(nodes, num_spheres, index, config))
+        return 1;
+    return 1 + count_emitted_nodes(nodes, num_spheres, nodes[index].child[0], config) +
+           count_emitted_nodes(nodes, num_spheres, nodes[index].child[1], config);
+}
+
+// Appends the spheres below a node to the output in depth first order
+static void gather_spheres(const PLOCNode *nodes, int num_spheres, uint32_t index,
+                           const Sphere *sorted, Sphere *output, uint32_t *written)
+{
+    if (index < (uint32_t)num_spheres)
+    {
+        output[(*written)++] = sorted[index];
+        return;
+    }
+    gather_spheres(nodes, num_spheres, nodes[index].child[0], sorted, output, written);
+    gather_spheres(nodes, num_spheres, nodes[index].child[1], sorted, output, written);
+}
+
+static uint32_t emit_nodes(const PLOCNode *nodes, int num_spheres, uint32_t index, BVH *bvh,
+                           const Sphere *sorted, BVHBuildConfig config, uint32_t *next, uint32_t *written)
+{
+    uint32_t flat_index = (*next)++;
+    BVHFlatNode *flat = &bvh->nodes[flat_index];
+    flat->bounds = nodes[index].bounds;
+
+    if (collapse_to_leaf(nodes, num_spheres, index, config))
+    {
+        flat->right_or_first = *written;
+        flat->count = nodes[index].count;
+        gather_spheres(nodes, num_spheres, index, sorted, bvh->spheres, written);
+        return flat_index;
+    }
+
+    emit_nodes(nodes, num_spheres, nodes[index].child[0], bvh, sorted, config, next, written);
+    flat->right_or_first = emit_nodes(nodes, num_spheres, nodes[index].child[1], bvh, sorted, config, next, written);
+    flat->count = 0;
+    return flat_index;
+}
+
+// Builds a linear BVH over the spheres by agglomerative clustering.
+// Reorders the given sphere array, the BVH keeps pointing to it.
+BVH *ploc_build(Sphere *spheres, int num_spheres)
+{
+    BVHBuildConfig config = bvh_get_build_config();
+
+    if (num_spheres <= 1)
+    {
+        BVH *bvh = bvh_allocate(spheres, num_spheres, num_spheres);
+        if (bvh && num_spheres == 1)
+            bvh->nodes[0] = (BVHFlatNode){.bounds = create_aabb_from_sphere(&spheres[0]), .right_or_first = 0, .count = 1};
+        return bvh;
+    }
+
+    uint64_t *codes = malloc(num_spheres * sizeof(uint64_t));
+    uint32_t *order = malloc(num_spheres * sizeof(uint32_t));
+    compute_morton_codes(spheres, num_spheres, config.morton_bits, codes, order);
+    radix_sort_morton(codes, order, num_spheres, config.morton_bits);
+    free(codes);
+
+    // Leaves are the first num_spheres nodes, in Morton order
+    Sphere *sorted = malloc(num_spheres * sizeof(Sphere));
+    PLOCNode *nodes = malloc((2 * num_spheres - 1) * sizeof(PLOCNode));
+    uint32_t *clusters = malloc(num_spheres * sizeof(uint32_t));
+    uint32_t *next_clusters = malloc(num_spheres * sizeof(uint32_t));
+    int *neighbours = malloc(num_spheres * sizeof(int));
+
+#pragma omp parallel for num_threads(build_threads())
+    for (int i = 0; i < num_spheres; i++)
+    {
+        sorted[i] = spheres[order[i]];
+        nodes[i] = (PLOCNode){create_aabb_from_sphere(&sorted[i]), {0, 0}, 1};
+        clusters[i] = (uint32_t)i;
+    }
+    free(order);
+
+    int node_count = num_spheres;
+    int num_clusters = num_spheres;
+    while (num_clusters > 1)
+    {
+        find_nearest_neighbours(nodes, clusters, num_clusters, config.ploc_radius, neighbours);
+        num_clusters = merge_clusters(nodes, &node_count, clusters, num_clusters, neighbours, next_clusters);
+
+        uint32_t *swap = clusters;
+        clusters = next_clusters;
+        next_clusters = swap;
+    }
+    uint32_t root = clusters[0];
+
+    BVH *bvh = bvh_allocate(spheres, num_spheres, count_emitted_nodes(nodes, num_spheres, root, config));
+    if (bvh)
+    {
+        uint32_t next = 0, written = 0;
+        emit_nodes(nodes, num_spheres, root, bvh, sorted, config, &next, &written);
+        bvh_assign_split_axes(bvh->nodes, bvh->node_count);
+    }
+
+    free(neighbours);
+    free(next_clusters);
+    free(clusters);
+    free(nodes);
+    free(sorted);
+    return bvh;
+}
@@ -14,14 +14,20 @@
 
 
 
-Ray get_camera_ray(Camera *camera, float u, float v) {
+// Screen axes of the image plane at distance 1, full width and height
+static void camera_plane(Camera *camera, Vec3 *horizontal, Vec3 *vertical) {
     float aspect_ratio = (float)WIDTH / (float)HEIGHT;
     float fov_rad = camera->fov * (M_PI / 180.0f);
     float half_height = tan(fov_rad / 2.0f);
     float half_width = aspect_ratio * half_height;
 
-    Vec3 horizontal = vec3_multiply(camera->right, 2.0f * half_width);
-    Vec3 vertical = vec3_multiply(camera->up, 2.0f * half_height);
+    *horizontal = vec3_multiply(camera->right, 2.0f * half_width);
+    *vertical = vec3_multiply(camera->up, 2.0f * half_height);
+}
+
+Ray get_camera_ray(Camera *camera, float u, float v) {
+    Vec3 horizontal, vertical;
+    camera_plane(camera, &horizontal, &vertical);
     
     Vec3 direction = camera->forward;
     direction = vec3_add(direction, vec3_multiply(horizontal, u));
@@ -31,6 +37,27 @@ Ray get_camera_ray(Camera *camera, float u, float v) {
     return (Ray){camera->position, direction};
 }
 
+// get_camera_ray() for count (u, v) pairs, the image plane set up once and the directions normalized
+// together (vec3_normalize_array()), a packet (RAY_PACKET_MAX rays) at a time. The rays are the same
+// as get_camera_ray()'s.
+void get_camera_rays(Camera *camera, const float *u, const float *v, int count, Ray *rays) {
+    Vec3 horizontal, vertical;
+    camera_plane(camera, &horizontal, &vertical);
+
+    Vec3 directions[RAY_PACKET_MAX];
+    for (int first = 0; first < count; first += RAY_PACKET_MAX) {
+        int n = count - first < RAY_PACKET_MAX ? count - first : RAY_PACKET_MAX;
+        for (int i = 0; i < n; i++) {
+            Vec3 direction = camera->forward;
+            direction = vec3_add(direction, vec3_multiply(horizontal, u[first + i]));
+            directions[i] = vec3_add(direction, vec3_multiply(vertical, v[first + i]));
+        }
+        vec3_normalize_array(directions, n);
+        for (int i = 0; i < n; i++)
+            rays[first + i] = (Ray){camera->position, directions[i]};
+    }
+}
+
 
 // Ray get_camera_ray(Camera *camera, float u, float v) {
 //     float aspect_ratio = (float)WIDTH / (float)HEIGHT;
@@ -0,0 +1,290 @@
+#include <math.h>
+#include "Custom/ray_packet.h"
+#include "Custom/constants.h"
+#include "Custom/cpu_dispatch.h"
+
+#if defined(CPU_DISPATCH_X86)
+#include <immintrin.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Ray packets
+// Up to RAY_PACKET_MAX coherent rays (a small screen block of primary rays, or the bounces of one)
+// walk the linear BVH together. Every node is fetched once for the whole packet and its box is
+// tested against all rays at once, lanes in SoA form, on the active path (cpu_dispatch.c):
+// - AVX-512 tests all 16 rays in one go
+// - AVX2 tests groups of 8 rays
+// - SSE2 tests groups of 4 rays
+// - scalar uses the same slab test in a plain loop
+// The packet carries an active mask: the rays that hit the parent's box before their own closest hit.
+// A subtree is skipped once the mask is empty, so all rays missing it or all rays having a closer
+// hit ends the descent. Children are visited nearer first by the split axis and the direction of the
+// first active ray, which is the direction of the whole packet for primary rays.
+// Sphere tests are per ray, with ray_sphere_hit_t() or, given a SoA copy of the BVH's spheres, the SIMD
+// kernel of sphere_soa.c for leaves of SPHERE_SOA_MIN_LEAF spheres or more. The closest hits are the
+// ones of ray_bvh_intersect(). Each lane keeps t and the sphere, the HitRecords are written at the end.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct RayPacket
+{
+    float origin[3][RAY_PACKET_MAX];
+    float inv_direction[3][RAY_PACKET_MAX];
+    float t_max[RAY_PACKET_MAX];
+    Sphere *closest[RAY_PACKET_MAX];
+    const Ray *rays;
+    const SphereSoA *soa; // built from bvh->spheres, NULL - scalar sphere tests
+    int lanes; // count rounded up to the SIMD group
+    // Lanes of the rays entering the box before their closest hit, the active path's box test
+    uint32_t (*box_test)(const struct RayPacket *p, const AABB *box);
+} RayPacket;
+
+typedef struct
+{
+    uint32_t node;
+    uint32_t mask;
+} PacketStackEntry;
+
+static uint32_t box_test_scalar(const RayPacket *p, const AABB *box)
+{
+    uint32_t mask = 0;
+    for (int g = 0; g < p->lanes; g++)
+    {
+        const float origin[3] = {p->origin[0][g], p->origin[1][g], p->origin[2][g]};
+        const float inv_direction[3] = {p->inv_direction[0][g], p->inv_direction[1][g], p->inv_direction[2][g]};
+        if (ray_aabb_slabs_inv(origin, inv_direction, box, p->t_max[g]))
+            mask |= 1u << g;
+    }
+    return mask;
+}
+
+#if defined(CPU_DISPATCH_X86)
+
+static uint32_t box_test_sse2(const RayPacket *p, const AABB *box)
+{
+    const float min[3] = {box->min.x, box->min.y, box->min.z};
+    const float max[3] = {box->max.x, box->max.y, box->max.z};
+    uint32_t mask = 0;
+    for (int g = 0; g < p->lanes; g += 4)
+    {
+        __m128 enter = _mm_set1_ps(-INFINITY), exit = _mm_set1_ps(INFINITY);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            __m128 origin = _mm_loadu_ps(&p->origin[axis][g]);
+            __m128 inv = _mm_loadu_ps(&p->inv_direction[axis][g]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min[axis]), origin), inv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max[axis]), origin), inv);
+            enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+            exit = _mm_min_ps(exit, _mm_max_ps(t0, t1));
+        }
+        __m128 hit = _mm_and_ps(_mm_cmpge_ps(exit, enter),
+                                _mm_and_ps(_mm_cmpgt_ps(exit, _mm_set1_ps(EPSILON)),
+                                           _mm_cmple_ps(enter, _mm_loadu_ps(&p->t_max[g]))));
+        mask |= (uint32_t)_mm_movemask_ps(hit) << g;
+    }
+    return mask;
+}
+
+// Groups of 8 rays, the last 4 of a packet of 4, 12 rays with SSE
+CPU_TARGET_AVX2
+static uint32_t box_test_avx2(const RayPacket *p, const AABB *box)
+{
+    const float min[3] = {box->min.x, box->min.y, box->min.z};
+    const float max[3] = {box->max.x, box->max.y, box->max.z};
+    uint32_t mask = 0;
+    int g = 0;
+    for (; g + 8 <= p->lanes; g += 8)
+    {
+        __m256 enter = _mm256_set1_ps(-INFINITY), exit = _mm256_set1_ps(INFINITY);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            __m256 origin = _mm256_loadu_ps(&p->origin[axis][g]);
+            __m256 inv = _mm256_loadu_ps(&p->inv_direction[axis][g]);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(min[axis]), origin), inv);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(max[axis]), origin), inv);
+            enter = _mm256_max_ps(enter, _mm256_min_ps(t0, t1));
+            exit = _mm256_min_ps(exit, _mm256_max_ps(t0, t1));
+        }
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(exit, enter, _CMP_GE_OQ),
+                                   _mm256_and_ps(_mm256_cmp_ps(exit, _mm256_set1_ps(EPSILON), _CMP_GT_OQ),
+                                                 _mm256_cmp_ps(enter, _mm256_loadu_ps(&p->t_max[g]), _CMP_LE_OQ)));
+        mask |= (uint32_t)_mm256_movemask_ps(hit) << g;
+    }
+    if (g < p->lanes)
+    {
+        __m128 enter = _mm_set1_ps(-INFINITY), exit = _mm_set1_ps(INFINITY);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            __m128 origin = _mm_loadu_ps(&p->origin[axis][g]);
+            __m128 inv = _mm_loadu_ps(&p->inv_direction[axis][g]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min[axis]), origin), inv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max[axis]), origin), inv);
+            enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+            exit = _mm_min_ps(exit, _mm_max_ps(t0, t1));
+        }
+        __m128 hit = _mm_and_ps(_mm_cmpge_ps(exit, enter),
+                                _mm_and_ps(_mm_cmpgt_ps(exit, _mm_set1_ps(EPSILON)),
+                                           _mm_cmple_ps(enter, _mm_loadu_ps(&p->t_max[g]))));
+        mask |= (uint32_t)_mm_movemask_ps(hit) << g;
+    }
+    return mask;
+}
+
+// All RAY_PACKET_MAX (16) rays at once, lanes past the packet are not loaded
+CPU_TARGET_AVX512
+static uint32_t box_test_avx512(const RayPacket *p, const AABB *box)
+{
+    const float min[3] = {box->min.x, box->min.y, box->min.z};
+    const float max[3] = {box->max.x, box->max.y, box->max.z};
+    __mmask16 lanes = (__mmask16)((1u << p->lanes) - 1);
+    __m512 enter = _mm512_set1_ps(-INFINITY), exit = _mm512_set1_ps(INFINITY);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        __m512 origin = _mm512_maskz_loadu_ps(lanes, p->origin[axis]);
+        __m512 inv = _mm512_maskz_loadu_ps(lanes, p->inv_direction[axis]);
+        __m512 t0 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(min[axis]), origin), inv);
+        __m512 t1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(max[axis]), origin), inv);
+        enter = _mm512_max_ps(enter, _mm512_min_ps(t0, t1));
+        exit = _mm512_min_ps(exit, _mm512_max_ps(t0, t1));
+    }
+    lanes = _mm512_mask_cmp_ps_mask(lanes, exit, enter, _CMP_GE_OQ);
+    lanes = _mm512_mask_cmp_ps_mask(lanes, exit, _mm512_set1_ps(EPSILON), _CMP_GT_OQ);
+    lanes = _mm512_mask_cmp_ps_mask(lanes, enter, _mm512_maskz_loadu_ps(lanes, p->t_max), _CMP_LE_OQ);
+    return lanes;
+}
+
+_Static_assert(RAY_PACKET_MAX <= 16, "The AVX-512 box test holds a packet in one register");
+
+#endif
+
+static void traverse_packet(RayPacket *p, const BVH *bvh, uint32_t root, uint32_t mask)
+{
+    PacketStackEntry stack[BVH_TRAVERSAL_STACK_SIZE];
+    int top = 0;
+    PacketStackEntry entry = {root, mask};
+
+    for (;;)
+    {
+        const BVHFlatNode *node = &bvh->nodes[entry.node];
+        entry.mask &= p->box_test(p, &node->bounds);
+
+        if (entry.mask)
+        {
+            if (node->count == 0)
+            {
+                uint32_t near = entry.node + 1, far = node->right_or_first;
+                int lane = __builtin_ctz(entry.mask);
+                if ((p->inv_direction[node->axis][lane] < 0.0f) != node->axis_flip)
+                {
+                    near = node->right_or_first;
+                    far = entry.node + 1;
+                }
+
+                if (top < BVH_TRAVERSAL_STACK_SIZE)
+                {
+                    stack[top++] = (PacketStackEntry){far, entry.mask};
+                    entry.node = near;
+                    continue;
+                }
+
+                traverse_packet(p, bvh, near, entry.mask);
+                entry.node = far;
+                continue;
+            }
+
+            Sphere *first = &bvh->spheres[node->right_or_first];
+            for (uint32_t lanes = entry.mask; lanes; lanes &= lanes - 1)
+            {
+                int lane = __builtin_ctz(lanes);
+                if (p->soa && node->count >= SPHERE_SOA_MIN_LEAF)
+                {
+                    int hit = sphere_soa_closest(p->soa, p->rays[lane], (int)node->right_or_first, (int)node->count,
+                                                 EPSILON, &p->t_max[lane]);
+                    if (hit >= 0)
+                        p->closest[lane] = &bvh->spheres[hit];
+                    continue;
+                }
+                for (uint32_t i = 0; i < node->count; i++)
+                {
+                    float t;
+                    if (ray_sphere_hit_t(p->rays[lane], &first[i], EPSILON, p->t_max[lane], &t))
+                    {
+                        p->closest[lane] = &first[i];
+                        p->t_max[lane] = t;
+                    }
+                }
+            }
+        }
+
+        if (top == 0)
+            return;
+        entry = stack[--top];
+    }
+}
+
+static void packet_setup(RayPacket *p, const Ray *rays, int count, const SphereSoA *soa)
+{
+    p->rays = rays;
+    p->soa = soa;
+    p->lanes = (count + 3) & ~3;
+    switch (cpu_get_path())
+    {
+#if defined(CPU_DISPATCH_X86)
+    case CPU_PATH_AVX512:
+        p->box_test = box_test_avx512;
+        break;
+    case CPU_PATH_AVX2:
+        p->box_test = box_test_avx2;
+        break;
+    case CPU_PATH_SSE2:
+        p->box_test = box_test_sse2;
+        break;
+#endif
+    default:
+        p->box_test = box_test_scalar;
+        break;
+    }
+    for (int lane = 0; lane < p->lanes; lane++)
+    {
+        // Lanes past count are padding, never in the mask
+        Ray ray = lane < count ? rays[lane] : rays[0];
+        float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+        float direction[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+        for (int axis = 0; axis < 3; axis++)
+        {
+            p->origin[axis][lane] = origin[axis];
+            p->inv_direction[axis][lane] = ray_inv_direction(direction[axis]);
+        }
+        p->t_max[lane] = INFINITY;
+        p->closest[lane] = NULL;
+    }
+}
+
+static void packet_hit_records(const RayPacket *p, int count, HitRecord *hits)
+{
+    for (int lane = 0; lane < count; lane++)
+        hits[lane] = p->closest[lane] ? ray_sphere_hit_record(p->rays[lane], p->closest[lane], p->t_max[lane]) : (HitRecord){0};
+}
+
+// Closest hits of count (at most RAY_PACKET_MAX) rays, the same as ray_bvh_intersect() on each ray.
+// soa (built from bvh->spheres) may be NULL.
+void ray_packet_intersect(const Ray *rays, int count, const BVH *bvh, const SphereSoA *soa, HitRecord *hits)
+{
+    RayPacket p;
+    packet_setup(&p, rays, count, soa);
+    if (bvh->node_count)
+        traverse_packet(&p, bvh, 0, (1u << count) - 1);
+    packet_hit_records(&p, count, hits);
+}
+
+// Same for rays that can only hit spheres below the given roots (ray_bvh_intersect_subtrees())
+void ray_packet_intersect_subtrees(const Ray *rays, int count, const BVH *bvh, const SphereSoA *soa,
+                                   const uint32_t *roots, int root_count, HitRecord *hits)
+{
+    RayPacket p;
+    packet_setup(&p, rays, count, soa);
+    for (int i = 0; i < root_count; i++)
+        traverse_packet(&p, bvh, roots[i], (1u << count) - 1);
+    packet_hit_records(&p, count, hits);
+}
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include "Custom/ray_stream.h"
+#include "Custom/lbvh.h"
+#include "Custom/constants.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Ray streams
+// Diffuse bounces leave every hit point in a random direction, so consecutive bounce rays of a frame
+// walk unrelated parts of the BVH. A stream collects the rays of one bounce for the whole frame and
+// reorders them so neighbours in the stream start close together and head the same way:
+// - the key is the direction octant (sign bits of the direction) above a Morton code of the origin,
+//   quantized to RAY_STREAM_CELL_BITS bits per axis inside the given bounds (the BVH root box)
+// - keys are sorted with the LBVH radix sort, ray and id arrays are permuted once afterwards
+// Rays of one octant and one origin cell touch mostly the same nodes, so traced in stream order
+// (one by one, or RAY_PACKET_MAX at a time as packets) they reuse cached nodes and keep packets coherent.
+// ids go along with the rays, so results can be written back to their pixels.
+
+//----------------------------------------------------------------------------------------------------
+
+static uint64_t ray_stream_key(Ray ray, AABB bounds, Vec3 scale)
+{
+    const float cells = (float)((1u << RAY_STREAM_CELL_BITS) - 1);
+    Vec3 p = vec3_sub(ray.origin, bounds.min);
+    float q[3] = {p.x * scale.x, p.y * scale.y, p.z * scale.z};
+    for (int axis = 0; axis < 3; axis++)
+        q[axis] = q[axis] < 0.0f ? 0.0f : (q[axis] > cells ? cells : q[axis]);
+
+    // Cells take at most 10 bits per axis, the 30 bit code's high bits stay zero
+    uint64_t cell = morton_encode((uint32_t)q[0], (uint32_t)q[1], (uint32_t)q[2], 30);
+    uint64_t octant = (ray.direction.x < 0.0f) << 2 | (ray.direction.y < 0.0f) << 1 | (ray.direction.z < 0.0f);
+    return octant << (3 * RAY_STREAM_CELL_BITS) | cell;
+}
+
+// Returns NULL if an allocation fails
+RayStreamScratch *ray_stream_scratch_create(int capacity)
+{
+    RayStreamScratch *scratch = malloc(sizeof(RayStreamScratch));
+    if (!scratch)
+        return NULL;
+    scratch->keys = malloc(capacity * sizeof(uint64_t));
+    scratch->order = malloc(capacity * sizeof(uint32_t));
+    scratch->key_buffer = malloc(capacity * sizeof(uint64_t));
+    scratch->value_buffer = malloc(capacity * sizeof(uint32_t));
+    scratch->histograms = malloc(radix_sort_chunk_count(capacity) * sizeof(*scratch->histograms));
+    scratch->sorted_rays = malloc(capacity * sizeof(Ray));
+    scratch->capacity = capacity;
+    if (!scratch->keys || !scratch->order || !scratch->key_buffer || !scratch->value_buffer ||
+        !scratch->histograms || !scratch->sorted_rays)
+    {
+        ray_stream_scratch_free(scratch);
+        return NULL;
+    }
+    return scratch;
+}
+
+void ray_stream_scratch_free(RayStreamScratch *scratch)
+{
+    if (!scratch)
+        return;
+    free(scratch->keys);
+    free(scratch->order);
+    free(scratch->key_buffer);
+    free(scratch->value_buffer);
+    free(scratch->histograms);
+    free(scratch->sorted_rays);
+    free(scratch);
+}
+
+// Sorts count rays (and their ids) by direction octant, then by origin cell inside bounds.
+// Without scratch arrays, or with more rays than they hold, the stream keeps its order.
+void ray_stream_sort(Ray *rays, uint32_t *ids, int count, AABB bounds, RayStreamScratch *scratch)
+{
+    if (count < 2 || !scratch || count > scratch->capacity)
+        return;
+
+    uint64_t *keys = scratch->keys;
+    uint32_t *order = scratch->order;
+
+    const float cells = (float)((1u << RAY_STREAM_CELL_BITS) - 1);
+    Vec3 extent = vec3_sub(bounds.max, bounds.min);
+    Vec3 scale = {
+        extent.x > 0.0f ? cells / extent.x : 0.0f,
+        extent.y > 0.0f ? cells / extent.y : 0.0f,
+        extent.z > 0.0f ? cells / extent.z : 0.0f};
+
+    for (int i = 0; i < count; i++)
+    {
+        keys[i] = ray_stream_key(rays[i], bounds, scale);
+        order[i] = (uint32_t)i;
+    }
+
+    radix_sort_morton_buffers(keys, order, count, 3 * RAY_STREAM_CELL_BITS + 3,
+                              scratch->key_buffer, scratch->value_buffer, scratch->histograms);
+
+    // The sort is done with its value buffer, it takes the permuted ids
+    Ray *sorted_rays = scratch->sorted_rays;
+    uint32_t *sorted_ids = scratch->value_buffer;
+    for (int i = 0; i < count; i++)
+    {
+        sorted_rays[i] = rays[order[i]];
+        sorted_ids[i] = ids[order[i]];
+    }
+    memcpy(rays, sorted_rays, count * sizeof(Ray));
+    memcpy(ids, sorted_ids, count * sizeof(uint32_t));
+}
@@ -1,13 +1,25 @@
 #include "Custom/renderer.h"
 #include "Custom/hit.h"
+#include "Custom/ray_packet.h"
+#include "Custom/ray_stream.h"
+#include "Custom/constants.h"
+#include <stdlib.h>
 #include <math.h>
 
+static SDL_Color shade_hit(Ray ray, HitRecord closest_hit, Sphere *spheres, int num_spheres, int depth, const BVH *bvh,
+                           const SphereSoA *soa);
+static SDL_Color blend_bounce(SDL_Color base_color, SDL_Color reflected_color);
+static SDL_Color sky_color(Ray ray);
+
 //--------------------------------------------------------------------------------------------------
 
 // Main function for recursive ray tracing (up to a specified depth).
 // The closest intersection of the ray can be calculated using two methods:
 // Method 1 - Bounding Volume Hierarchies (BVH) with Surface Area Heuristics (SAH) - O(log n), but building the BVH is O(n log n).
+//            With soa (a SoA copy of bvh->spheres, see sphere_soa.c) the spheres of bigger leaves are tested
+//            a group per instruction.
 // Method 2 - Brute force, traversing all objects (spheres) - O(n) for intersection tests.
+//            With soa (a SoA copy of spheres) a group of spheres is tested per instruction.
 
 // Recursion ends earlier if the ray directly misses all objects or ends up going towards
 // the sky after reflection.
@@ -18,50 +30,75 @@
 
 //--------------------------------------------------------------------------------------------------
 
-SDL_Color trace_ray(Ray ray, Sphere *spheres, int num_spheres, int depth, BVHNode *bvh)
+SDL_Color trace_ray(Ray ray, Sphere *spheres, int num_spheres, int depth, const BVH *bvh, const SphereSoA *soa)
 {
     if (depth <= 0)
         return (SDL_Color){0, 0, 0, 255};
 
     HitRecord closest_hit = {0};
-    closest_hit.t = INFINITY;
 
     if (bvh)
     {
-        closest_hit = ray_bvh_intersect(ray, bvh);
+        closest_hit = soa ? ray_bvh_intersect_soa(ray, bvh, soa) : ray_bvh_intersect(ray, bvh);
+    }
+    else if (soa)
+    {
+        closest_hit = ray_spheres_closest_soa(ray, spheres, soa);
     }
     else
     {
-
+        // Distances only, the attributes of the closest sphere are computed once
+        Sphere *closest = NULL;
+        float closest_t = INFINITY;
         for (int i = 0; i < num_spheres; i++)
         {
-            HitRecord hit = ray_sphere_intersect(ray, &spheres[i]);
-            if (hit.hit_something && hit.t < closest_hit.t)
+            float t;
+            if (ray_sphere_hit_t(ray, &spheres[i], EPSILON, closest_t, &t))
             {
-                closest_hit = hit;
+                closest = &spheres[i];
+                closest_t = t;
             }
         }
+        if (closest)
+            closest_hit = ray_sphere_hit_record(ray, closest, closest_t);
     }
 
+    return shade_hit(ray, closest_hit, spheres, num_spheres, depth, bvh, soa);
+}
+
+// Color of a ray with its closest hit (hit_something 0 - sky), continues with a diffuse bounce
+static SDL_Color shade_hit(Ray ray, HitRecord closest_hit, Sphere *spheres, int num_spheres, int depth, const BVH *bvh,
+                           const SphereSoA *soa)
+{
     if (closest_hit.hit_something)
     {
-        SDL_Color final_color = {0, 0, 0, 255};
         SDL_Color base_color = closest_hit.object ? closest_hit.object->color : (SDL_Color){0.0f, 0.0f, 0.0f};
 
         Vec3 reflected_dir = random_on_hemisphere(closest_hit.normal);
         // Vec3 reflected_dir = vec3_reflect(closest_hit.point, closest_hit.normal);
 
         Ray reflected_ray = {closest_hit.point, reflected_dir};
-        SDL_Color reflected_color = trace_ray(reflected_ray, spheres, num_spheres, depth - 1, bvh);
-        final_color.r = (Uint8)(base_color.r + 0.5 * reflected_color.r);
-        final_color.g = (Uint8)(base_color.g + 0.5 * reflected_color.g);
-        final_color.b = (Uint8)(base_color.b + 0.5 * reflected_color.b);
+        SDL_Color reflected_color = trace_ray(reflected_ray, spheres, num_spheres, depth - 1, bvh, soa);
+        return blend_bounce(base_color, reflected_color);
+    }
 
-        final_color.a = 255;
+    return sky_color(ray);
+}
 
-        return final_color;
-    }
+static SDL_Color blend_bounce(SDL_Color base_color, SDL_Color reflected_color)
+{
+    SDL_Color final_color = {0, 0, 0, 255};
+    final_color.r = (Uint8)(base_color.r + 0.5f * reflected_color.r);
+    final_color.g = (Uint8)(base_color.g + 0.5f * reflected_color.g);
+    final_color.b = (Uint8)(base_color.b + 0.5f * reflected_color.b);
+
+    final_color.a = 255;
 
+    return final_color;
+}
+
+static SDL_Color sky_color(Ray ray)
+{
     float t = 0.5f * (ray.direction.y + 1.0f);
     SDL_Color sky_color = {
         (1.0f - t) * 255 + t * 128,
@@ -75,3 +112,147 @@ SDL_Color trace_ray(Ray ray, Sphere *spheres, int num_spheres, int depth, BVHNod
     //     255};
     return sky_color;
 }
+
+//--------------------------------------------------------------------------------------------------
+
+// trace_ray_packet() - trace_ray() for a small screen block of primary rays (at most RAY_PACKET_MAX).
+// With a BVH the block's primary rays walk it together as one packet (ray_packet.c), the bounces
+// continue one ray at a time. Without a BVH every ray goes through trace_ray().
+// cut is the frustum cut of the tile holding the block (tile_frustum.c) or NULL to start at the root.
+
+//--------------------------------------------------------------------------------------------------
+
+void trace_ray_packet(const Ray *rays, int count, Sphere *spheres, int num_spheres, int depth, const BVH *bvh,
+                      const SphereSoA *soa, const TileCut *cut, SDL_Color *colors)
+{
+    if (!bvh || depth <= 0)
+    {
+        for (int i = 0; i < count; i++)
+            colors[i] = trace_ray(rays[i], spheres, num_spheres, depth, bvh, soa);
+        return;
+    }
+
+    HitRecord hits[RAY_PACKET_MAX];
+    if (cut)
+        ray_packet_intersect_subtrees(rays, count, bvh, soa, cut->roots, cut->count, hits);
+    else
+        ray_packet_intersect(rays, count, bvh, soa, hits);
+    for (int i = 0; i < count; i++)
+        colors[i] = shade_hit(rays[i], hits[i], spheres, num_spheres, depth, bvh, soa);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// trace_frame_stream() - trace_ray() for all count primary rays of a frame, one bounce at a time.
+// Instead of following every path to its end, each bounce is a stream : all rays still alive are
+// traced, their hits give the base colors and the next stream of diffuse bounces. Bounce streams are
+// sorted by direction octant and origin cell (ray_stream.c), then traced RAY_PACKET_MAX neighbouring
+// rays at a time as packets (ray_packet.c). Primary rays keep the given order, which is already coherent.
+// Rays that miss get the sky, rays left after depth bounces get black, then every pixel blends its
+// base colors back to front the way the recursion of trace_ray() does.
+// Same colors as trace_ray() for the same random bounces, only the order of random_on_hemisphere()
+// calls differs. Without a BVH, or without work arrays (frame_stream_create) big enough for count
+// rays and depth bounces, every ray goes through trace_ray().
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns NULL if an allocation fails
+FrameStream *frame_stream_create(int capacity, int depth)
+{
+    FrameStream *stream = malloc(sizeof(FrameStream));
+    if (!stream)
+        return NULL;
+    stream->rays = malloc(capacity * sizeof(Ray));
+    stream->ids = malloc(capacity * sizeof(uint32_t));
+    stream->base_colors = malloc((size_t)capacity * depth * sizeof(SDL_Color));
+    stream->hit_count = malloc(capacity * sizeof(int));
+    stream->sort = ray_stream_scratch_create(capacity);
+    stream->capacity = capacity;
+    stream->depth = depth;
+    if (!stream->rays || !stream->ids || !stream->base_colors || !stream->hit_count || !stream->sort)
+    {
+        frame_stream_free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+void frame_stream_free(FrameStream *stream)
+{
+    if (!stream)
+        return;
+    free(stream->rays);
+    free(stream->ids);
+    free(stream->base_colors);
+    free(stream->hit_count);
+    ray_stream_scratch_free(stream->sort);
+    free(stream);
+}
+
+void trace_frame_stream(const Ray *rays, int count, Sphere *spheres, int num_spheres, int depth, const BVH *bvh,
+                        const SphereSoA *soa, FrameStream *work, SDL_Color *colors)
+{
+    if (!bvh || !bvh->node_count || depth <= 0 || !work || count > work->capacity || depth > work->depth)
+    {
+        for (int i = 0; i < count; i++)
+            colors[i] = trace_ray(rays[i], spheres, num_spheres, depth, bvh, soa);
+        return;
+    }
+
+    Ray *stream = work->rays;
+    uint32_t *ids = work->ids;
+    SDL_Color *base_colors = work->base_colors;
+    int *hit_count = work->hit_count;
+    for (int i = 0; i < count; i++)
+    {
+        stream[i] = rays[i];
+        ids[i] = (uint32_t)i;
+        hit_count[i] = 0;
+    }
+
+    int active = count;
+    for (int bounce = 0; active > 0; bounce++)
+    {
+        if (bounce == depth)
+        {
+            for (int i = 0; i < active; i++)
+                colors[ids[i]] = (SDL_Color){0, 0, 0, 255};
+            break;
+        }
+
+        if (bounce > 0)
+            ray_stream_sort(stream, ids, active, bvh->nodes[0].bounds, work->sort);
+
+        // Survivors are compacted to the front, never past the packet being read
+        int next = 0;
+        for (int start = 0; start < active; start += RAY_PACKET_MAX)
+        {
+            int packet_count = active - start < RAY_PACKET_MAX ? active - start : RAY_PACKET_MAX;
+            HitRecord hits[RAY_PACKET_MAX];
+            ray_packet_intersect(&stream[start], packet_count, bvh, soa, hits);
+
+            for (int i = 0; i < packet_count; i++)
+            {
+                Ray ray = stream[start + i];
+                uint32_t id = ids[start + i];
+                if (!hits[i].hit_something)
+                {
+                    colors[id] = sky_color(ray);
+                    continue;
+                }
+
+                base_colors[(size_t)id * depth + bounce] = hits[i].object ? hits[i].object->color : (SDL_Color){0, 0, 0};
+                hit_count[id] = bounce + 1;
+                stream[next] = (Ray){hits[i].point, random_on_hemisphere(hits[i].normal)};
+                ids[next++] = id;
+            }
+        }
+        active = next;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        for (int bounce = hit_count[i] - 1; bounce >= 0; bounce--)
+            colors[i] = blend_bounce(base_colors[(size_t)i * depth + bounce], colors[i]);
+    }
+}
@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/rsah.h"
+#include "Custom/constants.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Ray distribution aware SAH (RSAH) construction
+// The SAH weights a child by SA(child) / SA(parent), the chance that a uniformly distributed ray
+// hitting the parent also hits the child. Rays of the interactive mode all start at the camera, so
+// the builder takes a sample of real rays (set in BVHBuildConfig.sample_rays, from
+// rsah_sample_camera_rays() or a ray file) and measures that chance instead :
+//   w(child) = (1 - ray_weight) * SA(child) / SA(parent) + ray_weight * hits(child) / hits(parent)
+// The surface area term keeps a sensible tree where the sample has no rays (behind the camera).
+// Otherwise the same binned top-down build as build_bvh_node(). Every node keeps the list of sample
+// rays hitting its bounds. The candidate left (and right) boxes of one axis are nested, so the first
+// box a ray hits is found by binary search and the hits of every candidate come from a prefix sum.
+// Without sample rays the build is a plain binned SAH build.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    Vec3 origin;
+    Vec3 inv_direction;
+} RSAHRay;
+
+typedef struct
+{
+    AABB bounds;
+    int count;
+} RSAHBin;
+
+typedef struct
+{
+    const RSAHRay *rays;
+    BVHBuildConfig config;
+} RSAHContext;
+
+static inline int rsah_bin_index(float center, float min, float scale, int bin_count)
+{
+    int bin = (int)((center - min) * scale);
+    return bin < 0 ? 0 : (bin >= bin_count ? bin_count - 1 : bin);
+}
+
+// Same test as ray_aabb_intersect() with the reciprocal direction precomputed
+static inline int ray_hits_box(const RSAHRay *ray, AABB box)
+{
+    float tx1 = (box.min.x - ray->origin.x) * ray->inv_direction.x;
+    float tx2 = (box.max.x - ray->origin.x) * ray->inv_direction.x;
+    float ty1 = (box.min.y - ray->origin.y) * ray->inv_direction.y;
+    float ty2 = (box.max.y - ray->origin.y) * ray->inv_direction.y;
+    float tz1 = (box.min.z - ray->origin.z) * ray->inv_direction.z;
+    float tz2 = (box.max.z - ray->origin.z) * ray->inv_direction.z;
+
+    float tmin = fmaxf(fminf(tx1, tx2), fmaxf(fminf(ty1, ty2), fminf(tz1, tz2)));
+    float tmax = fminf(fmaxf(tx1, tx2), fminf(fmaxf(ty1, ty2), fmaxf(tz1, tz2)));
+    return tmax >= tmin && tmax > EPSILON;
+}
+
+// Boxes grow from first to last (box[i] inside box[i + 1]), returns the first box the ray hits
+// or last + 1
+static int first_box_hit(const RSAHRay *ray, const AABB *boxes, int first, int last)
+{
+    int lo = first, hi = last + 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (ray_hits_box(ray, boxes[mid]))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+// Boxes grow from last to first, returns the last box the ray hits or first - 1
+static int last_box_hit(const RSAHRay *ray, const AABB *boxes, int first, int last)
+{
+    int lo = first - 1, hi = last;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (ray_hits_box(ray, boxes[mid]))
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// Picks the cheapest plane by the ray weighted cost, returns 0 if no plane separates the spheres
+static int find_best_split(const RSAHContext *ctx, Sphere *spheres, int start, int end, AABB bounds,
+                           AABB centroid_bounds, const uint32_t *rays, int num_rays,
+                           int *best_axis, int *best_bin, float *split_cost)
+{
+    const int bin_count = ctx->config.bin_count;
+    const float ray_weight = num_rays > 0 ? ctx->config.ray_weight : 0.0f;
+    float parent_area = get_aabb_surface_area(bounds);
+    *best_axis = -1;
+    *split_cost = INFINITY;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float axis_min = vec3_axis(centroid_bounds.min, axis);
+        float extent = vec3_axis(centroid_bounds.max, axis) - axis_min;
+        if (extent <= 0.0f)
+            continue;
+        float scale = bin_count / extent;
+
+        RSAHBin bins[BVH_MAX_SAH_BINS];
+        for (int b = 0; b < bin_count; b++)
+            bins[b] = (RSAHBin){create_empty_aabb(), 0};
+        for (int i = start; i < end; i++)
+        {
+            int b = rsah_bin_index(vec3_axis(spheres[i].center, axis), axis_min, scale, bin_count);
+            bins[b].count++;
+            bins[b].bounds = combine_aabb(bins[b].bounds, create_aabb_from_sphere(&spheres[i]));
+        }
+
+        // left[b] : bins 0..b, right[b] : bins b..bin_count - 1
+        AABB left[BVH_MAX_SAH_BINS], right[BVH_MAX_SAH_BINS];
+        int left_count[BVH_MAX_SAH_BINS], right_count[BVH_MAX_SAH_BINS];
+        left[0] = bins[0].bounds;
+        left_count[0] = bins[0].count;
+        for (int b = 1; b < bin_count; b++)
+        {
+            left[b] = combine_aabb(left[b - 1], bins[b].bounds);
+            left_count[b] = left_count[b - 1] + bins[b].count;
+        }
+        right[bin_count - 1] = bins[bin_count - 1].bounds;
+        right_count[bin_count - 1] = bins[bin_count - 1].count;
+        for (int b = bin_count - 2; b >= 0; b--)
+        {
+            right[b] = combine_aabb(right[b + 1], bins[b].bounds);
+            right_count[b] = right_count[b + 1] + bins[b].count;
+        }
+
+        // Sample rays hitting each candidate box, empty boxes (no spheres yet) are skipped
+        int left_hits[BVH_MAX_SAH_BINS + 1] = {0}, right_hits[BVH_MAX_SAH_BINS + 1] = {0};
+        if (ray_weight > 0.0f)
+        {
+            int first_left = 0, last_right = bin_count - 1;
+            while (!left_count[first_left])
+                first_left++;
+            while (!right_count[last_right])
+                last_right--;
+
+            for (int r = 0; r < num_rays; r++)
+            {
+                const RSAHRay *ray = &ctx->rays[rays[r]];
+                left_hits[first_box_hit(ray, left, first_left, bin_count - 2)]++;
+                right_hits[last_box_hit(ray, right, 1, last_right) + 1]++;
+            }
+            for (int b = 1; b < bin_count; b++)
+                left_hits[b] += left_hits[b - 1];
+            for (int b = bin_count - 1; b >= 0; b--)
+                right_hits[b] += right_hits[b + 1];
+        }
+
+        for (int b = 1; b < bin_count; b++)
+        {
+            if (!left_count[b - 1] || !right_count[b])
+                continue;
+
+            float left_weight = get_aabb_surface_area(left[b - 1]) / parent_area;
+            float right_weight = get_aabb_surface_area(right[b]) / parent_area;
+            if (ray_weight > 0.0f)
+            {
+                left_weight = (1.0f - ray_weight) * left_weight + ray_weight * left_hits[b - 1] / num_rays;
+                right_weight = (1.0f - ray_weight) * right_weight + ray_weight * right_hits[b + 1] / num_rays;
+            }
+
+            float cost = ctx->config.traversal_cost +
+                         ctx->config.intersection_cost *
+                             (left_count[b - 1] * left_weight + right_count[b] * right_weight);
+            if (cost < *split_cost)
+            {
+                *split_cost = cost;
+                *best_axis = axis;
+                *best_bin = b;
+            }
+        }
+    }
+    return *best_axis >= 0;
+}
+
+// Rays of the parent that also hit the node, into a new array
+static uint32_t *filter_rays(const RSAHContext *ctx, const uint32_t *rays, int num_rays, AABB bounds, int *count)
+{
+    uint32_t *hits = malloc((num_rays ? num_rays : 1) * sizeof(uint32_t));
+    *count = 0;
+    for (int r = 0; r < num_rays; r++)
+    {
+        if (ray_hits_box(&ctx->rays[rays[r]], bounds))
+            hits[(*count)++] = rays[r];
+    }
+
+    // Hit ratios only need a few hundred rays, thin out large nodes with an even stride
+    if (*count > RSAH_MAX_NODE_RAYS)
+    {
+        for (int r = 0; r < RSAH_MAX_NODE_RAYS; r++)
+            hits[r] = hits[(long long)r * *count / RSAH_MAX_NODE_RAYS];
+        *count = RSAH_MAX_NODE_RAYS;
+    }
+    return hits;
+}
+
+static BVHNode *make_leaf(BVHNode *node, Sphere *spheres, int start, int end)
+{
+    node->left = node->right = NULL;
+    node->sphere = &spheres[start];
+    node->sphere_count = end - start;
+    return node;
+}
+
+static BVHNode *build_rsah_recursive(const RSAHContext *ctx, Sphere *spheres, int start, int end,
+                                     const uint32_t *parent_rays, int num_parent_rays, int depth)
+{
+    BVHNode *node = malloc(sizeof(BVHNode));
+    int num_spheres = end - start;
+
+    AABB centroid_bounds = create_empty_aabb();
+    node->bounds = create_empty_aabb();
+    for (int i = start; i < end; i++)
+    {
+        node->bounds = combine_aabb(node->bounds, create_aabb_from_sphere(&spheres[i]));
+        centroid_bounds = combine_aabb(centroid_bounds, (AABB){spheres[i].center, spheres[i].center});
+    }
+    if (num_spheres <= 1 || depth >= 40)
+        return make_leaf(node, spheres, start, end);
+
+    int num_rays;
+    uint32_t *rays = filter_rays(ctx, parent_rays, num_parent_rays, node->bounds, &num_rays);
+
+    int best_axis, best_bin;
+    float split_cost;
+    int found_split = find_best_split(ctx, spheres, start, end, node->bounds, centroid_bounds, rays, num_rays,
+                                      &best_axis, &best_bin, &split_cost);
+
+    int mid;
+    if (num_spheres <= ctx->config.max_leaf_size && ctx->config.intersection_cost * num_spheres <= split_cost)
+    {
+        free(rays);
+        return make_leaf(node, spheres, start, end);
+    }
+    else if (!found_split)
+    {
+        mid = start + num_spheres / 2; // too many spheres for one leaf, split the range in half
+    }
+    else
+    {
+        float axis_min = vec3_axis(centroid_bounds.min, best_axis);
+        float scale = ctx->config.bin_count /
+                      (vec3_axis(centroid_bounds.max, best_axis) - axis_min);
+        mid = start;
+        for (int i = start; i < end; i++)
+        {
+            if (rsah_bin_index(vec3_axis(spheres[i].center, best_axis), axis_min, scale,
+                               ctx->config.bin_count) < best_bin)
+            {
+                Sphere temp = spheres[i];
+                spheres[i] = spheres[mid];
+                spheres[mid] = temp;
+                mid++;
+            }
+        }
+    }
+
+    if (num_spheres >= ctx->config.parallel_threshold)
+    {
+#pragma omp task
+        node->left = build_rsah_recursive(ctx, spheres, start, mid, rays, num_rays, depth + 1);
+#pragma omp task
+        node->right = build_rsah_recursive(ctx, spheres, mid, end, rays, num_rays, depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        node->left = build_rsah_recursive(ctx, spheres, start, mid, rays, num_rays, depth + 1);
+        node->right = build_rsah_recursive(ctx, spheres, mid, end, rays, num_rays, depth + 1);
+    }
+    free(rays);
+    node->sphere = NULL;
+    node->sphere_count = 0;
+    return node;
+}
+
+// Builds a linear BVH weighted by the sample rays of the build config.
+// Reorders the given sphere array, the BVH keeps pointing to it.
+BVH *rsah_build(Sphere *spheres, int num_spheres)
+{
+    RSAHContext ctx;
+    ctx.config = bvh_get_build_config();
+
+    int num_rays = ctx.config.sample_rays ? ctx.config.sample_ray_count : 0;
+    RSAHRay *rays = malloc((num_rays ? num_rays : 1) * sizeof(RSAHRay));
+    uint32_t *all_rays = malloc((num_rays ? num_rays : 1) * sizeof(uint32_t));
+    for (int r = 0; r < num_rays; r++)
+    {
+        Ray ray = ctx.config.sample_rays[r];
+        rays[r].origin = ray.origin;
+        rays[r].inv_direction = (Vec3){1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+        all_rays[r] = (uint32_t)r;
+    }
+    ctx.rays = rays;
+
+    BVHNode *root = NULL;
+    if (num_spheres > 0)
+    {
+#ifdef _OPENMP
+        if (ctx.config.thread_count != 1 && !omp_in_parallel() && num_spheres >= ctx.config.parallel_threshold)
+        {
+            int threads = ctx.config.thread_count > 0 ? ctx.config.thread_count : omp_get_max_threads();
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+            root = build_rsah_recursive(&ctx, spheres, 0, num_spheres, all_rays, num_rays, 0);
+        }
+        else
+#endif
+            root = build_rsah_recursive(&ctx, spheres, 0, num_spheres, all_rays, num_rays, 0);
+    }
+
+    BVH *bvh = bvh_flatten(root, spheres, num_spheres);
+    free_bvh(root);
+    free(all_rays);
+    free(rays);
+    return bvh;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Ray samples for the RSAH build
+// rsah_sample_camera_rays() - columns x rows rays through the pixel centers of a coarse image, with
+// the same pixel to (u, v) mapping as the render loop in main.c.
+// rsah_save_rays() / rsah_load_rays() - captured rays as text, one "ox oy oz dx dy dz" per line.
+
+//----------------------------------------------------------------------------------------------------
+
+Ray *rsah_sample_camera_rays(Camera *camera, int columns, int rows)
+{
+    Ray *rays = malloc(columns * rows * sizeof(Ray));
+    float aspect_ratio = (float)WIDTH / (float)HEIGHT;
+    for (int y = 0; y < rows; y++)
+    {
+        for (int x = 0; x < columns; x++)
+        {
+            float u = (((float)x + 0.5f) / columns - 0.5f) * aspect_ratio;
+            float v = ((float)y + 0.5f) / rows - 0.5f;
+            rays[y * columns + x] = get_camera_ray(camera, u, -v);
+        }
+    }
+    return rays;
+}
+
+int rsah_save_rays(const char *path, const Ray *rays, int num_rays)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        printf("Error opening ray file %s\n", path);
+        return 0;
+    }
+    for (int i = 0; i < num_rays; i++)
+    {
+        fprintf(file, "%.9g %.9g %.9g %.9g %.9g %.9g\n", rays[i].origin.x, rays[i].origin.y, rays[i].origin.z,
+                rays[i].direction.x, rays[i].direction.y, rays[i].direction.z);
+    }
+    fclose(file);
+    return 1;
+}
+
+// Returns NULL (and num_rays 0) if the file can not be read
+Ray *rsah_load_rays(const char *path, int *num_rays)
+{
+    *num_rays = 0;
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return NULL;
+
+    int capacity = 4096;
+    Ray *rays = malloc(capacity * sizeof(Ray));
+    Ray ray;
+    while (fscanf(file, "%f %f %f %f %f %f", &ray.origin.x, &ray.origin.y, &ray.origin.z,
+                  &ray.direction.x, &ray.direction.y, &ray.direction.z) == 6)
+    {
+        if (*num_rays == capacity)
+        {
+            capacity *= 2;
+            rays = realloc(rays, capacity * sizeof(Ray));
+        }
+        rays[(*num_rays)++] = ray;
+    }
+    fclose(file);
+
+    if (*num_rays == 0)
+    {
+        free(rays);
+        return NULL;
+    }
+    return rays;
+}
@@ -0,0 +1,557 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/sbvh.h"
+#include "Custom/constants.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Spatial split BVH (SBVH) construction (Stich, Friedrich and Dietrich 2009)
+// Top-down binned SAH build over sphere references (sphere index + bounds) instead of spheres :
+// - Every node first finds the best object split (binned over reference centroids, as in bvh.c).
+// - If the two children of that split overlap by more than spatial_split_alpha * SA(root), spatial
+//   splits are binned too. A spatial split cuts the node with a plane, a reference straddling the
+//   plane goes to both children with its bounds clipped to each side.
+// - Clipping uses the sphere, not just its box : any point p of the sphere inside a box satisfies
+//   (p_j - c_j)^2 <= r^2 - sum(i != j) dist(c_i, box_i)^2, so the clipped bounds shrink on every axis.
+// - Reference unsplitting : a straddling reference is kept on one side only when that is cheaper
+//   than duplicating it.
+// Duplicates are limited by duplication_budget * num_spheres extra references. The remaining budget
+// of a node is shared by its children in proportion to their reference counts, so the tree does not
+// depend on the number of threads.
+// The BVH gets its own sphere array (with the duplicates), the given spheres are not reordered.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    AABB bounds;
+    int sphere;
+} SBVHReference;
+
+typedef struct
+{
+    AABB bounds;
+    int count;
+} ObjectBin;
+
+typedef struct
+{
+    AABB bounds;
+    int enter; // references starting in this bin
+    int exit;  // references ending in this bin
+} SpatialBin;
+
+typedef struct SBVHNode
+{
+    AABB bounds;
+    struct SBVHNode *child[2];
+    int *spheres; // leaf - sphere index of every reference
+    int count;    // references in the subtree
+} SBVHNode;
+
+typedef struct
+{
+    const Sphere *spheres;
+    BVHBuildConfig config;
+    float min_overlap; // spatial_split_alpha * SA(root)
+} SBVHContext;
+
+typedef struct
+{
+    float cost;
+    int axis;
+    int bin;            // object - first bin of the right child, spatial - plane after this bin
+    float plane;        // spatial only
+    AABB left, right;   // child bounds
+    int left_count, right_count;
+} SBVHSplit;
+
+static inline float axis_min(AABB box, int axis)
+{
+    return axis == 0 ? box.min.x : (axis == 1 ? box.min.y : box.min.z);
+}
+
+static inline float axis_max(AABB box, int axis)
+{
+    return axis == 0 ? box.max.x : (axis == 1 ? box.max.y : box.max.z);
+}
+
+static inline float axis_center(AABB box, int axis)
+{
+    return 0.5f * (axis_min(box, axis) + axis_max(box, axis));
+}
+
+static inline void set_axis(Vec3 *v, int axis, float value)
+{
+    if (axis == 0)
+        v->x = value;
+    else if (axis == 1)
+        v->y = value;
+    else
+        v->z = value;
+}
+
+static inline int is_valid_aabb(AABB box)
+{
+    return box.min.x <= box.max.x && box.min.y <= box.max.y && box.min.z <= box.max.z;
+}
+
+static inline int bin_index(float value, float min, float scale, int bin_count)
+{
+    int bin = (int)((value - min) * scale);
+    return bin < 0 ? 0 : (bin >= bin_count ? bin_count - 1 : bin);
+}
+
+// Bounds of the part of the sphere inside box (the reference bounds already clipped to a slab).
+// Returns an inverted box if the sphere does not reach into it.
+static AABB clip_reference(const Sphere *sphere, AABB box)
+{
+    float center[3] = {sphere->center.x, sphere->center.y, sphere->center.z};
+    float lo[3] = {box.min.x, box.min.y, box.min.z};
+    float hi[3] = {box.max.x, box.max.y, box.max.z};
+    float dist2[3], total = 0.0f;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float d = center[axis] < lo[axis] ? lo[axis] - center[axis]
+                                          : (center[axis] > hi[axis] ? center[axis] - hi[axis] : 0.0f);
+        dist2[axis] = d * d;
+        total += dist2[axis];
+    }
+
+    float radius2 = sphere->radius * sphere->radius;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float rest = radius2 - (total - dist2[axis]);
+        if (rest < 0.0f)
+            return (AABB){{1.0f, 1.0f, 1.0f}, {-1.0f, -1.0f, -1.0f}};
+        float half = sqrtf(rest);
+        lo[axis] = fmaxf(lo[axis], center[axis] - half);
+        hi[axis] = fminf(hi[axis], center[axis] + half);
+    }
+
+    return (AABB){{lo[0], lo[1], lo[2]}, {hi[0], hi[1], hi[2]}};
+}
+
+// Part of the reference on one side of the plane, side 0 - below, 1 - above
+static AABB clip_to_side(const SBVHContext *ctx, const SBVHReference *ref, int axis, float plane, int side)
+{
+    AABB box = ref->bounds;
+    if (side == 0)
+        set_axis(&box.max, axis, fminf(axis_max(box, axis), plane));
+    else
+        set_axis(&box.min, axis, fmaxf(axis_min(box, axis), plane));
+    return clip_reference(&ctx->spheres[ref->sphere], box);
+}
+
+static inline float split_cost(const SBVHContext *ctx, float parent_area, AABB left, int left_count,
+                               AABB right, int right_count)
+{
+    return ctx->config.traversal_cost +
+           ctx->config.intersection_cost *
+               (left_count * get_aabb_surface_area(left) + right_count * get_aabb_surface_area(right)) /
+               parent_area;
+}
+
+static void find_object_split(const SBVHContext *ctx, const SBVHReference *refs, int count, AABB bounds,
+                              AABB centroid_bounds, SBVHSplit *best)
+{
+    const int bin_count = ctx->config.bin_count;
+    float parent_area = get_aabb_surface_area(bounds);
+    best->cost = INFINITY;
+    best->axis = -1;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float min = axis_min(centroid_bounds, axis);
+        float extent = axis_max(centroid_bounds, axis) - min;
+        if (extent <= 0.0f)
+            continue;
+        float scale = bin_count / extent;
+
+        ObjectBin bins[BVH_MAX_SAH_BINS];
+        for (int b = 0; b < bin_count; b++)
+            bins[b] = (ObjectBin){create_empty_aabb(), 0};
+        for (int i = 0; i < count; i++)
+        {
+            int b = bin_index(axis_center(refs[i].bounds, axis), min, scale, bin_count);
+            bins[b].count++;
+            bins[b].bounds = combine_aabb(bins[b].bounds, refs[i].bounds);
+        }
+
+        AABB left_bounds[BVH_MAX_SAH_BINS];
+        int left_count[BVH_MAX_SAH_BINS];
+        AABB box = create_empty_aabb();
+        int n = 0;
+        for (int b = 0; b < bin_count - 1; b++)
+        {
+            box = combine_aabb(box, bins[b].bounds);
+            n += bins[b].count;
+            left_bounds[b] = box;
+            left_count[b] = n;
+        }
+
+        box = create_empty_aabb();
+        n = 0;
+        for (int b = bin_count - 1; b > 0; b--)
+        {
+            box = combine_aabb(box, bins[b].bounds);
+            n += bins[b].count;
+            if (!n || !left_count[b - 1])
+                continue;
+
+            float cost = split_cost(ctx, parent_area, left_bounds[b - 1], left_count[b - 1], box, n);
+            if (cost < best->cost)
+            {
+                *best = (SBVHSplit){cost, axis, b, 0.0f, left_bounds[b - 1], box, left_count[b - 1], n};
+            }
+        }
+    }
+}
+
+static void find_spatial_split(const SBVHContext *ctx, const SBVHReference *refs, int count, AABB bounds,
+                               SBVHSplit *best)
+{
+    const int bin_count = ctx->config.bin_count;
+    float parent_area = get_aabb_surface_area(bounds);
+    best->cost = INFINITY;
+    best->axis = -1;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float min = axis_min(bounds, axis);
+        float extent = axis_max(bounds, axis) - min;
+        if (extent <= 0.0f)
+            continue;
+        float width = extent / bin_count;
+        float scale = 1.0f / width;
+
+        SpatialBin bins[BVH_MAX_SAH_BINS];
+        for (int b = 0; b < bin_count; b++)
+            bins[b] = (SpatialBin){create_empty_aabb(), 0, 0};
+
+        for (int i = 0; i < count; i++)
+        {
+            const SBVHReference *ref = &refs[i];
+            int first = bin_index(axis_min(ref->bounds, axis), min, scale, bin_count);
+            int last = bin_index(axis_max(ref->bounds, axis), min, scale, bin_count);
+            bins[first].enter++;
+            bins[last].exit++;
+
+            if (first == last)
+            {
+                bins[first].bounds = combine_aabb(bins[first].bounds, ref->bounds);
+                continue;
+            }
+            for (int b = first; b <= last; b++)
+            {
+                AABB box = ref->bounds;
+                if (b > first)
+                    set_axis(&box.min, axis, min + b * width);
+                if (b < last)
+                    set_axis(&box.max, axis, min + (b + 1) * width);
+                AABB piece = clip_reference(&ctx->spheres[ref->sphere], box);
+                if (is_valid_aabb(piece))
+                    bins[b].bounds = combine_aabb(bins[b].bounds, piece);
+            }
+        }
+
+        AABB left_bounds[BVH_MAX_SAH_BINS];
+        int left_count[BVH_MAX_SAH_BINS];
+        AABB box = create_empty_aabb();
+        int n = 0;
+        for (int b = 0; b < bin_count - 1; b++)
+        {
+            box = combine_aabb(box, bins[b].bounds);
+            n += bins[b].enter;
+            left_bounds[b] = box;
+            left_count[b] = n;
+        }
+
+        box = create_empty_aabb();
+        n = 0;
+        for (int b = bin_count - 1; b > 0; b--)
+        {
+            box = combine_aabb(box, bins[b].bounds);
+            n += bins[b].exit;
+            if (!n || !left_count[b - 1])
+                continue;
+
+            float cost = split_cost(ctx, parent_area, left_bounds[b - 1], left_count[b - 1], box, n);
+            if (cost < best->cost)
+            {
+                *best = (SBVHSplit){cost, axis, b - 1, min + b * width,
+                                    left_bounds[b - 1], box, left_count[b - 1], n};
+            }
+        }
+    }
+}
+
+// Splits the references by centroid bin, as the object split was binned
+static void partition_object(const SBVHReference *refs, int count, AABB centroid_bounds, int bin_count,
+                             const SBVHSplit *split, SBVHReference *left, int *left_count,
+                             SBVHReference *right, int *right_count)
+{
+    float min = axis_min(centroid_bounds, split->axis);
+    float scale = bin_count / (axis_max(centroid_bounds, split->axis) - min);
+    *left_count = *right_count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (bin_index(axis_center(refs[i].bounds, split->axis), min, scale, bin_count) < split->bin)
+            left[(*left_count)++] = refs[i];
+        else
+            right[(*right_count)++] = refs[i];
+    }
+}
+
+// Splits the references at the plane, straddling references are duplicated while the budget lasts
+// and it is cheaper than keeping them whole on one side. Returns the number of duplicates.
+static int partition_spatial(const SBVHContext *ctx, const SBVHReference *refs, int count, const SBVHSplit *split,
+                             int budget, SBVHReference *left, int *left_count,
+                             SBVHReference *right, int *right_count)
+{
+    int axis = split->axis;
+    float plane = split->plane;
+    AABB left_bounds = split->left, right_bounds = split->right;
+    int num_left = split->left_count, num_right = split->right_count;
+    int duplicates = 0;
+    *left_count = *right_count = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        const SBVHReference *ref = &refs[i];
+        if (axis_max(ref->bounds, axis) <= plane)
+        {
+            left[(*left_count)++] = *ref;
+            continue;
+        }
+        if (axis_min(ref->bounds, axis) >= plane)
+        {
+            right[(*right_count)++] = *ref;
+            continue;
+        }
+
+        AABB left_piece = clip_to_side(ctx, ref, axis, plane, 0);
+        AABB right_piece = clip_to_side(ctx, ref, axis, plane, 1);
+        if (!is_valid_aabb(left_piece))
+        {
+            right[(*right_count)++] = (SBVHReference){right_piece, ref->sphere};
+            continue;
+        }
+        if (!is_valid_aabb(right_piece))
+        {
+            left[(*left_count)++] = (SBVHReference){left_piece, ref->sphere};
+            continue;
+        }
+
+        // Unsplitting : compare duplicating against moving the whole reference to either side
+        AABB left_whole = combine_aabb(left_bounds, ref->bounds);
+        AABB right_whole = combine_aabb(right_bounds, ref->bounds);
+        float cost_split = get_aabb_surface_area(left_bounds) * num_left +
+                           get_aabb_surface_area(right_bounds) * num_right;
+        float cost_left = get_aabb_surface_area(left_whole) * num_left +
+                          get_aabb_surface_area(right_bounds) * (num_right - 1);
+        float cost_right = get_aabb_surface_area(left_bounds) * (num_left - 1) +
+                           get_aabb_surface_area(right_whole) * num_right;
+
+        if (duplicates < budget && cost_split <= cost_left && cost_split <= cost_right)
+        {
+            left[(*left_count)++] = (SBVHReference){left_piece, ref->sphere};
+            right[(*right_count)++] = (SBVHReference){right_piece, ref->sphere};
+            duplicates++;
+        }
+        else if (cost_left <= cost_right)
+        {
+            left[(*left_count)++] = *ref;
+            left_bounds = left_whole;
+            num_right--;
+        }
+        else
+        {
+            right[(*right_count)++] = *ref;
+            right_bounds = right_whole;
+            num_left--;
+        }
+    }
+    return duplicates;
+}
+
+static SBVHNode *make_leaf(SBVHNode *node, SBVHReference *refs, int count)
+{
+    node->child[0] = node->child[1] = NULL;
+    node->spheres = malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++)
+        node->spheres[i] = refs[i].sphere;
+    node->count = count;
+    free(refs);
+    return node;
+}
+
+// Builds the subtree over refs (takes ownership of the array), budget - extra references allowed
+static SBVHNode *build_sbvh_recursive(const SBVHContext *ctx, SBVHReference *refs, int count, int budget, int depth)
+{
+    SBVHNode *node = malloc(sizeof(SBVHNode));
+    AABB centroid_bounds = create_empty_aabb();
+    node->bounds = create_empty_aabb();
+    for (int i = 0; i < count; i++)
+    {
+        node->bounds = combine_aabb(node->bounds, refs[i].bounds);
+        Vec3 center = vec3_multiply(vec3_add(refs[i].bounds.min, refs[i].bounds.max), 0.5f);
+        centroid_bounds = combine_aabb(centroid_bounds, (AABB){center, center});
+    }
+
+    if (count <= 1 || depth >= SBVH_MAX_DEPTH)
+        return make_leaf(node, refs, count);
+
+    SBVHSplit object, spatial;
+    find_object_split(ctx, refs, count, node->bounds, centroid_bounds, &object);
+    spatial.cost = INFINITY;
+    if (budget > 0 && object.axis >= 0)
+    {
+        AABB overlap = {{fmaxf(object.left.min.x, object.right.min.x), fmaxf(object.left.min.y, object.right.min.y),
+                         fmaxf(object.left.min.z, object.right.min.z)},
+                        {fminf(object.left.max.x, object.right.max.x), fminf(object.left.max.y, object.right.max.y),
+                         fminf(object.left.max.z, object.right.max.z)}};
+        if (is_valid_aabb(overlap) && get_aabb_surface_area(overlap) > ctx->min_overlap)
+            find_spatial_split(ctx, refs, count, node->bounds, &spatial);
+    }
+    if (budget > 0 && object.axis < 0)
+        find_spatial_split(ctx, refs, count, node->bounds, &spatial);
+
+    float best_cost = fminf(object.cost, spatial.cost);
+    if (best_cost == INFINITY ||
+        (count <= ctx->config.max_leaf_size && ctx->config.intersection_cost * count <= best_cost))
+        return make_leaf(node, refs, count);
+
+    SBVHReference *left = malloc((count + budget) * sizeof(SBVHReference));
+    SBVHReference *right = malloc((count + budget) * sizeof(SBVHReference));
+    int left_count = 0, right_count = 0, duplicates = 0;
+    if (spatial.cost < object.cost)
+        duplicates = partition_spatial(ctx, refs, count, &spatial, budget, left, &left_count, right, &right_count);
+
+    // Everything ended up on one side after unsplitting, fall back to the object split
+    if (!left_count || !right_count)
+    {
+        if (object.axis < 0)
+        {
+            free(left);
+            free(right);
+            return make_leaf(node, refs, count);
+        }
+        partition_object(refs, count, centroid_bounds, ctx->config.bin_count, &object,
+                         left, &left_count, right, &right_count);
+        duplicates = 0;
+    }
+    free(refs);
+
+    int remaining = budget - duplicates;
+    int left_budget = (int)((long long)remaining * left_count / (left_count + right_count));
+    int right_budget = remaining - left_budget;
+    left = realloc(left, (left_count + left_budget) * sizeof(SBVHReference));
+    right = realloc(right, (right_count + right_budget) * sizeof(SBVHReference));
+
+    if (count >= ctx->config.parallel_threshold)
+    {
+#pragma omp task
+        node->child[0] = build_sbvh_recursive(ctx, left, left_count, left_budget, depth + 1);
+#pragma omp task
+        node->child[1] = build_sbvh_recursive(ctx, right, right_count, right_budget, depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        node->child[0] = build_sbvh_recursive(ctx, left, left_count, left_budget, depth + 1);
+        node->child[1] = build_sbvh_recursive(ctx, right, right_count, right_budget, depth + 1);
+    }
+    node->spheres = NULL;
+    node->count = node->child[0]->count + node->child[1]->count;
+    return node;
+}
+
+static int count_nodes(const SBVHNode *node)
+{
+    if (!node->child[0])
+        return 1;
+    return 1 + count_nodes(node->child[0]) + count_nodes(node->child[1]);
+}
+
+static uint32_t emit_nodes(const SBVHNode *node, const Sphere *spheres, BVH *bvh, uint32_t *next, uint32_t *written)
+{
+    uint32_t index = (*next)++;
+    BVHFlatNode *flat = &bvh->nodes[index];
+    flat->bounds = node->bounds;
+
+    if (!node->child[0])
+    {
+        flat->right_or_first = *written;
+        flat->count = (uint32_t)node->count;
+        for (int i = 0; i < node->count; i++)
+            bvh->spheres[(*written)++] = spheres[node->spheres[i]];
+        return index;
+    }
+
+    emit_nodes(node->child[0], spheres, bvh, next, written);
+    flat->right_or_first = emit_nodes(node->child[1], spheres, bvh, next, written);
+    flat->count = 0;
+    return index;
+}
+
+static void free_nodes(SBVHNode *node)
+{
+    if (node->child[0])
+    {
+        free_nodes(node->child[0]);
+        free_nodes(node->child[1]);
+    }
+    free(node->spheres);
+    free(node);
+}
+
+// Builds a linear BVH with spatial splits. The BVH owns a copy of the spheres (sphere_count is the
+// number of references, duplicates included), the given array is left as it is.
+BVH *sbvh_build(Sphere *spheres, int num_spheres)
+{
+    SBVHContext ctx = {spheres, bvh_get_build_config(), 0.0f};
+
+    if (num_spheres <= 0)
+        return bvh_allocate_owned(0, 0);
+
+    SBVHReference *refs = malloc(num_spheres * sizeof(SBVHReference));
+    AABB root_bounds = create_empty_aabb();
+    for (int i = 0; i < num_spheres; i++)
+    {
+        refs[i] = (SBVHReference){create_aabb_from_sphere(&spheres[i]), i};
+        root_bounds = combine_aabb(root_bounds, refs[i].bounds);
+    }
+    ctx.min_overlap = ctx.config.spatial_split_alpha * get_aabb_surface_area(root_bounds);
+    int budget = (int)(num_spheres * ctx.config.duplication_budget);
+
+    SBVHNode *root;
+#ifdef _OPENMP
+    if (ctx.config.thread_count != 1 && !omp_in_parallel() && num_spheres >= ctx.config.parallel_threshold)
+    {
+        int threads = ctx.config.thread_count > 0 ? ctx.config.thread_count : omp_get_max_threads();
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+        root = build_sbvh_recursive(&ctx, refs, num_spheres, budget, 0);
+    }
+    else
+#endif
+        root = build_sbvh_recursive(&ctx, refs, num_spheres, budget, 0);
+
+    BVH *bvh = bvh_allocate_owned(root->count, count_nodes(root));
+    if (bvh)
+    {
+        uint32_t next = 0, written = 0;
+        emit_nodes(root, spheres, bvh, &next, &written);
+        bvh_assign_split_axes(bvh->nodes, bvh->node_count);
+    }
+    free_nodes(root);
+    return bvh;
+}
@@ -16,10 +16,11 @@ float random_float(float min, float max) {
 }
 
 
+// Unit length to the precision of vec3_rsqrt() (VEC3_NEWTON_STEPS), enough for bounce directions
 Vec3 random_in_unit_sphere() {
     while (1) {
-        Vec3 p = vec3_random(-1.0, 1.0f);
-        if (vec3_dot(p, p) < 1 && vec3_dot(p, p) != 0.0f) return vec3_normalize(p);
+        Vec3 p = vec3_random(-1.0f, 1.0f);
+        if (vec3_dot(p, p) < 1 && vec3_dot(p, p) != 0.0f) return vec3_normalize_fast(p);
     }
 }
 
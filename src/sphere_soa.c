@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "Custom/sphere_soa.h"
+#include "Custom/constants.h"
+#include "Custom/cpu_dispatch.h"
+
+#if defined(CPU_DISPATCH_X86)
+#include <immintrin.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Structure of arrays spheres
+// Sphere structs interleave the center, the radius and the color, so a loop over them tests one
+// sphere at a time. The SoA copy keeps cx[], cy[], cz[] and r^2[] apart, and sphere_soa_closest()
+// tests one ray against a whole group of spheres per instruction, on the active path (cpu_dispatch.c) :
+// - AVX-512 16 spheres
+// - AVX2 8 spheres
+// - SSE2 4 spheres
+// - scalar the same test in a plain loop
+// Every lane computes exactly the float operations of ray_sphere_hit_t(), in the same order, so the
+// t values and the closest sphere (the first one in the range on equal t) are the scalar ones.
+// Used for the brute force path of trace_ray() and, on a copy of bvh->spheres, for the leaves of
+// ray_bvh_intersect_soa() (every BVH bounce of trace_ray()) and of the ray packets (ray_packet.c).
+
+//----------------------------------------------------------------------------------------------------
+
+// Returns NULL if the memory can not be allocated
+SphereSoA *sphere_soa_build(const Sphere *spheres, int num_spheres)
+{
+    SphereSoA *soa = malloc(sizeof(SphereSoA));
+    size_t padded = (size_t)num_spheres + SPHERE_SOA_PAD;
+    float *data = soa ? malloc(4 * padded * sizeof(float)) : NULL;
+    if (!data)
+    {
+        printf("Failed to allocate memory for the SoA spheres (%d spheres)\n", num_spheres);
+        free(soa);
+        return NULL;
+    }
+
+    soa->center_x = data;
+    soa->center_y = data + padded;
+    soa->center_z = data + 2 * padded;
+    soa->radius2 = data + 3 * padded;
+    soa->count = num_spheres;
+    for (size_t i = 0; i < padded; i++)
+    {
+        // Padding is never hit, its c and the discriminant are infinite
+        int real = i < (size_t)num_spheres;
+        soa->center_x[i] = real ? spheres[i].center.x : 0.0f;
+        soa->center_y[i] = real ? spheres[i].center.y : 0.0f;
+        soa->center_z[i] = real ? spheres[i].center.z : 0.0f;
+        soa->radius2[i] = real ? spheres[i].radius * spheres[i].radius : -INFINITY;
+    }
+    return soa;
+}
+
+void sphere_soa_free(SphereSoA *soa)
+{
+    if (!soa)
+        return;
+    free(soa->center_x);
+    free(soa);
+}
+
+// Kernels of the paths, each finds the closest sphere in [first, first + count) with
+// t_min < t < *t_max and writes its t to *t_max
+
+static int closest_scalar(const SphereSoA *soa, Ray ray, int first, int count, float t_min, float *t_max)
+{
+    const float ox = ray.origin.x, oy = ray.origin.y, oz = ray.origin.z;
+    const float dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+    const float a = dx * dx + dy * dy + dz * dz;
+    const float four_a = 4 * a, two_a = 2.0f * a;
+    int closest = -1;
+    float closest_t = *t_max;
+
+    for (int i = first; i < first + count; i++)
+    {
+        float ocx = ox - soa->center_x[i], ocy = oy - soa->center_y[i], ocz = oz - soa->center_z[i];
+        float b = 2.0f * (ocx * dx + ocy * dy + ocz * dz);
+        float c = (ocx * ocx + ocy * ocy + ocz * ocz) - soa->radius2[i];
+        float discriminant = b * b - four_a * c;
+        if (discriminant > 0)
+        {
+            float t = (-b - sqrtf(discriminant)) / two_a;
+            if (t > t_min && t < closest_t)
+            {
+                closest_t = t;
+                closest = i;
+            }
+        }
+    }
+
+    *t_max = closest_t;
+    return closest;
+}
+
+#if defined(CPU_DISPATCH_X86)
+
+static int closest_sse2(const SphereSoA *soa, Ray ray, int first, int count, float t_min, float *t_max)
+{
+    const float dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+    const float a = dx * dx + dy * dy + dz * dz;
+    const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+    const __m128 four_a = _mm_set1_ps(4 * a), two_a = _mm_set1_ps(2.0f * a);
+    const __m128 lane_index = _mm_setr_ps(0, 1, 2, 3);
+    int closest = -1;
+    float closest_t = *t_max;
+
+    for (int i = first, end = first + count; i < end; i += 4)
+    {
+        __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(&soa->center_x[i]));
+        __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(&soa->center_y[i]));
+        __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(&soa->center_z[i]));
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, _mm_set1_ps(dx)), _mm_mul_ps(ocy, _mm_set1_ps(dy))),
+                              _mm_mul_ps(ocz, _mm_set1_ps(dz)));
+        b = _mm_mul_ps(_mm_set1_ps(2.0f), b);
+        __m128 c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz));
+        c = _mm_sub_ps(c, _mm_loadu_ps(&soa->radius2[i]));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(four_a, c));
+        __m128 hit = _mm_and_ps(_mm_cmpgt_ps(discriminant, _mm_setzero_ps()),
+                                _mm_cmplt_ps(lane_index, _mm_set1_ps((float)(end - i))));
+        if (!_mm_movemask_ps(hit))
+            continue;
+
+        __m128 t = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), b), _mm_sqrt_ps(discriminant)), two_a);
+        hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(t_min)), _mm_cmplt_ps(t, _mm_set1_ps(closest_t))));
+        uint32_t lanes = (uint32_t)_mm_movemask_ps(hit);
+        if (!lanes)
+            continue;
+
+        float lane_t[4];
+        _mm_storeu_ps(lane_t, t);
+        for (; lanes; lanes &= lanes - 1)
+        {
+            int lane = __builtin_ctz(lanes);
+            if (lane_t[lane] < closest_t)
+            {
+                closest_t = lane_t[lane];
+                closest = i + lane;
+            }
+        }
+    }
+
+    *t_max = closest_t;
+    return closest;
+}
+
+CPU_TARGET_AVX2
+static int closest_avx2(const SphereSoA *soa, Ray ray, int first, int count, float t_min, float *t_max)
+{
+    const float dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+    const float a = dx * dx + dy * dy + dz * dz;
+    const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+    const __m256 four_a = _mm256_set1_ps(4 * a), two_a = _mm256_set1_ps(2.0f * a);
+    const __m256 lane_index = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    int closest = -1;
+    float closest_t = *t_max;
+
+    for (int i = first, end = first + count; i < end; i += 8)
+    {
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&soa->center_x[i]));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&soa->center_y[i]));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&soa->center_z[i]));
+        __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, _mm256_set1_ps(dx)), _mm256_mul_ps(ocy, _mm256_set1_ps(dy))),
+                                 _mm256_mul_ps(ocz, _mm256_set1_ps(dz)));
+        b = _mm256_mul_ps(_mm256_set1_ps(2.0f), b);
+        __m256 c = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz));
+        c = _mm256_sub_ps(c, _mm256_loadu_ps(&soa->radius2[i]));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(four_a, c));
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ),
+                                   _mm256_cmp_ps(lane_index, _mm256_set1_ps((float)(end - i)), _CMP_LT_OQ));
+        if (!_mm256_movemask_ps(hit))
+            continue;
+
+        __m256 t = _mm256_div_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_setzero_ps(), b), _mm256_sqrt_ps(discriminant)), two_a);
+        hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(t_min), _CMP_GT_OQ),
+                                               _mm256_cmp_ps(t, _mm256_set1_ps(closest_t), _CMP_LT_OQ)));
+        uint32_t lanes = (uint32_t)_mm256_movemask_ps(hit);
+        if (!lanes)
+            continue;
+
+        float lane_t[8];
+        _mm256_storeu_ps(lane_t, t);
+        for (; lanes; lanes &= lanes - 1)
+        {
+            int lane = __builtin_ctz(lanes);
+            if (lane_t[lane] < closest_t)
+            {
+                closest_t = lane_t[lane];
+                closest = i + lane;
+            }
+        }
+    }
+
+    *t_max = closest_t;
+    return closest;
+}
+
+CPU_TARGET_AVX512
+static int closest_avx512(const SphereSoA *soa, Ray ray, int first, int count, float t_min, float *t_max)
+{
+    const float dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+    const float a = dx * dx + dy * dy + dz * dz;
+    const __m512 ox = _mm512_set1_ps(ray.origin.x), oy = _mm512_set1_ps(ray.origin.y), oz = _mm512_set1_ps(ray.origin.z);
+    const __m512 four_a = _mm512_set1_ps(4 * a), two_a = _mm512_set1_ps(2.0f * a);
+    int closest = -1;
+    float closest_t = *t_max;
+
+    for (int i = first, end = first + count; i < end; i += 16)
+    {
+        __mmask16 lanes = end - i >= 16 ? 0xffff : (__mmask16)((1u << (end - i)) - 1);
+        __m512 ocx = _mm512_sub_ps(ox, _mm512_loadu_ps(&soa->center_x[i]));
+        __m512 ocy = _mm512_sub_ps(oy, _mm512_loadu_ps(&soa->center_y[i]));
+        __m512 ocz = _mm512_sub_ps(oz, _mm512_loadu_ps(&soa->center_z[i]));
+        __m512 b = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, _mm512_set1_ps(dx)), _mm512_mul_ps(ocy, _mm512_set1_ps(dy))),
+                                 _mm512_mul_ps(ocz, _mm512_set1_ps(dz)));
+        b = _mm512_mul_ps(_mm512_set1_ps(2.0f), b);
+        __m512 c = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz));
+        c = _mm512_sub_ps(c, _mm512_loadu_ps(&soa->radius2[i]));
+        __m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(b, b), _mm512_mul_ps(four_a, c));
+        lanes = _mm512_mask_cmp_ps_mask(lanes, discriminant, _mm512_setzero_ps(), _CMP_GT_OQ);
+        if (!lanes)
+            continue;
+
+        __m512 t = _mm512_div_ps(_mm512_sub_ps(_mm512_sub_ps(_mm512_setzero_ps(), b), _mm512_sqrt_ps(discriminant)), two_a);
+        lanes = _mm512_mask_cmp_ps_mask(lanes, t, _mm512_set1_ps(t_min), _CMP_GT_OQ);
+        lanes = _mm512_mask_cmp_ps_mask(lanes, t, _mm512_set1_ps(closest_t), _CMP_LT_OQ);
+        if (!lanes)
+            continue;
+
+        float lane_t[16];
+        _mm512_storeu_ps(lane_t, t);
+        for (uint32_t mask = lanes; mask; mask &= mask - 1)
+        {
+            int lane = __builtin_ctz(mask);
+            if (lane_t[lane] < closest_t)
+            {
+                closest_t = lane_t[lane];
+                closest = i + lane;
+            }
+        }
+    }
+
+    *t_max = closest_t;
+    return closest;
+}
+
+#endif
+
+// Index of the closest sphere in [first, first + count) with t_min < t < *t_max, or -1.
+// *t_max becomes the t of the hit.
+int sphere_soa_closest(const SphereSoA *soa, Ray ray, int first, int count, float t_min, float *t_max)
+{
+    switch (cpu_get_path())
+    {
+#if defined(CPU_DISPATCH_X86)
+    case CPU_PATH_AVX512:
+        return closest_avx512(soa, ray, first, count, t_min, t_max);
+    case CPU_PATH_AVX2:
+        return closest_avx2(soa, ray, first, count, t_min, t_max);
+    case CPU_PATH_SSE2:
+        return closest_sse2(soa, ray, first, count, t_min, t_max);
+#endif
+    default:
+        return closest_scalar(soa, ray, first, count, t_min, t_max);
+    }
+}
@@ -0,0 +1,115 @@
+#include <math.h>
+#include "Custom/tile_frustum.h"
+#include "Custom/ray.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Tile frustum culling
+// All primary rays of a screen tile start at the camera and pass between the rays through the tile's
+// corners (get_camera_ray() is linear in u, v before normalizing), so they stay inside the pyramid
+// of those four corner rays. A box fully behind one of its four side planes is missed by every ray
+// of the tile. Once per tile, the BVH is cut below the root :
+// - a candidate with one visible child is replaced by it (the deepest common entry node)
+// - a candidate with two visible children is split while the cut has room (TILE_CUT_MAX roots)
+// - candidates whose children are both outside are dropped
+// Children keep the near / far order of the tile's center ray, so the roots are front to back.
+// Rays of the tile then start at these roots instead of the root (ray_bvh_intersect_subtrees() in
+// hit.c, ray_packet_intersect_subtrees()), skipping the top levels and the nodes outside the tile.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    Vec3 apex;
+    Vec3 normals[4]; // inward side planes through the apex
+} TileFrustum;
+
+// 0 if the box is fully outside one side plane (the test is conservative, boxes near an edge stay in)
+static int frustum_box_visible(const TileFrustum *frustum, AABB box)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        Vec3 n = frustum->normals[i];
+        Vec3 farthest = {
+            n.x >= 0.0f ? box.max.x : box.min.x,
+            n.y >= 0.0f ? box.max.y : box.min.y,
+            n.z >= 0.0f ? box.max.z : box.min.z};
+        if (vec3_dot(n, vec3_sub(farthest, frustum->apex)) < 0.0f)
+            return 0;
+    }
+    return 1;
+}
+
+// Cut of the BVH for the rays get_camera_ray(camera, u, v) with u in [u0, u1] and v in [v0, v1]
+void tile_cut_build(const BVH *bvh, Camera *camera, float u0, float v0, float u1, float v1, TileCut *cut)
+{
+    cut->count = 0;
+    if (bvh->node_count == 0)
+        return;
+
+    Ray corners[4] = {
+        get_camera_ray(camera, u0, v0),
+        get_camera_ray(camera, u1, v0),
+        get_camera_ray(camera, u1, v1),
+        get_camera_ray(camera, u0, v1)};
+    Ray center = get_camera_ray(camera, 0.5f * (u0 + u1), 0.5f * (v0 + v1));
+
+    TileFrustum frustum;
+    frustum.apex = camera->position;
+    for (int i = 0; i < 4; i++)
+    {
+        Vec3 n = vec3_cross(corners[i].direction, corners[(i + 1) % 4].direction);
+        frustum.normals[i] = vec3_dot(n, center.direction) < 0.0f ? vec3_multiply(n, -1.0f) : n;
+    }
+
+    if (!frustum_box_visible(&frustum, bvh->nodes[0].bounds))
+        return;
+
+    const float direction[3] = {center.direction.x, center.direction.y, center.direction.z};
+    cut->roots[cut->count++] = 0;
+    int changed = 1;
+    while (changed)
+    {
+        changed = 0;
+        for (int i = 0; i < cut->count; i++)
+        {
+            uint32_t index = cut->roots[i];
+            const BVHFlatNode *node = &bvh->nodes[index];
+            if (node->count)
+                continue;
+
+            uint32_t near = index + 1, far = node->right_or_first;
+            if ((direction[node->axis] < 0.0f) != node->axis_flip)
+            {
+                near = node->right_or_first;
+                far = index + 1;
+            }
+            int near_visible = frustum_box_visible(&frustum, bvh->nodes[near].bounds);
+            int far_visible = frustum_box_visible(&frustum, bvh->nodes[far].bounds);
+
+            if (near_visible && far_visible)
+            {
+                if (cut->count == TILE_CUT_MAX)
+                    continue;
+                for (int j = cut->count; j > i + 1; j--)
+                    cut->roots[j] = cut->roots[j - 1];
+                cut->roots[i] = near;
+                cut->roots[i + 1] = far;
+                cut->count++;
+            }
+            else if (near_visible || far_visible)
+            {
+                // Same slot, looked at again
+                cut->roots[i--] = near_visible ? near : far;
+            }
+            else
+            {
+                for (int j = i; j < cut->count - 1; j++)
+                    cut->roots[j] = cut->roots[j + 1];
+                cut->count--;
+                i--;
+            }
+            changed = 1;
+        }
+    }
+}